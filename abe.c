@@ -9,6 +9,7 @@ static char	_Copyright[] = "Copyright 2008-2017 Dale Schumacher";
 
 #include <getopt.h>
 #include "abe.h"
+#include "arena.h"
 #include "sample.h"
 
 /*#include <unistd.h>*/
@@ -85,7 +86,7 @@ void
 usage(void)
 {
 	fprintf(stderr, "\
-usage: %s [-ts] [-n count] [-# dbug] filename ...\n",
+usage: %s [-tsP] [-n count] [-S stats-file] [-H cells] [-G percent] [-C kbytes] [-# dbug] filename ...\n",
 		_Program);
 	exit(EXIT_FAILURE);
 }
@@ -101,14 +102,23 @@ main(int argc, char** argv)
 {
 	int c;
 	int	counter = 5;			/* default 5 second counter for ticker */
+	long heap_cells = 0;		/* cells to pre-allocate */
+	long commit_kb = 0;			/* arena commit size (0 = default) */
+	BOOL huge_pages = FALSE;	/* flag to advise huge pages */
+	char* stats_file = NULL;	/* file to write GC statistics to at exit */
 
 	DBUG_ENTER("main");
 	DBUG_PROCESS(argv[0]);
-	while ((c = getopt(argc, argv, "tsn:#:V")) != EOF) {
+	while ((c = getopt(argc, argv, "tsPS:n:H:G:C:#:V")) != EOF) {
 		switch(c) {
 		case 't':	test_mode = TRUE;		break;
 		case 's':	init_sample = TRUE;		break;
+		case 'P':	huge_pages = TRUE;		break;
+		case 'S':	stats_file = optarg;	break;
 		case 'n':	counter = atoi(optarg);	break;
+		case 'H':	heap_cells = atol(optarg);	break;
+		case 'G':	gc_set_heap_growth(atol(optarg));	break;
+		case 'C':	commit_kb = atol(optarg);	break;
 		case '#':	DBUG_PUSH(optarg);		break;
 		case 'V':	banner();				exit(EXIT_SUCCESS);
 		case '?':							usage();
@@ -116,14 +126,22 @@ main(int argc, char** argv)
 		}
 	}
 	banner();
+	if ((commit_kb > 0) || huge_pages) {
+		arena_set_commit((commit_kb > 0) ? ((size_t)commit_kb << 10) : ARENA_COMMIT, huge_pages);
+	}
+	if (heap_cells > 0) {
+		gc_presize_heap(heap_cells);	/* avoid growth stalls */
+	}
 	if (test_mode) {
 		DBUG_PRINT("", ("_nilp()@%p, main()@%p", _nilp, main));
 		test_pre();
 		test_number();
+		test_arena();
 		test_gc();
 		test_cons();
 		test_atom();
 		test_emit();
+		test_actor();
 	}
 	if (init_sample) {
 		int limit = 100;
@@ -152,5 +170,15 @@ main(int argc, char** argv)
 		report_actor_usage(cfg);
 	}
 	report_cons_stats();
+	if (stats_file != NULL) {
+		FILE* f = fopen(stats_file, "w");
+
+		if (f == NULL) {
+			perror(stats_file);
+		} else {
+			gc_dump_stats(f);	/* JSON */
+			fclose(f);
+		}
+	}
 	DBUG_RETURN (exit(EXIT_SUCCESS), 0);
 }
@@ -3,9 +3,23 @@
  *
  * Copyright 2008-2017 Dale Schumacher.  ALL RIGHTS RESERVED.
  */
-#include <sys/time.h>		/* gettimeofday(), struct timeval */
+#define	_GNU_SOURCE		/* for sysconf(), clock_gettime() */
+#include <time.h>			/* clock_gettime(), struct timespec */
+#include <unistd.h>			/* getpid(), sysconf() */
+#include <limits.h>			/* INT_MAX */
+#include <pthread.h>
 #include "actor.h"
 #include "abe.h"
+#if ACTOR_WORK_STEALING
+#include <sched.h>			/* sched_yield() */
+#endif
+
+#if ACTOR_WORK_STEALING && GC_PACKED_HEAP
+#error "ACTOR_WORK_STEALING requires the treadmill heap (thread allocation buffers)"
+#endif
+#if ACTOR_WORK_STEALING && !defined(DBUG_OFF)
+#error "ACTOR_WORK_STEALING requires DBUG_OFF (dbug keeps a single call stack)"
+#endif
 
 #include "dbug.h"
 DBUG_UNIT("actor");
@@ -104,98 +118,366 @@ BEH_DECL(assert_msg)
 	DBUG_RETURN;
 }
 
-static CONS*	free_config = NIL;			/* list of available recycleable cells */
-static int		free_config_cnt = 0;		/* number of recycleable cells allocated now */
-static int		free_config_max = 0;		/* peak number of recycleable cells allocated */
+#define	TV_BOX_BITS		30			/* bits in the low half of a boxed time */
 
-static CONS*
-cq_cons(CONS* a, CONS* d)	/* allocate recycleable cell */
+CONS*
+tv_box(WORD t)
+/*
+ * Box a time (nanoseconds since the epoch) as a pair of numbers
+ */
 {
-	CONS* p;
+	return cons(NUMBER(t >> TV_BOX_BITS), NUMBER(t & ((as_word(1) << TV_BOX_BITS) - 1)));
+}
 
-	XDBUG_ENTER("cq_cons");
-	if (!nilp(free_config)) {
-		assert(consp(free_config));
-		p = free_config;
-		free_config = cdr(p);
-		rplaca(p, a);
-		rplacd(p, d);
-	} else {
-		p = gc_perm(a, d);		/* non-garbage-collected cell allocation */
+WORD
+tv_unbox(CONS* t)
+/*
+ * Recover a time (nanoseconds since the epoch) boxed by tv_box()
+ */
+{
+	assert(consp(t));
+	return (as_word(MK_INT(car(t))) << TV_BOX_BITS) | as_word(MK_INT(cdr(t)));
+}
+
+#define	Q_RING_MIN		16		/* initial number of message queue slots (power of 2) */
+#define	Q_SLOT(cfg,i)	(((cfg)->q_head + (i)) & ((cfg)->q_size - 1))
+
+static void
+cfg_reserve_messages(CONFIG* cfg, int n)
+/*
+ * Grow the message queue of <cfg> until <n> more messages fit.
+ */
+{
+	MESSAGE* ring;
+	int size;
+	int i;
+
+	if ((cfg->q_count + n) <= cfg->q_size) {
+		return;
+	}
+	size = (cfg->q_size > 0) ? cfg->q_size : Q_RING_MIN;
+	while (size < (cfg->q_count + n)) {
+		size <<= 1;
 	}
-	if (++free_config_cnt > free_config_max) {
-		free_config_max = free_config_cnt;
+	ring = NEWxN(MESSAGE, size);
+	assert(ring != NULL);
+	for (i = 0; i < cfg->q_count; ++i) {	/* unwrap, oldest first */
+		ring[i] = cfg->q_ring[Q_SLOT(cfg, i)];
 	}
-	XDBUG_RETURN p;
+	FREE(cfg->q_ring);
+	cfg->q_ring = ring;
+	cfg->q_size = size;
+	cfg->q_head = 0;
 }
 
-static CONS*
-cq_free(CONS* p)				/* recycle cell */
+static void
+cfg_put_message(CONFIG* cfg, CONS* target, CONS* msg)
+/* add a message at the end of the queue of <cfg> */
 {
-	XDBUG_ENTER("cq_free");
-	if (!nilp(p)) {
-		rplaca(p, NIL);
-		rplacd(p, free_config);
-		free_config = p;
-		--free_config_cnt;
-	} else {
-		DBUG_PRINT("cq_free", ("ALERT! cq_free(NIL)"));
+	MESSAGE* m;
+
+	if (cfg->q_count >= cfg->q_size) {
+		cfg_reserve_messages(cfg, 1);
 	}
-	XDBUG_RETURN NIL;
+	m = &cfg->q_ring[Q_SLOT(cfg, cfg->q_count)];
+	m->target = target;
+	m->msg = msg;
+	++cfg->q_count;
 }
 
-CONS*
-tv_create(time_t s, time_t us)
-/*
- * Create a time tuple from raw time components (seconds and microseconds)
- */
+static BOOL
+cfg_take_message(CONFIG* cfg, MESSAGE* m)
+/* take the oldest message from the queue of <cfg>, FALSE if empty */
 {
-	CONS* t = NIL;
-	while (us > TICK_FREQ) {	/* normalize seconds */
-		++s;
-		us -= TICK_FREQ;
+	if (cfg->q_count <= 0) {
+		return FALSE;
 	}
-	t = map_put(t, ATOM("us"), NUMBER(us));
-	t = map_put(t, ATOM("s"), NUMBER(s));
-	return t;
-/*
-	return cons(cons(ATOM("s"), NUMBER(tv->tv_sec)),
-			cons(cons(ATOM("us"), NUMBER(tv->tv_usec)), NIL));
-*/
+	*m = cfg->q_ring[cfg->q_head];
+	cfg->q_head = Q_SLOT(cfg, 1);
+	--cfg->q_count;
+	return TRUE;
 }
 
-CONS*
-tv_increment(time_t s, time_t us, time_t d)
 /*
- * Create a time tuple offset by d ticks (usecs) from raw time components
+ * Delayed messages wait in a hierarchical timing wheel. Each level has
+ * WHEEL_SLOTS slots, and each slot covers WHEEL_SLOTS times the ticks of
+ * a slot on the level below. A timer is linked into the level of the
+ * highest bit in which its delivery time differs from the wheel time,
+ * so it moves down at most once per level as the wheel time advances.
+ * Timer records are linked by index, and a handle holds the index and
+ * generation of the record, so a stale handle is never mistaken.
  */
+#define	WHEEL_BITS		6						/* log2(WHEEL_SLOTS) */
+#define	WHEEL_SLOTS		(1 << WHEEL_BITS)		/* one bit per slot in a ulint */
+#define	WHEEL_LEVELS	((64 + WHEEL_BITS - 1) / WHEEL_BITS)	/* covers 64-bit times */
+#define	WHEEL_MASK		as_word(WHEEL_SLOTS - 1)
+#define	WHEEL_NONE		(-1)					/* end of list / unscheduled */
+#define	TIMER_POOL_MIN	16						/* initial number of timer records */
+#define	TIMER_HANDLE(i,g)	((as_word(g) << 32) | as_word(i))
+
+typedef struct timer TIMER;
+struct timer {
+	int		next;		/* next timer in the slot (or free list) */
+	int		prev;		/* previous timer in the slot */
+	int		slot;		/* level * WHEEL_SLOTS + slot, or WHEEL_NONE */
+	int		gen;		/* advanced whenever the record is released */
+	WORD	due;		/* delivery time (ticks since the epoch) */
+	MESSAGE	m;			/* delayed message */
+};
+
+struct timer_wheel {
+	WORD	now;							/* wheel time (ticks since the epoch) */
+	ulint	busy[WHEEL_LEVELS];				/* one bit per non-empty slot */
+	int		head[WHEEL_LEVELS * WHEEL_SLOTS];	/* first timer of each slot */
+	TIMER*	pool;							/* timer records */
+	int		pool_cnt;						/* records used (scheduled or free) */
+	int		pool_max;						/* records allocated */
+	int		free;							/* first free record */
+};
+
+static TIMER_WHEEL*
+wheel_new(WORD now)
+/* create an empty timing wheel, starting at time <now> */
 {
-	while (d > TICK_FREQ) {	/* avoid overflow */
-		++s;
-		d -= TICK_FREQ;
+	TIMER_WHEEL* w;
+	int i;
+
+	w = NEW(TIMER_WHEEL);
+	assert(w != NULL);
+	w->now = now;
+	for (i = 0; i < (WHEEL_LEVELS * WHEEL_SLOTS); ++i) {
+		w->head[i] = WHEEL_NONE;
 	}
-	return tv_create(s, us + d);
+	w->pool = NULL;
+	w->pool_cnt = 0;
+	w->pool_max = 0;
+	w->free = WHEEL_NONE;
+	return w;
 }
 
-int
-tv_compare(time_t t0s, time_t t0us, time_t t1s, time_t t1us)
+static int
+wheel_alloc(TIMER_WHEEL* w)
+/* take an unscheduled timer record */
+{
+	TIMER* pool;
+	int i;
+
+	if (w->free != WHEEL_NONE) {
+		i = w->free;
+		w->free = w->pool[i].next;
+		return i;
+	}
+	if (w->pool_cnt >= w->pool_max) {
+		i = (w->pool_max > 0) ? (2 * w->pool_max) : TIMER_POOL_MIN;
+		pool = (TIMER*)realloc(w->pool, i * sizeof(TIMER));
+		assert(pool != NULL);
+		w->pool = pool;
+		w->pool_max = i;
+	}
+	i = w->pool_cnt++;
+	w->pool[i].gen = 1;
+	w->pool[i].slot = WHEEL_NONE;
+	return i;
+}
+
+static void
+wheel_release(TIMER_WHEEL* w, int i)
+/* return timer record <i> to the free list, invalidating its handle */
+{
+	TIMER* t = &w->pool[i];
+
+	t->slot = WHEEL_NONE;
+	++t->gen;
+	t->m.target = NIL;
+	t->m.msg = NIL;
+	t->next = w->free;
+	w->free = i;
+}
+
+static void
+wheel_link(TIMER_WHEEL* w, int i)
+/* schedule timer record <i>, due after the wheel time */
+{
+	TIMER* t = &w->pool[i];
+	ulint x = (ulint)(t->due ^ w->now);
+	int level;
+	int slot;
+
+	assert(t->due > w->now);
+	level = (((int)(8 * sizeof(ulint)) - 1) - __builtin_clzl(x)) / WHEEL_BITS;
+	slot = (int)((t->due >> (level * WHEEL_BITS)) & WHEEL_MASK);
+	w->busy[level] |= (1UL << slot);
+	slot += level * WHEEL_SLOTS;
+	t->slot = slot;
+	t->prev = WHEEL_NONE;
+	t->next = w->head[slot];
+	if (t->next != WHEEL_NONE) {
+		w->pool[t->next].prev = i;
+	}
+	w->head[slot] = i;
+}
+
+static void
+wheel_unlink(TIMER_WHEEL* w, int i)
+/* remove scheduled timer record <i> from its slot */
+{
+	TIMER* t = &w->pool[i];
+	int slot = t->slot;
+
+	if (t->prev != WHEEL_NONE) {
+		w->pool[t->prev].next = t->next;
+	} else {
+		w->head[slot] = t->next;
+		if (t->next == WHEEL_NONE) {
+			w->busy[slot / WHEEL_SLOTS] &= ~(1UL << (slot % WHEEL_SLOTS));
+		}
+	}
+	if (t->next != WHEEL_NONE) {
+		w->pool[t->next].prev = t->prev;
+	}
+	t->slot = WHEEL_NONE;
+}
+
+static void
+wheel_advance(TIMER_WHEEL* w, WORD now, CONFIG* cfg)
+/* advance the wheel time to <now>, sending each delayed message that comes due to <cfg> */
+{
+	int pending = WHEEL_NONE;
+	ulint a;
+	ulint b;
+	ulint mask;
+	int shift;
+	int level;
+	int slot;
+	int i;
+
+	if (now <= w->now) {
+		return;
+	}
+	for (level = 0; level < WHEEL_LEVELS; ++level) {
+		shift = level * WHEEL_BITS;
+		a = (ulint)w->now >> shift;
+		b = (ulint)now >> shift;
+		if (a == b) {
+			break;				/* no slot passed here, or above */
+		}
+		if ((b - a) >= WHEEL_SLOTS) {
+			mask = ~0UL;		/* the whole level passed */
+		} else {
+			mask = (1UL << (b - a)) - 1;	/* slots a+1 .. b, rotated */
+			shift = (int)((a + 1) & WHEEL_MASK);
+			if (shift != 0) {
+				mask = (mask << shift) | (mask >> (WHEEL_SLOTS - shift));
+			}
+		}
+		mask &= w->busy[level];
+		w->busy[level] &= ~mask;
+		while (mask != 0) {
+			slot = __builtin_ctzl(mask);
+			mask &= (mask - 1);
+			slot += level * WHEEL_SLOTS;
+			while ((i = w->head[slot]) != WHEEL_NONE) {	/* move to pending */
+				w->head[slot] = w->pool[i].next;
+				w->pool[i].next = pending;
+				pending = i;
+			}
+		}
+	}
+	w->now = now;
+	while ((i = pending) != WHEEL_NONE) {
+		TIMER* t = &w->pool[i];
+
+		pending = t->next;
+		if (t->due > now) {
+			wheel_link(w, i);	/* move down to a finer level */
+		} else {
+			--cfg->t_count;
+			abe__send(cfg, t->m.target, t->m.msg);
+			wheel_release(w, i);
+		}
+	}
+}
+
+static void
+cfg_visit_roots(void* ctx, GC_VISIT visit)
 /*
- * Compare raw time components(return: -1 if t0<t1, 0 if t0==t1, 1 if t0>t1)
+ * Visit the registered roots, the message being delivered,
+ * pending messages, and delayed messages of a configuration.
  */
 {
-	if (t0s < t1s) {
-		return -1;
+	CONFIG* cfg = (CONFIG*)ctx;
+	MESSAGE* m;
+	POST* p;
+	TIMER* t;
+	int i;
+
+	for (i = 0; i < cfg->gc_root_cnt; ++i) {
+		(*visit)(cfg->gc_roots[i]);		/* free slots hold numbers */
 	}
-	if (t0s > t1s) {
-		return 1;
+	(*visit)(cfg->q_entry.target);
+	(*visit)(cfg->q_entry.msg);
+	for (i = 0; i < cfg->q_count; ++i) {
+		m = &cfg->q_ring[Q_SLOT(cfg, i)];
+		(*visit)(m->target);
+		(*visit)(m->msg);
 	}
-	if (t0us < t1us) {
-		return -1;
+	for (p = cfg->in_tail; p != NULL; p = p->next) {
+		if (p != &cfg->in_stub) {
+			(*visit)(p->m.target);
+			(*visit)(p->m.msg);
+		}
 	}
-	if (t0us > t1us) {
-		return 1;
+	for (i = 0; i < cfg->t_wheel->pool_cnt; ++i) {
+		t = &cfg->t_wheel->pool[i];
+		if (t->slot != WHEEL_NONE) {
+			(*visit)(t->m.target);
+			(*visit)(t->m.msg);
+		}
 	}
-	return 0;
+}
+
+#define	cfg_now(cfg)	((cfg)->t_now / NS_PER_TICK)	/* cached time in ticks */
+
+static WORD
+clock_now()
+/* read the monotonic clock (nanoseconds), 0 if unavailable */
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		return 0;
+	}
+	return (as_word(ts.tv_sec) * NS_PER_SEC) + as_word(ts.tv_nsec);
+}
+
+static void
+cfg_initialize(CONFIG* cfg, int q_limit)
+/*
+ * Set up an empty configuration, and register its roots.
+ */
+{
+	cfg->q_ring = NULL;
+	cfg->q_size = 0;
+	cfg->q_head = 0;
+	cfg->gc_roots = NULL;
+	cfg->gc_root_cnt = 0;
+	cfg->gc_root_max = 0;
+	cfg->gc_root_free = -1;
+	cfg->q_count = 0;
+	cfg->q_entry.target = NIL;
+	cfg->q_entry.msg = NIL;
+	cfg->msg_cnt_hi = 0;
+	cfg->msg_cnt_lo = 0;
+	cfg->q_limit = q_limit;
+	cfg->t_epoch = clock_now();
+	cfg->t_now = 0;
+	DBUG_PRINT("timer", ("epoch=%ldns", cfg->t_epoch));
+	cfg->t_wheel = wheel_new(cfg_now(cfg));
+	cfg->t_count = 0;
+	cfg->in_stub.next = NULL;
+	cfg->in_head = &cfg->in_stub;
+	cfg->in_tail = &cfg->in_stub;
+	gc_add_roots(cfg_visit_roots, cfg);
 }
 
 CONFIG*
@@ -205,86 +487,56 @@ new_configuration(int q_limit)
  */
 {
 	CONFIG* cfg = NULL;
-	CELL* cell;
-	CONS* cq;
-	struct timeval tv;
 
 	DBUG_ENTER("new_configuration");
 	cfg = NEW(CONFIG);
 	assert(cfg != NULL);
-	cell = as_cell(cfg);
-	cq = CONFIG_QUEUE(cfg);
-	assert(consp(cq));
-	GC_SET_FIRST(cell, NIL);
-	GC_SET_REST(cell, NIL);
-	GC_SET_PREV(cell, cell);
-	GC_SET_NEXT(cell, cell);
-	cfg->gc_root = NIL;
-	cfg->q_count = 0;
-	cfg->q_entry = NIL;
-	cfg->msg_cnt_hi = 0;
-	cfg->msg_cnt_lo = 0;
-	cfg->q_limit = q_limit;
-	if (gettimeofday(&tv, NULL) == 0) {
-		cfg->t_epoch = tv.tv_sec;
-		DBUG_PRINT("timer", ("epoch=%d", cfg->t_epoch));
-		cfg->t_now_s = (tv.tv_sec - cfg->t_epoch);
-		cfg->t_now_us = tv.tv_usec;
-		DBUG_PRINT("timer", ("t = %lus %luus", cfg->t_now_s, cfg->t_now_us));
-	}
-	cfg->t_queue = NIL;
-	cfg->t_count = 0;
+	cfg_initialize(cfg, q_limit);
 	DBUG_RETURN cfg;
 }
 
-void
+int
 cfg_add_gc_root(CONFIG* cfg, CONS* root)
 /*
- * Add root to list of references preserved during garbage-collection.
+ * Add root to the references preserved during garbage-collection.
+ * Returns a handle for cfg_remove_gc_root().
  */
 {
+	CONS** roots;
+	int n;
+
 	DBUG_ENTER("cfg_add_gc_root");
 	DBUG_PRINT("", ("root=@%p", root));
-	cfg->gc_root = cons(root, cfg->gc_root);
-	DBUG_RETURN;
+	if (cfg->gc_root_free >= 0) {		/* reuse a free slot */
+		n = cfg->gc_root_free;
+		cfg->gc_root_free = MK_INT(cfg->gc_roots[n]);
+	} else {
+		if (cfg->gc_root_cnt >= cfg->gc_root_max) {
+			n = (cfg->gc_root_max > 0) ? (2 * cfg->gc_root_max) : 16;
+			roots = (CONS**)realloc(cfg->gc_roots, n * sizeof(CONS*));
+			assert(roots != NULL);
+			cfg->gc_roots = roots;
+			cfg->gc_root_max = n;
+		}
+		n = cfg->gc_root_cnt++;
+	}
+	cfg->gc_roots[n] = root;
+	DBUG_PRINT("", ("handle=%d", n));
+	DBUG_RETURN n;
 }
 
-static CONS*
-cfg_gather_roots(CONFIG* cfg)
+void
+cfg_remove_gc_root(CONFIG* cfg, int handle)
+/*
+ * Remove a root added by cfg_add_gc_root(), its slot is reused.
+ */
 {
-	CONS* root;
-	CONS* node;
-	CONS* entry;
-	int n;
-
-	DBUG_ENTER("cfg_gather_roots");
-	root = cfg->gc_root;
-	DBUG_PRINT("", ("length(gc_root)=%d", length(root)));
-	/* protect pending messages */
-	n = 0;
-	node = CQ_PEEK(CONFIG_QUEUE(cfg));
-	while (!nilp(node)) {
-		entry = car(node);					/* entry is a permanent cell */
-		root = cons(cdr(entry), root);		/* add message to root list */
-		root = cons(car(entry), root);		/* add actor to root list */
-		node = cdr(node);
-		++n;
-	}
-	DBUG_PRINT("", ("n=%d q_count=%d", n, cfg->q_count));
-	assert(n == cfg->q_count);
-	/* protect delayed messages */
-	n = 0;
-	node = cfg->t_queue;
-	while (!nilp(node)) {
-		entry = cdr(car(node));				/* entry is a permanent cell */
-		root = cons(cdr(entry), root);		/* add message to root list */
-		root = cons(car(entry), root);		/* add actor to root list */
-		node = cdr(node);
-		++n;
-	}
-	DBUG_PRINT("", ("n=%d t_count=%d", n, cfg->t_count));
-	assert(n == cfg->t_count);
-	DBUG_RETURN root;
+	DBUG_ENTER("cfg_remove_gc_root");
+	DBUG_PRINT("", ("handle=%d", handle));
+	assert((handle >= 0) && (handle < cfg->gc_root_cnt));
+	cfg->gc_roots[handle] = NUMBER(cfg->gc_root_free);
+	cfg->gc_root_free = handle;
+	DBUG_RETURN;
 }
 
 void
@@ -293,27 +545,79 @@ cfg_force_gc(CONFIG* cfg)
  * Force immediate garbage-collection. (WARNING: NOT CONCURRENT!)
  */
 {
-	CONS* root;
-
 	DBUG_ENTER("cfg_force_gc");
-	root = cfg_gather_roots(cfg);
-	DBUG_PRINT("", ("length(root)=%d", length(root)));
-	gc_full_collection(root);
+	DBUG_PRINT("", ("roots=%d q_count=%d t_count=%d",
+		cfg->gc_root_cnt, cfg->q_count, cfg->t_count));
+	gc_full_collection(NIL);	/* the configuration is a registered root set */
 	DBUG_RETURN;
 }
 
 void
-cfg_start_gc(CONFIG* cfg)
+cfg_compact_gc(CONFIG* cfg)
 /*
- * Start concurrent actor-based garbage-collection process.
+ * Force immediate garbage-collection, moving live cells together.
+ * References held in C variables must be registered as gc roots,
+ * which keeps them from moving. (WARNING: NOT CONCURRENT!)
  */
 {
+	DBUG_ENTER("cfg_compact_gc");
+	DBUG_PRINT("", ("roots=%d q_count=%d t_count=%d",
+		cfg->gc_root_cnt, cfg->q_count, cfg->t_count));
+	gc_compact_collection(NIL, NIL);	/* root sets are pinned */
+	DBUG_RETURN;
+}
+
+static CONS*	cfg_snap__roots;	/* root list built by cfg_list_root() */
+
+static void
+cfg_list_root(CONS* value)
+{
+	cfg_snap__roots = cons(value, cfg_snap__roots);
+}
+
+BOOL
+cfg_snapshot(CONFIG* cfg, char* path)
+/*
+ * Write a heap snapshot to <path> (or a new "abe-<pid>-<n>.heap" file
+ * if <path> is NULL), see gc_write_snapshot(). (WARNING: NOT CONCURRENT!)
+ */
+{
+	static int snap_cnt = 0;
+	char name[64];
 	CONS* root;
+	FILE* f;
+	BOOL ok;
 
+	DBUG_ENTER("cfg_snapshot");
+	if (path == NULL) {
+		sprintf(name, "abe-%ld-%d.heap", (long)getpid(), ++snap_cnt);
+		path = name;
+	}
+	cfg_snap__roots = NIL;
+	cfg_visit_roots(cfg, cfg_list_root);	/* the snapshot records one root */
+	root = cfg_snap__roots;
+	cfg_snap__roots = NIL;
+	f = fopen(path, "wb");
+	ok = (f != NULL) && gc_write_snapshot(f, root);
+	if ((f != NULL) && (fclose(f) != 0)) {
+		ok = FALSE;
+	}
+	DBUG_PRINT("", ("path=%s ok=%d", path, ok));
+	fprintf(stderr, (ok ? "heap snapshot written to %s\n"
+		: "=ERROR= unable to write heap snapshot %s\n"), path);
+	DBUG_RETURN ok;
+}
+
+void
+cfg_start_gc(CONFIG* cfg)
+/*
+ * Start concurrent actor-based garbage-collection process.
+ */
+{
 	DBUG_ENTER("cfg_start_gc");
-	root = cfg_gather_roots(cfg);
-	DBUG_PRINT("", ("length(root)=%d", length(root)));
-	gc_actor_collection(cfg, root);
+	DBUG_PRINT("", ("roots=%d q_count=%d t_count=%d",
+		cfg->gc_root_cnt, cfg->q_count, cfg->t_count));
+	gc_actor_collection(cfg, NIL);	/* the configuration is a registered root set */
 	DBUG_RETURN;
 }
 
@@ -347,55 +651,255 @@ abe__become(CONS* self, BEH beh, CONS* state)
 	DBUG_RETURN self;
 }
 
+WORD
+abe__now(CONFIG* cfg)
+/*
+ * Refresh the current time of a configuration (nanoseconds since its creation).
+ */
+{
+	WORD t = clock_now() - cfg->t_epoch;
+
+	if (t > cfg->t_now) {		/* never goes backward */
+		cfg->t_now = t;
+	}
+	return cfg->t_now;
+}
+
+void
+abe__finalize(CONFIG* cfg, CONS* cell, BEH beh, CONS* state)
+/*
+ * Once <cell> becomes unreachable, send #finalize
+ * to a new actor with the specified state/behavior.
+ */
+{
+	DBUG_ENTER("finalize");
+	DBUG_PRINT("", ("cell=@%p beh=@%p", cell, beh));
+	gc_finalize(cell, MK_FUNC(beh), state);
+	DBUG_RETURN;
+}
+
+static void
+cfg_run_finalizers(CONFIG* cfg)
+/*
+ * Send #finalize to a new actor for each cell found unreachable.
+ */
+{
+	CONS* beh;
+	CONS* state;
+
+	DBUG_ENTER("cfg_run_finalizers");
+	while (gc_next_finalizer(&beh, &state)) {
+		CFG_SEND(cfg, CFG_ACTOR(cfg, MK_BEH(beh), state), ATOM("finalize"));
+	}
+	DBUG_RETURN;
+}
+
+#if ACTOR_WORK_STEALING
+
+/*
+ * Each dispatch thread owns a worker, whose private configuration holds
+ * the messages sent by the behaviors it runs (delayed messages are kept
+ * by the shared configuration, under the timer lock).
+ * The owner takes the oldest entry of its queue, and an idle thread steals
+ * the oldest entry of another queue, both under the queue lock.
+ */
+typedef struct actor_worker WORKER;
+struct actor_worker {
+	CONFIG			cfg;			/* must be first, see cfg_worker() */
+	pthread_mutex_t	lock;			/* guards the queue of <cfg> */
+	int				delivered;		/* messages delivered this round */
+	int				round;			/* last round started */
+	int				id;
+	pthread_t		thread;
+};
+
+static ACTOR_LOCAL WORKER*	actor_worker__self = NULL;	/* worker of the calling thread */
+static volatile int			actor_round__queued = 0;	/* messages waiting in all queues */
+static CONFIG*				actor_round__cfg = NULL;	/* configuration being dispatched */
+static pthread_mutex_t		actor_timer__lock = PTHREAD_MUTEX_INITIALIZER;	/* guards its timers */
+
+#define	cfg_worker(cfg)	(((actor_worker__self != NULL) \
+						&& ((cfg) == &actor_worker__self->cfg)) ? actor_worker__self : NULL)
+
+static BOOL
+cfg_take_entry(WORKER* w, MESSAGE* m)
+/* take the oldest message from the queue of <w>, FALSE if empty */
+{
+	BOOL taken;
+
+	pthread_mutex_lock(&w->lock);
+	taken = cfg_take_message(&w->cfg, m);
+	pthread_mutex_unlock(&w->lock);
+	return taken;
+}
+
+static void
+cfg_put_entry(WORKER* w, CONS* target, CONS* msg)
+/* add a message at the end of the queue of <w> */
+{
+	pthread_mutex_lock(&w->lock);
+	cfg_put_message(&w->cfg, target, msg);
+	pthread_mutex_unlock(&w->lock);
+}
+
+#endif /* ACTOR_WORK_STEALING */
+
 void
 abe__send(CONFIG* cfg, CONS* target, CONS* msg)
 /*
  * Queue an asynchronous message for the target actor.
  */
 {
-	CONS* entry = NIL;
-	CONS* cq = CONFIG_QUEUE(cfg);
+#if ACTOR_WORK_STEALING
+	WORKER* w = cfg_worker(cfg);
+#endif
 
 	DBUG_ENTER("send");
 	DBUG_PRINT("", ("target=%s", cons_to_str(target)));
 	assert(actorp(target));
 	DBUG_PRINT("", ("msg=%s", cons_to_str(msg)));
-	entry = cq_cons(target, msg);
-	CQ_PUT(cq, cq_cons(entry, NIL));
-	XDBUG_PRINT("", ("queue=%s", cons_to_str(CQ_PEEK(cq))));
-	++cfg->q_count;
+#if ACTOR_WORK_STEALING
+	if (w != NULL) {		/* sent during a round, other threads may steal it */
+		cfg_put_entry(w, target, msg);
+		__sync_fetch_and_add(&actor_round__queued, 1);
+		DBUG_RETURN;
+	}
+#endif
+	cfg_put_message(cfg, target, msg);
 	DBUG_PRINT("", ("%d message(s) queued", cfg->q_count));
 	DBUG_RETURN;
 }
 
+void
+abe__send_batch(CONFIG* cfg, MESSAGE* batch, int n)
+/*
+ * Queue <n> asynchronous messages, in order, making room for all of them at once.
+ */
+{
+	int i;
+#if ACTOR_WORK_STEALING
+	WORKER* w = cfg_worker(cfg);
+#endif
+
+	DBUG_ENTER("send_batch");
+	DBUG_PRINT("", ("n=%d", n));
+#if ACTOR_WORK_STEALING
+	if (w != NULL) {		/* sent during a round, other threads may steal them */
+		pthread_mutex_lock(&w->lock);
+	}
+#endif
+	cfg_reserve_messages(cfg, n);
+	for (i = 0; i < n; ++i) {
+		assert(actorp(batch[i].target));
+		cfg->q_ring[Q_SLOT(cfg, cfg->q_count)] = batch[i];
+		++cfg->q_count;
+	}
+#if ACTOR_WORK_STEALING
+	if (w != NULL) {
+		pthread_mutex_unlock(&w->lock);
+		__sync_fetch_and_add(&actor_round__queued, n);
+	}
+#endif
+	DBUG_PRINT("", ("%d message(s) queued", cfg->q_count));
+	DBUG_RETURN;
+}
+
+/*
+ * Messages posted by other threads are linked into an intrusive
+ * multi-producer/single-consumer list (after Dmitry Vyukov).
+ * A producer swaps itself in as the newest post, then links the previous
+ * newest to it. The dispatch thread alone unlinks the oldest posts
+ * and adds them to the message queue.
+ */
 static void
-t_queue_insert(CONS** qp, CONS* t, time_t t0s, time_t t0us)
+cfg_link_post(CONFIG* cfg, POST* p)
+/* make <p> the newest post of <cfg> (any thread) */
 {
-	time_t t1s;
-	time_t t1us;
+	POST* prev;
 
-	/* FIXME: this method abuses knowledge of t_queue representation */
-	while (!nilp(*qp)) {
-		CONS* m = (*qp)->first->first;
-		t1s = MK_INT(map_get_def(m, ATOM("s"), NUMBER(0)));
-		t1us = MK_INT(map_get_def(m, ATOM("us"), NUMBER(0)));
-		if (tv_compare(t0s, t0us, t1s, t1us) > 0) {
-			break;
+	p->next = NULL;
+	__sync_synchronize();		/* publish <p> before it can be reached */
+	prev = __sync_lock_test_and_set(&cfg->in_head, p);
+	prev->next = p;
+}
+
+static POST*
+cfg_take_post(CONFIG* cfg)
+/* unlink the oldest post of <cfg>, NULL if none (or one is still being linked) */
+{
+	POST* tail = cfg->in_tail;
+	POST* next = tail->next;
+
+	if (tail == &cfg->in_stub) {
+		if (next == NULL) {
+			return NULL;
 		}
-		qp = &((*qp)->rest);
+		cfg->in_tail = next;
+		tail = next;
+		next = next->next;
+	}
+	if (next != NULL) {
+		cfg->in_tail = next;
+		return tail;
+	}
+	if (tail != cfg->in_head) {
+		return NULL;			/* a producer is linking, take it later */
+	}
+	cfg_link_post(cfg, &cfg->in_stub);	/* keep the newest post linked */
+	next = tail->next;
+	if (next != NULL) {
+		cfg->in_tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+static void
+cfg_splice_posts(CONFIG* cfg)
+/* move the messages posted by other threads to the end of the queue */
+{
+	POST* p;
+
+	while ((p = cfg_take_post(cfg)) != NULL) {
+		cfg_put_message(cfg, p->m.target, p->m.msg);
+		FREE(p);
 	}
-	*qp = cq_cons(t, *qp);
 }
 
 void
+cfg_post(CONFIG* cfg, CONS* target, CONS* msg)
+/*
+ * Queue an asynchronous message for the target actor from any thread,
+ * delivered once run_configuration() picks it up. The target and message
+ * must not be allocated by the calling thread, and must stay reachable
+ * until cfg_post() returns (immediate values, or registered roots).
+ */
+{
+	POST* p;
+
+	p = NEW(POST);				/* no dbug calls here! */
+	assert(p != NULL);
+	p->m.target = target;
+	p->m.msg = msg;
+	cfg_link_post(cfg, p);
+}
+
+WORD
 abe__send_after(CONFIG* cfg, CONS* delay, CONS* target, CONS* msg)
 /*
  * Queue a message for delayed delivery to the target actor.
+ *
+ * returns: a handle for abe__cancel_after(), or 0 if already sent
  */
 {
-	CONS* t;
-	time_t s;
-	time_t us;
+	TIMER_WHEEL* w;
+	TIMER* t;
+	WORD due;
+	WORD h;
+	int i;
+#if ACTOR_WORK_STEALING
+	BOOL locked = FALSE;
+#endif
 
 	DBUG_ENTER("send_after");
 	assert(numberp(delay));
@@ -403,20 +907,77 @@ abe__send_after(CONFIG* cfg, CONS* delay, CONS* target, CONS* msg)
 	DBUG_PRINT("", ("target=%s", cons_to_str(target)));
 	DBUG_PRINT("", ("msg=%s", cons_to_str(msg)));
 	assert(actorp(target));
-	t = tv_increment(cfg->t_now_s, cfg->t_now_us, MK_INT(delay));
-	s = MK_INT(map_get_def(t, ATOM("s"), NUMBER(0)));
-	us = MK_INT(map_get_def(t, ATOM("us"), NUMBER(0)));
-	DBUG_PRINT("", ("t = %lus %luus", s, us));
-	t = cq_cons(t, cq_cons(target, msg));
-	t_queue_insert(&cfg->t_queue, t, s, us);
-	++cfg->t_count;
-	DBUG_PRINT("", ("t_count=%d", cfg->t_count));
-	DBUG_PRINT("", ("t_queue=%s", cons_to_str(cfg->t_queue)));
-#if 0	/* HACK: ignore delay */
-	DBUG_PRINT("WARNING", ("SEND_AFTER DOES NOT DELAY"));
-	abe__send(cfg, target, msg);
+	due = cfg_now(cfg) + MK_INT(delay);
+#if ACTOR_WORK_STEALING
+	if (cfg_worker(cfg) != NULL) {	/* timers are kept by the shared configuration */
+		pthread_mutex_lock(&actor_timer__lock);
+		locked = TRUE;
+		cfg = actor_round__cfg;
+	}
 #endif
-	DBUG_RETURN;
+	w = cfg->t_wheel;
+	if (due <= w->now) {
+		h = 0;
+		abe__send(cfg, target, msg);	/* no delay left */
+	} else {
+		i = wheel_alloc(w);
+		t = &w->pool[i];
+		t->due = due;
+		t->m.target = target;
+		t->m.msg = msg;
+		wheel_link(w, i);
+		h = TIMER_HANDLE(i, t->gen);
+		++cfg->t_count;
+	}
+#if ACTOR_WORK_STEALING
+	if (locked) {
+		pthread_mutex_unlock(&actor_timer__lock);
+	}
+#endif
+	DBUG_PRINT("", ("due=%ld t_count=%d", due, cfg->t_count));
+	DBUG_RETURN h;
+}
+
+BOOL
+abe__cancel_after(CONFIG* cfg, WORD timer)
+/*
+ * Cancel delivery of a delayed message, see abe__send_after().
+ *
+ * returns: TRUE on success, FALSE if the message was sent (or cancelled) already
+ */
+{
+	TIMER_WHEEL* w;
+	int i = (int)(timer & 0xFFFFFFFFL);
+	BOOL ok = FALSE;
+#if ACTOR_WORK_STEALING
+	BOOL locked = FALSE;
+#endif
+
+	DBUG_ENTER("cancel_after");
+	DBUG_PRINT("", ("timer=%lx", timer));
+#if ACTOR_WORK_STEALING
+	if (cfg_worker(cfg) != NULL) {
+		pthread_mutex_lock(&actor_timer__lock);
+		locked = TRUE;
+		cfg = actor_round__cfg;
+	}
+#endif
+	w = cfg->t_wheel;
+	if ((timer > 0) && (i < w->pool_cnt)
+	&&  (w->pool[i].slot != WHEEL_NONE)
+	&&  (TIMER_HANDLE(i, w->pool[i].gen) == timer)) {
+		wheel_unlink(w, i);
+		wheel_release(w, i);
+		--cfg->t_count;
+		ok = TRUE;
+	}
+#if ACTOR_WORK_STEALING
+	if (locked) {
+		pthread_mutex_unlock(&actor_timer__lock);
+	}
+#endif
+	DBUG_PRINT("", ("ok=%d t_count=%d", ok, cfg->t_count));
+	DBUG_RETURN ok;
 }
 
 static BOOL
@@ -427,34 +988,19 @@ abe__dispatch(CONFIG* cfg)
  * returns: TRUE on success, FALSE if there are no pending messages
  */
 {
-	CONS* cq = CONFIG_QUEUE(cfg);
-
 	DBUG_ENTER("dispatch");
 	DBUG_PRINT("", ("%d message(s) queued", cfg->q_count));
-	XDBUG_PRINT("", ("cq = %s", cons_to_str(cq)));
-	if (!CQ_EMPTY(cq)) {
-		CONS* node = CQ_PEEK(cq);
-		CONS* entry = car(node);
-		CONS* actor;
-		CONS* msg;
+	if (cfg_take_message(cfg, &cfg->q_entry)) {
+		CONS* actor = cfg->q_entry.target;
 		BEH beh;
 
-		XDBUG_PRINT("", ("entry=%s", cons_to_str(entry)));
-		CQ_POP(CONFIG_QUEUE(cfg));
-		node = cq_free(node);
-		XDBUG_PRINT("", ("entry=%s", cons_to_str(entry)));
-		assert(consp(entry));
-		actor = car(entry);
 		assert(actorp(actor));
 		beh = _THIS(actor);
-		msg = cdr(entry);
-		--cfg->q_count;
 		DBUG_PRINT("", ("actor=%s", cons_to_str(actor)));
-		DBUG_PRINT("", ("msg=%s", cons_to_str(msg)));
-		cfg->q_entry = entry;
+		DBUG_PRINT("", ("msg=%s", cons_to_str(cfg->q_entry.msg)));
 		(*beh)(cfg);			/* call actor behavior to handle message */
-		cfg->q_entry = NIL;
-		entry = cq_free(entry);
+		cfg->q_entry.target = NIL;
+		cfg->q_entry.msg = NIL;
 		if (++cfg->msg_cnt_lo < 0) {
 			++cfg->msg_cnt_hi;
 			cfg->msg_cnt_lo = 0;
@@ -471,45 +1017,355 @@ abe__clock_tick(CONFIG* cfg)
  * Update real-time clock and send any delayed messages whose time has come.
  */
 {
-	CONS* t_node;
-	struct timeval tv;
+	abe__now(cfg);
+	DBUG_PRINT("timer", ("t = %ldns", cfg->t_now));
+	if (cfg->t_count > 0) {
+		wheel_advance(cfg->t_wheel, cfg_now(cfg), cfg);
+		DBUG_PRINT("timer", ("t_count=%d", cfg->t_count));
+	} else {
+		cfg->t_wheel->now = cfg_now(cfg);	/* nothing to send */
+	}
+	cfg_splice_posts(cfg);
+}
+
+#define	CLOCK_STEP_SIZE		256		/* number of messages between clock checks */
+
+static void
+cfg_drop_messages(CONFIG* cfg)
+/*
+ * Discard every message waiting in the queue (delayed messages are kept).
+ */
+{
+	DBUG_ENTER("cfg_drop_messages");
+	DBUG_PRINT("", ("%d message(s) dropped", cfg->q_count));
+	cfg->q_head = 0;
+	cfg->q_count = 0;
+	DBUG_RETURN;
+}
+
+static int		actor_dispatch__threads = 0;	/* threads dispatching messages (0 = #cpus) */
+
+#if ACTOR_WORK_STEALING
 
-	if (gettimeofday(&tv, NULL) == 0) {
-		cfg->t_now_s = (tv.tv_sec - cfg->t_epoch);
-		cfg->t_now_us = tv.tv_usec;
-		DBUG_PRINT("timer", ("t = %lus %luus", cfg->t_now_s, cfg->t_now_us));
+static void
+cfg_count_delivered(CONFIG* cfg, int n)
+/* add <n> to the messages delivered by <cfg> */
+{
+	if (n > (INT_MAX - cfg->msg_cnt_lo)) {
+		n -= (INT_MAX - cfg->msg_cnt_lo) + 1;
+		++cfg->msg_cnt_hi;
+		cfg->msg_cnt_lo = 0;
 	}
-	while (!nilp(t_node = cfg->t_queue)) {
-		CONS* t_entry = car(t_node);
-		CONS* t_timer = car(t_entry);
-		time_t s;
-		time_t us;
+	cfg->msg_cnt_lo += n;
+}
+
+#define	ACTOR_THREADS_MAX	64				/* most dispatch threads */
+#define	ACTOR_SLOTS			(1 << 12)		/* actor exclusion slots (power of 2) */
+#define	ACTOR_SLOT(a)		(&actor_busy__slot[(as_word(MK_CONS(a)) / sizeof(CELL)) & (ACTOR_SLOTS - 1)])
+
+/*
+ * Messages are dispatched in rounds. Between rounds the waiting messages
+ * are dealt out to the worker queues, and afterwards gathered back, so
+ * the clock, collections and finalizers run while no other thread does.
+ * A round ends when its share of the message budget is used up, when the
+ * queues are empty, or when something has to happen between rounds.
+ * A behavior runs only once the exclusion slot of its actor is claimed,
+ * so a message for a busy actor goes back to the end of the queue.
+ */
+static WORKER*			actor_worker__pool = NULL;	/* one worker per dispatch thread */
+static int				actor_worker__init = 0;		/* workers with a registered configuration */
+static volatile int		actor_busy__slot[ACTOR_SLOTS];	/* 1 while a behavior runs */
+static pthread_mutex_t	actor_round__lock = PTHREAD_MUTEX_INITIALIZER;	/* guards round changes */
+static pthread_cond_t	actor_round__start = PTHREAD_COND_INITIALIZER;	/* signals a new round */
+static pthread_cond_t	actor_round__end = PTHREAD_COND_INITIALIZER;	/* signals the last helper done */
+static int				actor_round__number = 0;	/* advanced to start a round */
+static int				actor_round__running = 0;	/* helper threads still in the round */
+static BOOL				actor_round__exit = FALSE;	/* helper threads should exit */
+static int				actor_round__threads = 1;	/* workers taking part */
+static int				actor_round__limit = 0;		/* q_limit of the shared configuration */
+static volatile int		actor_round__tickets = 0;	/* messages left in the round budget */
+static volatile int		actor_round__stop = FALSE;	/* end the round early */
+static BOOL				actor_round__due = FALSE;	/* a collection was due as the round started */
+static volatile int		actor_idle__cnt = 0;		/* workers with no work */
+
+static BOOL
+cfg_steal_entry(WORKER* w, MESSAGE* m)
+/* take a message from another queue, FALSE once every worker is idle (or the round stops) */
+{
+	int n = actor_round__threads;
+	WORKER* v;
+	int i;
 
-		s = MK_INT(map_get_def(t_timer, ATOM("s"), NUMBER(0)));
-		us = MK_INT(map_get_def(t_timer, ATOM("us"), NUMBER(0)));
-		if (tv_compare(s, us, cfg->t_now_s, cfg->t_now_us) > 0) {
-			break;		/* not yet time to send this message */
+	__sync_fetch_and_add(&actor_idle__cnt, 1);
+	while ((actor_idle__cnt < n) && !actor_round__stop) {
+		for (i = 1; i < n; ++i) {
+			v = &actor_worker__pool[(w->id + i) % n];
+			if (v->cfg.q_count > 0) {
+				__sync_fetch_and_sub(&actor_idle__cnt, 1);
+				if (cfg_take_entry(v, m)) {
+					return TRUE;
+				}
+				__sync_fetch_and_add(&actor_idle__cnt, 1);
+			}
 		}
-		/* pop message from delay-timer queue and send it */
-		--cfg->t_count;
-		DBUG_PRINT("timer", ("t_count=%d", cfg->t_count));
-		cfg->t_queue = cdr(t_node);
-		abe__send(cfg, car(cdr(t_entry)), cdr(cdr(t_entry)));
-		cq_free(cdr(t_entry));
-		t_entry = cq_free(t_entry);
-		t_node = cq_free(t_node);
+		sched_yield();
 	}
+	return FALSE;
 }
 
-#define	CLOCK_STEP_SIZE		256		/* number of messages between clock checks */
+static void
+cfg_dispatch_round(WORKER* w)
+/* deliver messages until the round ends */
+{
+	CONFIG* cfg = &w->cfg;
+	volatile int* slot;
+	MESSAGE m;
+	CONS* actor;
+
+	while (!actor_round__stop) {
+		if (!cfg_take_entry(w, &m) && !cfg_steal_entry(w, &m)) {
+			break;			/* no work left anywhere */
+		}
+		actor = m.target;
+		assert(actorp(actor));
+		slot = ACTOR_SLOT(actor);
+		if (!__sync_bool_compare_and_swap(slot, 0, 1)) {
+			cfg_put_entry(w, m.target, m.msg);	/* the actor is busy on another thread */
+			sched_yield();
+			continue;
+		}
+		if (__sync_sub_and_fetch(&actor_round__tickets, 1) < 0) {
+			__sync_lock_release(slot);
+			cfg_put_entry(w, m.target, m.msg);
+			actor_round__stop = TRUE;	/* the round budget is used up */
+			break;
+		}
+		__sync_fetch_and_sub(&actor_round__queued, 1);
+		cfg->q_entry = m;
+		(*_THIS(actor))(cfg);	/* call actor behavior to handle message */
+		cfg->q_entry.target = NIL;
+		cfg->q_entry.msg = NIL;
+		__sync_lock_release(slot);	/* publishes BECOME to the next claimant */
+		++w->delivered;
+		if ((actor_round__queued > actor_round__limit)
+		||  gc_collection_requested()
+		||  (!actor_round__due && gc_collection_due())
+		||  gc_snapshot_requested()
+		||  gc_finalization_pending()) {
+			actor_round__stop = TRUE;	/* handled between rounds */
+		}
+	}
+}
+
+static void*
+cfg_dispatch_thread(void* arg)
+/* take part in rounds until told to exit */
+{
+	WORKER* w = (WORKER*)arg;
+
+	actor_worker__self = w;
+	gc_attach_thread();
+	for (;;) {
+		pthread_mutex_lock(&actor_round__lock);
+		while ((actor_round__number == w->round) && !actor_round__exit) {
+			pthread_cond_wait(&actor_round__start, &actor_round__lock);
+		}
+		if (actor_round__exit) {
+			pthread_mutex_unlock(&actor_round__lock);
+			break;
+		}
+		w->round = actor_round__number;
+		pthread_mutex_unlock(&actor_round__lock);
+		cfg_dispatch_round(w);
+		pthread_mutex_lock(&actor_round__lock);
+		if (--actor_round__running == 0) {
+			pthread_cond_signal(&actor_round__end);
+		}
+		pthread_mutex_unlock(&actor_round__lock);
+	}
+	cons_count_thread();
+	gc_detach_thread();
+	actor_worker__self = NULL;
+	return NULL;
+}
+
+static void
+cfg_deal_entries(CONFIG* cfg, int n)
+/* move the waiting messages of <cfg> to the first <n> worker queues */
+{
+	MESSAGE m;
+	int i = 0;
+
+	while (cfg_take_message(cfg, &m)) {
+		cfg_put_message(&actor_worker__pool[i].cfg, m.target, m.msg);
+		i = (i + 1) % n;
+	}
+	assert(cfg->q_count == 0);
+}
+
+static int
+cfg_gather_entries(CONFIG* cfg, int n)
+/*
+ * Move the waiting messages of the first <n> workers back to <cfg>,
+ * returning the number of messages they delivered.
+ */
+{
+	MESSAGE m;
+	WORKER* w;
+	int delivered = 0;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		w = &actor_worker__pool[i];
+		cfg_reserve_messages(cfg, w->cfg.q_count);
+		while (cfg_take_message(&w->cfg, &m)) {
+			cfg_put_message(cfg, m.target, m.msg);
+		}
+		delivered += w->delivered;
+		w->delivered = 0;
+	}
+	return delivered;
+}
+
+static int
+cfg_run_threads(CONFIG* cfg, int msg_limit, int n)
+/*
+ * Dispatch messages in rounds on <n> threads, see run_configuration().
+ */
+{
+	WORKER* w;
+	int quota;
+	int i;
+
+	DBUG_ENTER("cfg_run_threads");
+	if (actor_worker__pool == NULL) {
+		actor_worker__pool = NEWxN(WORKER, ACTOR_THREADS_MAX);
+		assert(actor_worker__pool != NULL);
+	}
+	for (; actor_worker__init < n; ++actor_worker__init) {
+		w = &actor_worker__pool[actor_worker__init];
+		cfg_initialize(&w->cfg, 0);
+		pthread_mutex_init(&w->lock, NULL);
+		w->id = actor_worker__init;
+	}
+	gc_attach_thread();		/* every allocating thread needs a buffer */
+	actor_worker__self = &actor_worker__pool[0];
+	actor_round__exit = FALSE;
+	for (i = 1; i < n; ++i) {
+		w = &actor_worker__pool[i];
+		w->round = actor_round__number;
+		if (pthread_create(&w->thread, NULL, cfg_dispatch_thread, w) != 0) {
+			DBUG_PRINT("", ("pthread_create failed, %d threads", i));
+			n = i;
+			break;
+		}
+	}
+	actor_round__threads = n;
+	actor_round__cfg = cfg;
+	while (msg_limit > 0) {
+		abe__clock_tick(cfg);
+		if (gc_collection_requested() || gc_collection_due() || gc_cycle_active()) {
+			cfg_force_gc(cfg);	/* no other thread runs between rounds */
+		}
+		if (gc_heap_exhausted()) {
+			DBUG_PRINT("", ("heap limit exceeded!"));
+			cfg_drop_messages(cfg);	/* stop the computation that filled the heap */
+			msg_limit = -1;
+			break;
+		}
+		if (gc_snapshot_requested()) {
+			cfg_snapshot(cfg, NULL);	/* asked for, see gc_request_snapshot() */
+		}
+		if (gc_finalization_pending()) {
+			cfg_run_finalizers(cfg);	/* registered cells were collected */
+		}
+		if (cfg->q_count == 0) {
+			break;
+		}
+		quota = CLOCK_STEP_SIZE * n;
+		if (quota > msg_limit) {
+			quota = msg_limit;
+		}
+		actor_round__queued = cfg->q_count;
+		actor_round__limit = cfg->q_limit;
+		actor_round__tickets = quota;
+		actor_round__stop = FALSE;
+		actor_round__due = gc_collection_due();	/* still due after collecting */
+		actor_idle__cnt = 0;
+		cfg_deal_entries(cfg, n);
+		for (i = 0; i < n; ++i) {
+			w = &actor_worker__pool[i];
+			w->cfg.t_epoch = cfg->t_epoch;
+			w->cfg.t_now = cfg->t_now;
+		}
+		pthread_mutex_lock(&actor_round__lock);
+		++actor_round__number;
+		actor_round__running = n - 1;
+		pthread_cond_broadcast(&actor_round__start);
+		pthread_mutex_unlock(&actor_round__lock);
+		cfg_dispatch_round(actor_worker__self);
+		pthread_mutex_lock(&actor_round__lock);
+		while (actor_round__running > 0) {
+			pthread_cond_wait(&actor_round__end, &actor_round__lock);
+		}
+		pthread_mutex_unlock(&actor_round__lock);
+		quota = cfg_gather_entries(cfg, n);
+		cfg_count_delivered(cfg, quota);
+		msg_limit -= quota;
+		DBUG_PRINT("", ("%d message(s) delivered, %d queued", quota, cfg->q_count));
+		if (cfg->q_count > cfg->q_limit) {
+			DBUG_PRINT("", ("message queue limit exceeded!"));
+			msg_limit = -1;
+			break;
+		}
+	}
+	pthread_mutex_lock(&actor_round__lock);
+	actor_round__exit = TRUE;
+	pthread_cond_broadcast(&actor_round__start);
+	pthread_mutex_unlock(&actor_round__lock);
+	for (i = 1; i < n; ++i) {
+		w = &actor_worker__pool[i];
+		pthread_join(w->thread, NULL);
+	}
+	actor_worker__self = NULL;
+	actor_round__cfg = NULL;
+	gc_detach_thread();
+	DBUG_RETURN msg_limit;
+}
+
+#endif /* ACTOR_WORK_STEALING */
+
+void
+cfg_set_dispatch_threads(int n)
+/* set the number of threads dispatching messages in run_configuration() (0 = one per cpu) */
+{
+	DBUG_ENTER("cfg_set_dispatch_threads");
+#if ACTOR_WORK_STEALING
+	if (n <= 0) {
+		n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (n > ACTOR_THREADS_MAX) {
+		n = ACTOR_THREADS_MAX;
+	}
+#endif
+	if (n < 1) {
+		n = 1;
+	}
+	actor_dispatch__threads = n;
+	DBUG_PRINT("", ("dispatch_threads=%d", actor_dispatch__threads));
+	DBUG_RETURN;
+}
 
 int
 run_configuration(CONFIG* cfg, int msg_limit)
 /*
  * Dispatch messages until the message queue is empty.
  * No more than <msg_limit> messages will be delivered.
+ * Garbage-collection is started between messages
+ * whenever free cells are running low.
  * Dispatch is aborted if the queue of waiting messages
- * exceeds the configuration limit.
+ * exceeds the configuration limit, or if live cells do not
+ * fit under the heap limit (the waiting messages are dropped).
  * 
  * returns: unused message budget or -1 if aborted
  */
@@ -517,11 +1373,40 @@ run_configuration(CONFIG* cfg, int msg_limit)
 	int clock_step = 0;
 
 	DBUG_ENTER("run_configuration");
+	if (actor_dispatch__threads == 0) {
+		cfg_set_dispatch_threads(0);
+	}
+#if ACTOR_WORK_STEALING
+	if (actor_dispatch__threads > 1) {
+		msg_limit = cfg_run_threads(cfg, msg_limit, actor_dispatch__threads);
+		DBUG_RETURN msg_limit;
+	}
+#endif
 	while (msg_limit > 0) {
 		if (--clock_step <= 0) {
 			abe__clock_tick(cfg);
 			clock_step = CLOCK_STEP_SIZE;
 		}
+		if (gc_collection_requested()) {
+			cfg_force_gc(cfg);	/* asked for, see gc_request_collection() */
+		} else if (gc_collection_due()) {
+			cfg_start_gc(cfg);	/* free cells are running low */
+		}
+		if (gc_heap_exhausted()) {
+			DBUG_PRINT("", ("heap limit exceeded!"));
+			cfg_drop_messages(cfg);	/* stop the computation that filled the heap */
+			msg_limit = -1;
+			break;
+		}
+		if (gc_snapshot_requested()) {
+			cfg_snapshot(cfg, NULL);	/* asked for, see gc_request_snapshot() */
+		}
+		if (gc_finalization_pending()) {
+			cfg_run_finalizers(cfg);	/* registered cells were collected */
+		}
+		if (cfg->q_count == 0) {
+			cfg_splice_posts(cfg);	/* see if another thread posted a message */
+		}
 		if (!abe__dispatch(cfg)) {
 			break;
 		}
@@ -532,12 +1417,10 @@ run_configuration(CONFIG* cfg, int msg_limit)
 			break;
 		}
 	}
-	DBUG_PRINT("", ("t_count=%d now=%lus %luus", cfg->t_count, cfg->t_now_s, cfg->t_now_us));
-	DBUG_PRINT("", ("t_queue=%s", cons_to_str(cfg->t_queue)));
+	DBUG_PRINT("", ("t_count=%d now=%ldns", cfg->t_count, cfg->t_now));
 	DBUG_PRINT("", ("q_count=%d q_limit=%d msg_limit=%d", cfg->q_count, cfg->q_limit, msg_limit));
 	DBUG_PRINT("", ("msg_cnt_hi=%d msg_cnt_lo=%d", cfg->msg_cnt_hi, cfg->msg_cnt_lo));
-	DBUG_PRINT("", ("free_config_cnt=%d", free_config_cnt));
-	DBUG_PRINT("", ("free_config_max=%d", free_config_max));
+	DBUG_PRINT("", ("q_size=%d t_pool=%d", cfg->q_size, cfg->t_wheel->pool_cnt));
 	DBUG_RETURN msg_limit;
 }
 
@@ -547,22 +1430,17 @@ report_configuration(CONFIG* cfg)
 	CONS* p;
 	CONS* q;
 	char* m;
-	CONS* cq = CONFIG_QUEUE(cfg);
 
 	DBUG_ENTER("report_configuration");
 	p = NIL;
 	DBUG_PRINT("", ("NIL @%p = %s", p, cons_to_str(p)));
 
-	DBUG_PRINT("", ("@%p {head:%p, tail:%p}", cq, car(cq), cdr(cq)));
-	p = car(cq);
-	assert(consp(p));
+	DBUG_PRINT("", ("@%p {head:%d, count:%d, size:%d}",
+		cfg->q_ring, cfg->q_head, cfg->q_count, cfg->q_size));
+	assert(cfg->q_count > 0);
+	q = cfg->q_ring[cfg->q_head].target;
+	p = cfg->q_ring[cfg->q_head].msg;
 	DBUG_PRINT("", ("@%p = %s", p, cons_to_str(p)));
-	
-	assert(!nilp(p));
-	p = car(p);
-	DBUG_PRINT("", ("@%p = %s", p, cons_to_str(p)));
-	assert(consp(p));
-	q = car(p);
 	DBUG_PRINT("", ("1st: actor=%p (behavior=%p, state=%p)", q, _THIS(q), _MINE(q)));
 	assert(actorp(q));
 	assert(funcp(car(MK_CONS(q))));
@@ -574,17 +1452,163 @@ report_configuration(CONFIG* cfg)
 	DBUG_RETURN;
 }
 
-static void
-report_cq_usage()
+void
+report_actor_usage(CONFIG* cfg)
+{
+	TRACE(printf("msg_cnt_hi=%d msg_cnt_lo=%d\n", cfg->msg_cnt_hi, cfg->msg_cnt_lo));
+	TRACE(printf("q_size=%d t_pool=%d\n", cfg->q_size, cfg->t_wheel->pool_cnt));
+}
+
+/**
+counter_beh(n):
+	BEHAVIOR {count:$n}
+	_ -> [ BECOME counter_beh(n + 1) ]
+	DONE
+**/
+static
+BEH_DECL(counter_beh)
+{
+	DBUG_ENTER("counter_beh");
+	BECOME(counter_beh, NUMBER(MK_INT(MINE) + 1));
+	DBUG_RETURN;
+}
+
+/**
+fan_out_beh(counter):
+	BEHAVIOR {counter:$counter}
+	$depth -> [
+		SEND #tick TO counter
+		IF $depth > 0 [
+			SEND (depth - 1) TO NEW fan_out_beh(counter)
+			SEND (depth - 1) TO NEW fan_out_beh(counter)
+		]
+	]
+	DONE
+**/
+static
+BEH_DECL(fan_out_beh)
+{
+	CONS* counter = MINE;
+	int depth = MK_INT(WHAT);
+
+	DBUG_ENTER("fan_out_beh");
+	SEND(counter, ATOM("tick"));
+	if (depth > 0) {
+		SEND(ACTOR(fan_out_beh, counter), NUMBER(depth - 1));
+		SEND(ACTOR(fan_out_beh, counter), NUMBER(depth - 1));
+	}
+	DBUG_RETURN;
+}
+
+#define	FAN_OUT_DEPTH	10			/* 2047 fan-out actors */
+#define	FAN_OUT_ACTORS	((2 << FAN_OUT_DEPTH) - 1)
+#define	BATCH_SIZE		100			/* more than the initial queue slots */
+#define	TIMER_COUNT		1000		/* delayed messages, up to TIMER_COUNT us */
+#define	POST_THREADS	4
+#define	POST_COUNT		10000		/* messages posted by each thread */
+
+static CONFIG*	test__post_cfg;		/* see test_post_thread() */
+static CONS*	test__post_target;
+
+static void*
+test_post_thread(void* arg)
 {
-	TRACE(printf("free_config_cnt=%d\n", free_config_cnt));
-	TRACE(printf("free_config_max=%d\n", free_config_max));
-/*	assert(free_config_cnt == 0); */
+	int i;
+
+	for (i = 0; i < POST_COUNT; ++i) {
+		cfg_post(test__post_cfg, test__post_target, NUMBER(i));
+	}
+	return NULL;
 }
 
 void
-report_actor_usage(CONFIG* cfg)
+test_actor()
 {
-	TRACE(printf("msg_cnt_hi=%d msg_cnt_lo=%d\n", cfg->msg_cnt_hi, cfg->msg_cnt_lo));
-	report_cq_usage();
+	int threads = actor_dispatch__threads;
+	MESSAGE batch[BATCH_SIZE];
+	pthread_t poster[POST_THREADS];
+	CONFIG* cfg;
+	CONS* counter;
+	WORD h;
+	int n;
+	int i;
+
+	DBUG_ENTER("test_actor");
+	TRACE(printf("--test_actor--\n"));
+	cfg_set_dispatch_threads(4);	/* one thread, unless ACTOR_WORK_STEALING */
+	cfg = new_configuration(10 * FAN_OUT_ACTORS);
+	h = abe__now(cfg);
+	assert(abe__now(cfg) >= h);			/* monotonic */
+	h = as_word(1000) * 24 * 3600 * NS_PER_SEC;	/* 1000 days */
+	assert(tv_unbox(tv_box(h + 1)) == h + 1);
+	counter = CFG_ACTOR(cfg, counter_beh, NUMBER(0));
+	cfg_add_gc_root(cfg, counter);
+	CFG_SEND(cfg, CFG_ACTOR(cfg, fan_out_beh, counter), NUMBER(FAN_OUT_DEPTH));
+	n = run_configuration(cfg, 100);	/* the budget stops dispatch */
+	assert(n == 0);
+	assert(cfg->msg_cnt_lo == 100);
+	assert(cfg->q_count > 0);
+	n = run_configuration(cfg, 1000000);
+	DBUG_PRINT("", ("n=%d msg_cnt_lo=%d", n, cfg->msg_cnt_lo));
+	assert(cfg->q_count == 0);
+	assert(cfg->msg_cnt_lo == 2 * FAN_OUT_ACTORS);
+	assert(n == 1000000 - (2 * FAN_OUT_ACTORS - 100));
+	assert(MK_INT(_MINE(counter)) == FAN_OUT_ACTORS);	/* each BECOME saw the last */
+
+	for (n = 0; n < BATCH_SIZE; ++n) {
+		batch[n].target = counter;
+		batch[n].msg = ATOM("tick");
+	}
+	CFG_SEND(cfg, counter, ATOM("tick"));
+	CFG_SEND_BATCH(cfg, batch, BATCH_SIZE);
+	assert(cfg->q_count == BATCH_SIZE + 1);
+	n = run_configuration(cfg, 1000000);
+	assert(cfg->q_count == 0);
+	assert(MK_INT(_MINE(counter)) == FAN_OUT_ACTORS + BATCH_SIZE + 1);
+
+	n = MK_INT(_MINE(counter)) + (POST_THREADS * POST_COUNT);
+	test__post_cfg = cfg;
+	test__post_target = counter;	/* a registered root */
+	for (i = 0; i < POST_THREADS; ++i) {
+		if (pthread_create(&poster[i], NULL, test_post_thread, NULL) != 0) {
+			break;
+		}
+	}
+	n -= (POST_THREADS - i) * POST_COUNT;	/* only threads that started */
+	while (MK_INT(_MINE(counter)) < n) {	/* deliver while they post */
+		run_configuration(cfg, 1000);
+	}
+	while (i > 0) {
+		pthread_join(poster[--i], NULL);
+	}
+	assert(MK_INT(_MINE(counter)) == n);
+	assert(cfg->q_count == 0);
+
+	h = abe__send_after(cfg, NUMBER(TICK_FREQ / 1000), counter, ATOM("tick"));
+	assert(h != 0);
+	assert(abe__cancel_after(cfg, h));
+	assert(!abe__cancel_after(cfg, h));		/* a handle is used only once */
+	h = abe__send_after(cfg, NUMBER(100 * TICK_FREQ), counter, ATOM("tick"));
+	for (i = 0; i < TIMER_COUNT; ++i) {
+		abe__send_after(cfg, NUMBER(1 + ((i * 7) % TIMER_COUNT)), counter, NUMBER(i));
+	}
+	assert(cfg->t_count == TIMER_COUNT + 1);
+	cfg_force_gc(cfg);				/* delayed messages are roots */
+	usleep(8 * TIMER_COUNT);
+	n += TIMER_COUNT;
+	while (cfg->t_count > 1) {		/* deliver all but the last */
+		run_configuration(cfg, 1000000);
+	}
+	assert(MK_INT(_MINE(counter)) == n);
+	assert(abe__cancel_after(cfg, h));
+	assert(cfg->t_count == 0);
+
+	cfg->q_limit = 100;				/* the fan-out overflows the queue */
+	CFG_SEND(cfg, CFG_ACTOR(cfg, fan_out_beh, counter), NUMBER(FAN_OUT_DEPTH));
+	n = run_configuration(cfg, 1000000);
+	assert(n == -1);
+	assert(cfg->q_count > cfg->q_limit);
+	cfg_drop_messages(cfg);
+	cfg_set_dispatch_threads(threads);
+	DBUG_RETURN;
 }
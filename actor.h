@@ -9,8 +9,18 @@
 #include "types.h"
 
 #define	TICK_FREQ		(1000 * 1000)	/* number of timer ticks per second */
+#define	NS_PER_SEC		(1000 * 1000 * 1000)
+#define	NS_PER_TICK		(NS_PER_SEC / TICK_FREQ)
 
-#define	CONFIG_QUEUE(cfg)	((CONS*)(cfg))
+#ifndef ACTOR_WORK_STEALING
+#define	ACTOR_WORK_STEALING 0	/* 1 = run_configuration() dispatches on several threads */
+#endif
+
+#if ACTOR_WORK_STEALING
+#define	ACTOR_LOCAL		__thread	/* one per dispatch thread */
+#else
+#define	ACTOR_LOCAL					/* a single dispatch thread */
+#endif
 
 #define	BEH_SIG			CONFIG*
 #define	BEH_PROTO		BEH_SIG abe__config
@@ -23,16 +33,21 @@ typedef void (*BEH)(BEH_SIG);
 #define	_MINE(a)		_mine(a)
 
 #define CFG				(abe__config)
-#define	SELF			car(CFG->q_entry)
+#define	SELF			(CFG->q_entry.target)
 #define	THIS			_THIS(SELF)
 #define	MINE			_MINE(SELF)
-#define	WHAT			cdr(CFG->q_entry)
-#define	NOW				tv_create(CFG->t_now_s, CFG->t_now_us)
+#define	WHAT			(CFG->q_entry.msg)
+#define	NOW				abe__now(CFG)
 #define	CFG_ACTOR(c,b,s) abe__actor((c),(b),(s))
 #define	ACTOR(b,s)		abe__actor(CFG,(b),(s))
 #define	CFG_SEND(c,a,m)	abe__send((c),(a),(m))
 #define	SEND(a,m)		abe__send(CFG,(a),(m))
+#define	CFG_SEND_BATCH(c,v,n) abe__send_batch((c),(v),(n))
+#define	SEND_BATCH(v,n)	abe__send_batch(CFG,(v),(n))
 #define	SEND_AFTER(t,a,m) abe__send_after(CFG,(t),(a),(m))
+#define	CANCEL_AFTER(h)	abe__cancel_after(CFG,(h))
+#define	CFG_FINALIZE(c,x,b,s) abe__finalize((c),(x),(b),(s))
+#define	FINALIZE(x,b,s)	abe__finalize(CFG,(x),(b),(s))
 #define	BECOME(b,s)		abe__become(SELF,(b),(s))
 
 BEH			_this(CONS* self);
@@ -42,18 +57,28 @@ BEH_DECL(sink_beh);
 BEH_DECL(error_msg);
 BEH_DECL(assert_msg);
 
-CONS*		tv_create(time_t s, time_t us);
-CONS*		tv_increment(time_t s, time_t us, time_t d);
-int			tv_compare(time_t t0s, time_t t0us, time_t t1s, time_t t1us);
+CONS*		tv_box(WORD t);
+WORD		tv_unbox(CONS* t);
 CONFIG*		new_configuration(int q_limit);
-void		cfg_add_gc_root(CONFIG* cfg, CONS* root);
+int			cfg_add_gc_root(CONFIG* cfg, CONS* root);
+void		cfg_remove_gc_root(CONFIG* cfg, int handle);
 void		cfg_force_gc(CONFIG* cfg);
+void		cfg_compact_gc(CONFIG* cfg);
+BOOL		cfg_snapshot(CONFIG* cfg, char* path);
 void		cfg_start_gc(CONFIG* cfg);
 CONS*		abe__actor(CONFIG* cfg, BEH beh, CONS* state);
 CONS*		abe__become(CONS* self, BEH beh, CONS* state);
+WORD		abe__now(CONFIG* cfg);
+void		abe__finalize(CONFIG* cfg, CONS* cell, BEH beh, CONS* state);
 void		abe__send(CONFIG* cfg, CONS* target, CONS* msg);
-void		abe__send_after(CONFIG* cfg, CONS* delay, CONS* target, CONS* msg);
+void		abe__send_batch(CONFIG* cfg, MESSAGE* batch, int n);
+WORD		abe__send_after(CONFIG* cfg, CONS* delay, CONS* target, CONS* msg);
+BOOL		abe__cancel_after(CONFIG* cfg, WORD timer);
+void		cfg_post(CONFIG* cfg, CONS* target, CONS* msg);
 int			run_configuration(CONFIG* cfg, int msg_limit);
+void		cfg_set_dispatch_threads(int n);
+
+void		test_actor();
 
 void		report_configuration(CONFIG* cfg);
 void		report_actor_usage(CONFIG* cfg);
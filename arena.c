@@ -0,0 +1,220 @@
+/*
+ * arena.c -- reserved virtual memory regions for the cell heap
+ *
+ * Copyright 2009-2017 Dale Schumacher.  ALL RIGHTS RESERVED.
+ */
+#define _GNU_SOURCE				/* MAP_ANONYMOUS, MAP_NORESERVE, madvise() */
+#include <sys/mman.h>
+#include "arena.h"
+#include "abe.h"
+
+#include "dbug.h"
+DBUG_UNIT("arena");
+
+/*
+ * An arena is a large region of address space, reserved (but not
+ * committed) all at once. Memory is committed from the front of the
+ * region, in steps of the commit size, and allocated by bumping a
+ * pointer. Cells allocated one after another are contiguous, which
+ * keeps a large heap on few pages (or huge pages).
+ */
+struct arena {
+	char*		base;		/* start of reserved region */
+	char*		next;		/* next unallocated byte */
+	char*		commit;		/* end of committed memory */
+	char*		limit;		/* end of reserved region */
+	ARENA*		prev;		/* previously filled region */
+};
+
+static ARENA*	arena__current = NULL;			/* region being allocated from */
+static size_t	arena__commit = ARENA_COMMIT;	/* bytes committed at a time */
+static BOOL		arena__huge = FALSE;			/* TRUE to advise huge pages */
+static size_t	arena__committed = 0;			/* total bytes committed */
+
+#define	ARENA_ROUND(n,a)	((((n) + (a) - 1) / (a)) * (a))
+
+static ARENA*
+arena_reserve(size_t size)
+/* reserve a new region of at least <size> bytes */
+{
+	ARENA* a;
+	void* p;
+	size_t n;
+
+	DBUG_ENTER("arena_reserve");
+	n = ARENA_ROUND(size, ARENA_HUGE_PAGE);
+	for (;;) {
+		p = mmap(NULL, n + ARENA_HUGE_PAGE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p != MAP_FAILED) {
+			break;
+		}
+		if ((n >> 1) < ARENA_ROUND(size, ARENA_HUGE_PAGE)) {
+			DBUG_PRINT("arena", ("unable to reserve %lu bytes", (ulint)size));
+			DBUG_RETURN NULL;
+		}
+		n >>= 1;			/* address space is limited, try a smaller region */
+	}
+	a = NEW(ARENA);
+	assert(a != NULL);
+	a->base = (char*)ARENA_ROUND(as_word(p), ARENA_HUGE_PAGE);	/* huge page aligned */
+	a->next = a->base;
+	a->commit = a->base;
+	a->limit = a->base + n;
+	a->prev = NULL;
+	DBUG_PRINT("arena", ("%lu bytes reserved at %p", (ulint)n, a->base));
+	DBUG_RETURN a;
+}
+
+static BOOL
+arena_commit(ARENA* a, char* end)
+/* commit memory in region <a> up to at least <end> */
+{
+	size_t n;
+
+	DBUG_ENTER("arena_commit");
+	n = ARENA_ROUND((size_t)(end - a->commit), arena__commit);
+	if (n > (size_t)(a->limit - a->commit)) {
+		n = (size_t)(a->limit - a->commit);
+	}
+	if (mprotect(a->commit, n, PROT_READ | PROT_WRITE) != 0) {
+		DBUG_PRINT("arena", ("unable to commit %lu bytes", (ulint)n));
+		DBUG_RETURN FALSE;
+	}
+#ifdef MADV_HUGEPAGE
+	if (arena__huge) {
+		madvise(a->commit, n, MADV_HUGEPAGE);	/* advice only, failure is harmless */
+	}
+#endif
+	DBUG_PRINT("arena", ("%lu bytes committed at %p", (ulint)n, a->commit));
+	a->commit += n;
+	arena__committed += n;
+	DBUG_RETURN TRUE;
+}
+
+ARENA*
+arena_new(size_t size)
+/* reserve a separate region of up to <size> bytes, see arena_take() */
+{
+	return arena_reserve(size);
+}
+
+void*
+arena_take(ARENA* a, size_t size, size_t align)
+/* allocate <size> bytes of zeroed memory from region <a>, NULL if it is full */
+{
+	char* p;
+
+	assert((align & (align - 1)) == 0);
+	p = (char*)ARENA_ROUND(as_word(a->next), align);
+	if (p + size > a->limit) {
+		return NULL;
+	}
+	if (p + size > a->commit) {
+		if (!arena_commit(a, p + size)) {
+			return NULL;
+		}
+	}
+	a->next = p + size;
+	return p;
+}
+
+void*
+arena_alloc(size_t size, size_t align)
+/* allocate <size> bytes of zeroed memory, aligned on <align> (a power of 2), NULL if none */
+{
+	ARENA* a = arena__current;
+	char* p = NULL;
+
+	assert((align & (align - 1)) == 0);
+	if (a != NULL) {
+		p = (char*)ARENA_ROUND(as_word(a->next), align);
+	}
+	if ((a == NULL) || (p + size > a->limit)) {
+		a = arena_reserve((size + align > ARENA_RESERVE) ? (size + align) : ARENA_RESERVE);
+		if (a == NULL) {
+			return NULL;	/* out of address space */
+		}
+		a->prev = arena__current;
+		arena__current = a;
+	}
+	return arena_take(a, size, align);
+}
+
+void
+arena_release(void* p, size_t size)
+/* return the pages of an allocation to the OS, they stay mapped and read as zero */
+{
+	DBUG_ENTER("arena_release");
+	assert((as_word(p) & (getpagesize() - 1)) == 0);
+	if (madvise(p, size, MADV_DONTNEED) != 0) {
+		DBUG_PRINT("arena", ("unable to release %lu bytes at %p", (ulint)size, p));
+		DBUG_RETURN;
+	}
+	arena__committed -= size;
+	DBUG_RETURN;
+}
+
+void
+arena_recommit(void* p, size_t size)
+/* account for reuse of memory returned by arena_release() */
+{
+	arena__committed += size;
+}
+
+void
+arena_set_commit(size_t size, BOOL huge_pages)
+/* set the bytes committed at a time, and whether to advise huge pages */
+{
+	DBUG_ENTER("arena_set_commit");
+	if (huge_pages) {
+		size = ARENA_ROUND(size, ARENA_HUGE_PAGE);	/* whole huge pages */
+	}
+	assert(size > 0);
+	arena__commit = size;
+	arena__huge = huge_pages;
+	DBUG_PRINT("arena", ("commit=%lu huge=%d", (ulint)arena__commit, arena__huge));
+	DBUG_RETURN;
+}
+
+size_t
+arena_committed()
+/* total bytes committed by all regions */
+{
+	return arena__committed;
+}
+
+void
+test_arena()
+/* internal unit test */
+{
+	char* p;
+	char* q;
+	ARENA* a;
+
+	DBUG_ENTER("test_arena");
+	TRACE(printf("--test_arena--\n"));
+	p = (char*)arena_alloc(100, 16);
+	assert(p != NULL);
+	assert((as_word(p) & 15) == 0);
+	assert(p[0] == 0 && p[99] == 0);		/* memory is zeroed */
+	assert(arena_committed() >= 100);
+	q = (char*)arena_alloc(1 << 16, 1 << 16);
+	assert(q != NULL);
+	assert((as_word(q) & 0xFFFF) == 0);
+	assert(q >= (p + 100));					/* allocation is contiguous */
+	q[(1 << 16) - 1] = 1;					/* memory is writable */
+	p = (char*)arena_alloc(100, 16);
+	assert(p == (q + (1 << 16)));
+	arena_release(q, 1 << 16);
+	assert(q[(1 << 16) - 1] == 0);			/* released memory reads as zero */
+	arena_recommit(q, 1 << 16);
+	a = arena_new(1 << 16);					/* a separate region */
+	assert(a != NULL);
+	p = (char*)arena_take(a, 100, 16);
+	assert(p != NULL);
+	q = (char*)arena_take(a, 100, 16);
+	assert(q == (p + 112));					/* contiguous, aligned */
+	assert(arena_take(a, ARENA_HUGE_PAGE, 16) == NULL);	/* the region is full */
+	DBUG_RETURN;
+}
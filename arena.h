@@ -0,0 +1,27 @@
+/*
+ * arena.h -- reserved virtual memory regions for the cell heap
+ *
+ * Copyright 2009-2017 Dale Schumacher.  ALL RIGHTS RESERVED.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include "types.h"
+
+#define	ARENA_RESERVE	((size_t)1 << 36)	/* virtual bytes reserved per region (64Gb) */
+#define	ARENA_COMMIT	((size_t)1 << 20)	/* default bytes committed at a time (1Mb) */
+#define	ARENA_HUGE_PAGE	((size_t)1 << 21)	/* huge page size (2Mb) */
+
+typedef struct arena ARENA;
+
+ARENA*	arena_new(size_t size);					/* reserve a separate region for arena_take() */
+void*	arena_take(ARENA* a, size_t size, size_t align);	/* allocate from region <a>, NULL if full */
+void*	arena_alloc(size_t size, size_t align);	/* allocate zeroed memory, aligned on <align>, NULL if none */
+void	arena_release(void* p, size_t size);	/* return memory to the OS, it reads as zero */
+void	arena_recommit(void* p, size_t size);	/* account for reuse of released memory */
+void	arena_set_commit(size_t size, BOOL huge_pages);	/* set the commit size, huge page use */
+size_t	arena_committed();						/* total bytes committed */
+void	test_arena();							/* internal unit test */
+
+#endif /* ARENA_H */
@@ -5,6 +5,9 @@
  */
 #include "atom.h"
 #include "abe.h"
+#if ACTOR_WORK_STEALING
+#include <pthread.h>
+#endif
 
 #include "dbug.h"
 DBUG_UNIT("atom");
@@ -12,6 +15,10 @@ DBUG_UNIT("atom");
 static CONS*	lu_atom_root = NULL;
 static int		lu_cons_cnt = 0;
 
+#if ACTOR_WORK_STEALING
+static pthread_mutex_t	lu_atom_lock = PTHREAD_MUTEX_INITIALIZER;	/* guards new atoms */
+#endif
+
 CONS*
 lu_cons(CONS* a, CONS* d)
 /* allocate a permanent cell (not garbage-collected) */
@@ -30,7 +37,11 @@ lu_extend_atom(CONS* atom, int c)
 {
 	CONS* root;
 	CONS* node;
+	CONS* next;
 	CONS* ch = NUMBER(c);
+#if ACTOR_WORK_STEALING
+	BOOL locked = FALSE;	/* readers search the suffix lists without the lock */
+#endif
 
 	XDBUG_ENTER("lu_extend_atom");
 	XDBUG_PRINT("", ("atom@%p = %s", atom, atom_str(atom)));
@@ -50,11 +61,23 @@ lu_extend_atom(CONS* atom, int c)
 	for (;;) {
 		XDBUG_PRINT("", ("node = %p[%p;%p]", node, car(node), cdr(node)));
 		if (nilp(node)) {
+#if ACTOR_WORK_STEALING
+			if (!locked) {	/* search again, another thread may add it */
+				pthread_mutex_lock(&lu_atom_lock);
+				locked = TRUE;
+				node = cdr(root);
+				continue;
+			}
+#endif
 			/* suffix not found, extend suffix list with new character */
 			XDBUG_PRINT("", ("extending suffix list"));
 			node = lu_cons(ch, car(root));
 			node = lu_cons(node, NIL);
-			rplacd(root, lu_cons(node, cdr(root)));
+			next = lu_cons(node, cdr(root));
+#if ACTOR_WORK_STEALING
+			__sync_synchronize();	/* readers must see a complete entry */
+#endif
+			rplacd(root, next);
 			break;
 		}
 		if (car(car(car(node))) == ch) {
@@ -65,6 +88,11 @@ lu_extend_atom(CONS* atom, int c)
 		}
 		node = cdr(node);
 	}
+#if ACTOR_WORK_STEALING
+	if (locked) {
+		pthread_mutex_unlock(&lu_atom_lock);
+	}
+#endif
 	atom = MK_ATOM(node);
 	assert(atomp(atom));
 	XDBUG_RETURN atom;
@@ -96,7 +124,7 @@ char*
 atom_str(CONS* atom)	/* warning: returns pointer to static buffer, do not nest calls! */
 /* return a string representation of an atom */
 {
-	static char s[256];
+	static ACTOR_LOCAL char s[256];
 	CONS* p;
 	int n;
 	
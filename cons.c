@@ -9,8 +9,9 @@
 #include "dbug.h"
 DBUG_UNIT("cons");
 
-CELL		nil__cons = { NIL, NIL, GC_PHASE_Z, as_word(0) };
-static int	cons_cnt = 0;
+CELL		nil__cons = { GC_NIL_REF, GC_NIL_REF, GC_PHASE_Z, as_word(0) };
+static ACTOR_LOCAL int	cons_cnt = 0;	/* cells allocated by this thread */
+static int	cons_sum = 0;		/* cells allocated by finished threads, see cons_count_thread() */
 
 BOOL
 _nilp(CONS* p)
@@ -141,24 +142,35 @@ equal(CONS* x, CONS* y)
 CONS*
 append(CONS* x, CONS* y)
 {
+	CONS* v[LIST_BATCH];
+	int n = 0;
+
 	assert(consp(x));
 	assert(consp(y));
-	if (nilp(x)) {
-		return y;
+	while (!nilp(x) && (n < LIST_BATCH)) {
+		assert(consp(x));
+		v[n++] = car(x);
+		x = cdr(x);
+	}
+	if (!nilp(x)) {
+		y = append(x, y);	/* recursion depth is length / LIST_BATCH */
 	}
-	/* FIXME: consider a non-recursive implementation to minimize stack usage */
-	return cons(car(x), append(cdr(x), y));
+	return gc_list(v, n, y);
 }
 
 CONS*
 reverse(CONS* list)
 {
+	CONS* v[LIST_BATCH];
 	CONS* rev = NIL;
+	int n;
 
 	while (!nilp(list)) {
-		assert(consp(list));
-		rev = cons(car(list), rev);
-		list = cdr(list);
+		for (n = LIST_BATCH; (n > 0) && !nilp(list); list = cdr(list)) {
+			assert(consp(list));
+			v[--n] = car(list);
+		}
+		rev = gc_list(v + n, LIST_BATCH - n, rev);
 	}
 	return rev;
 }
@@ -355,10 +367,10 @@ test_cons()
 	assert(!funcp(p));
 	assert(!numberp(p));
 	
-	assert(nilp((p)->first));
-	assert((p)->first == NIL);
-	assert(nilp((p)->rest));
-	assert((p)->rest == NIL);
+	assert(nilp(GC_FIRST(p)));
+	assert(GC_FIRST(p) == NIL);
+	assert(nilp(GC_REST(p)));
+	assert(GC_REST(p) == NIL);
 	
 	p = cons(NIL, NIL);
 	DBUG_PRINT("", ("p:cons(NIL,NIL)=%p", p));
@@ -430,13 +442,23 @@ test_cons()
 	DBUG_RETURN;
 }
 
+void
+cons_count_thread()
+/* add the cells allocated by a finishing dispatch thread to the total */
+{
+#if ACTOR_WORK_STEALING
+	__sync_fetch_and_add(&cons_sum, cons_cnt);
+	cons_cnt = 0;
+#endif
+}
+
 void
 report_cons_usage()
 {
 	report_cell_usage();
-	TRACE(printf("cons_cnt=%d\n", cons_cnt));
-	assert((NIL)->first == NIL);
-	assert((NIL)->rest == NIL);
+	TRACE(printf("cons_cnt=%d\n", cons_sum + cons_cnt));
+	assert(GC_FIRST(NIL) == NIL);
+	assert(GC_REST(NIL) == NIL);
 }
 
 BOOL
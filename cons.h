@@ -43,6 +43,8 @@
 
 #define	map_get(map,key)	map_get_def((map), (key), NULL)
 
+#define	LIST_BATCH	64		/* values gathered per gc_list() call */
+
 extern CELL		nil__cons;
 
 #define	NIL		as_cons(&nil__cons)
@@ -79,6 +81,7 @@ CONS*	map_remove(CONS* map, CONS* key);
 CONS*	map_cut(CONS* map, CONS* key);
 
 void	test_cons();
+void	cons_count_thread();
 void	report_cons_usage();
 BOOL	assert_equal_cons(char* msg, CONS* expect, CONS* actual);
 
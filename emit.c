@@ -20,7 +20,7 @@ DBUG_UNIT("emit");
 #define REDUCE_TOKEN_BRKS	" \t\r\n\b():'\""
 #define HUMUS_TOKEN_BRKS	" \t\r\n\b(),#\""
 
-static SBUF* cons_sbuf = NULL;
+static ACTOR_LOCAL SBUF* cons_sbuf = NULL;
 
 #define	CONS_BUFSZ	1024
 #define	CHILD_DEPTH	3
@@ -92,7 +92,7 @@ tail_to_str(int depth, int length, char* buf, CONS* cons)
 char*
 cons_to_str(CONS* cons)		/* warning: returns pointer to static buffer, do not nest calls! */
 {
-	static char buf[CONS_BUFSZ];
+	static ACTOR_LOCAL char buf[CONS_BUFSZ];
 
 	XDBUG_ENTER("cons_to_str");
 	depth_to_str(CHILD_DEPTH, buf, cons);
@@ -249,7 +249,7 @@ file_emit(char c, void* ctx)
 	assert(c == e);
 }
 
-static int emit_depth = 0;
+static ACTOR_LOCAL int emit_depth = 0;
 #define	EMIT_DEPTH_LIMIT	6
 #define	EMIT_LENGTH_LIMIT	9
 
@@ -1,24 +1,180 @@
 /*
  * gc.c -- garbage collected cell management
  *
- * This algorithm is based on Henry Baker's "Treadmill"
+ * This algorithm is based on Henry Baker's "Treadmill",
+ * extended with a young generation and a remembered set.
+ *
+ * When GC_PACKED_HEAP is set, cells are bare two-word CONS
+ * packed into aligned chunks, with phase marks kept in
+ * per-chunk side bitmaps instead of treadmill links.
  *
  * Copyright 2009-2017 Dale Schumacher.  ALL RIGHTS RESERVED.
  */
+#define	_GNU_SOURCE		/* for clock_gettime(), sysconf() */
+#include <time.h>			/* clock_gettime(), struct timespec */
+#include <signal.h>			/* sig_atomic_t */
 #include "gc.h"
 #include "abe.h"
+#include "arena.h"
+#if GC_PARALLEL_MARK || GC_COLLECTOR_THREAD || !GC_PACKED_HEAP
+#include <pthread.h>
+#include <sched.h>			/* sched_yield() */
+#include <unistd.h>			/* sysconf() */
+#endif
+#if GC_COLLECTOR_THREAD && GC_PACKED_HEAP
+#error "GC_COLLECTOR_THREAD requires the treadmill heap layout"
+#endif
 
 #include "dbug.h"
 DBUG_UNIT("gc");
 
 static WORD	gc_phase__mark = GC_PHASE_INIT;	/* current GC phase marker */
 static WORD	gc_phase__prev = GC_PHASE_INIT;	/* previous GC phase marker */
+static BOOL	gc_major__cycle = FALSE;		/* TRUE if old cells are being collected */
+static WORD	gc_major__threshold = 0;		/* old cells that trigger a major cycle */
+#if !GC_PACKED_HEAP
+static WORD	gc_promote__cnt = 0;			/* cells promoted to the old generation */
+#endif
+
+#define	GC_MAJOR_MINIMUM	as_word(1 << 16)	/* least old cells before a major cycle */
+
+static WORD	gc_low__water = GC_LOW_WATER;		/* free cells that trigger a collection */
+static WORD	gc_high__water = GC_HIGH_WATER;		/* least free cells after heap growth */
+static WORD	gc_growth__ratio = GC_GROWTH_RATIO;	/* heap size target, percent of live cells */
+static WORD	gc_heap__growth = GC_HEAP_GROWTH;	/* heap added when cells run out, percent of heap */
+static WORD	gc_retain__cells = GC_RETAIN_CELLS;	/* free cells never returned to the OS */
+static WORD	gc_heap__limit = 0;				/* most collectable cells (0 = no limit) */
+static WORD	gc_heap__ceiling = 0;			/* most collectable cells for now, see gc_emergency() */
+static BOOL	gc_heap__exhausted = FALSE;		/* live (or permanent) cells did not fit under the limit */
+static WORD	gc_heap__cnt = 0;				/* collectable cells in the heap */
+static WORD	gc_perm__cnt = 0;				/* allocated permanent cells */
+static WORD	gc_scan__rate = 0;				/* cells scanned per allocation during a cycle */
+static BOOL	gc_cycle__active = FALSE;		/* TRUE while a concurrent collection runs */
+static WORD	gc_scan__batch = GC_SCAN_BATCH;		/* cells scanned per scanning actor message */
+static WORD	gc_scan__budget = GC_SCAN_BUDGET;	/* microseconds per scanning actor message */
+
+static int	gc_mark__threads = 0;			/* threads marking in a full collection (0 = #cpus) */
+static BOOL	gc_collect__requested = FALSE;	/* see gc_request_collection() */
+static volatile sig_atomic_t gc_snap__requested = 0;	/* see gc_request_snapshot() */
+
+static GC_STATS			gc_stats__total;	/* collector statistics, see gc_get_stats() */
+static struct timespec	gc_stats__time;		/* end of the last cycle */
+static WORD				gc_stats__alloc = 0;	/* cells allocated at the end of the last cycle */
+
+/*
+ * A weak reference is a collectable cell holding its target (in first)
+ * and the next weak reference (in rest) disguised as numbers, so the
+ * collector does not trace through either of them.
+ */
+static CONS*	gc_weak__list = NULL;		/* every weak reference, see gc_weak() */
+
+#if GC_COMPRESSED_REFS
+#define	GC_HIDE(p)		gc_hide(p)
+#define	GC_UNHIDE(s)	gc_unhide(s)
+#else
+#define	GC_HIDE(p)		MK_NUMBER(p)
+#define	GC_UNHIDE(s)	as_cons(MK_PTR(s))
+#endif
+
+#define	GC_WEAK_TARGET(w)	GC_UNHIDE(GC_FIRST(w))
+#define	GC_WEAK_NEXT(w)		GC_UNHIDE(GC_REST(w))
+
+/*
+ * A finalizer registration holds its cell without tracing it, like a weak
+ * reference, but its behavior and state are roots of every collection.
+ */
+typedef struct gc_final GC_FINAL;
+struct gc_final {
+	GC_FINAL*	next;
+	CONS*		cell;					/* registered cell (not traced) */
+	CONS*		beh;					/* finalizer behavior */
+	CONS*		state;					/* finalizer state */
+};
+
+static GC_FINAL*	gc_final__list = NULL;	/* registered cells, see gc_finalize() */
+static GC_FINAL*	gc_final__ready = NULL;	/* unreachable cells, see gc_next_finalizer() */
+
+/*
+ * A root set is a callback that visits the roots held outside the heap,
+ * such as the references and message queues of a configuration.
+ */
+typedef struct gc_root_set GC_ROOT_SET;
+struct gc_root_set {
+	GC_ROOT_SET*	next;
+	GC_ROOTS		roots;				/* visit each root of <ctx> */
+	void*			ctx;
+};
+
+static GC_ROOT_SET*	gc_root__sets = NULL;	/* see gc_add_roots() */
+
+#define	GC_SCAN_CHECK		as_word(64)			/* cells scanned between clock checks */
+#define	GC_SCAN_BATCH_MAX	as_word(1 << 20)	/* largest adaptive batch */
+
+#if GC_PACKED_HEAP
+static WORD	gc_free__cnt = 0;				/* unallocated collectable cells */
+#define	GC_FREE_COUNT	(gc_free__cnt)
+#else
+#define	GC_FREE_COUNT	GC_SIZE(GC_FREE_LIST)
+#endif
+
+static void	gc_grow_heap(WORD n);		/* forward */
+static WORD	gc_growth_step();			/* forward */
+static void	gc_release_chunks(WORD keep);	/* forward */
+static void	gc_check_limit();			/* forward */
+static void	gc_out_of_memory(char* what);	/* forward */
+static void	gc_clear_weak();			/* forward */
+static void	gc_queue_finalizers();		/* forward */
+static void	gc_visit_roots(GC_VISIT visit);	/* forward */
+static void	gc_scan_roots(CONS* root);	/* forward */
+
+#if GC_COLLECTOR_THREAD
+
+#define	GC_THREAD_IDLE	0				/* collector thread waiting for a cycle */
+#define	GC_THREAD_SCAN	1				/* collector thread scanning */
+#define	GC_THREAD_DONE	2				/* scan list was empty, waiting for gc_free_cells() */
+
+static pthread_mutex_t	gc_thread__lock = PTHREAD_MUTEX_INITIALIZER;	/* guards the treadmill */
+static pthread_cond_t	gc_thread__wake = PTHREAD_COND_INITIALIZER;		/* signals a new cycle */
+static pthread_t		gc_thread__id;
+static BOOL				gc_thread__started = FALSE;
+static volatile int		gc_thread__state = GC_THREAD_IDLE;
+static volatile int		gc_thread__waiting = 0;	/* mutator threads waiting for the lock */
+
+static BOOL
+gc_lock()
+/* exclude the collector thread while a cycle is active, return TRUE if locked */
+{
+	if (!gc_cycle__active) {
+		return FALSE;		/* collector thread is idle */
+	}
+	__sync_fetch_and_add(&gc_thread__waiting, 1);
+	pthread_mutex_lock(&gc_thread__lock);
+	__sync_fetch_and_sub(&gc_thread__waiting, 1);
+	return TRUE;
+}
+
+static void
+gc_unlock(BOOL locked)
+/* release the lock taken by gc_lock() */
+{
+	if (locked) {
+		pthread_mutex_unlock(&gc_thread__lock);
+	}
+}
+
+#else
+
+#define	gc_lock()			(FALSE)
+#define	gc_unlock(locked)	((void)(locked))
 
-CELL	gc_aged__cell = { as_cons(as_word(0)), NIL, GC_PHASE_Z, as_word(0) };
-CELL	gc_scan__cell = { as_cons(as_word(0)), NIL, GC_PHASE_Z, as_word(0) };
-CELL	gc_fresh__cell = { as_cons(as_word(0)), NIL, GC_PHASE_Z, as_word(0) };
-CELL	gc_free__cell = { as_cons(as_word(0)), NIL, GC_PHASE_Z, as_word(0) };
-CELL	gc_perm__cell = { as_cons(as_word(0)), NIL, GC_PHASE_Z, as_word(0) };
+#endif /* GC_COLLECTOR_THREAD */
+
+CELL	gc_aged__cell = { as_ref(0), GC_NIL_REF, GC_PHASE_Z, as_word(0) };
+CELL	gc_scan__cell = { as_ref(0), GC_NIL_REF, GC_PHASE_Z, as_word(0) };
+CELL	gc_fresh__cell = { as_ref(0), GC_NIL_REF, GC_PHASE_Z, as_word(0) };
+CELL	gc_free__cell = { as_ref(0), GC_NIL_REF, GC_PHASE_Z, as_word(0) };
+CELL	gc_old__cell = { as_ref(0), GC_NIL_REF, GC_PHASE_Z, as_word(0) };
+CELL	gc_rset__cell = { as_ref(0), GC_NIL_REF, GC_PHASE_Z, as_word(0) };
 
 static void
 gc_initialize()
@@ -29,6 +185,7 @@ gc_initialize()
 	DBUG_PRINT("", ("gc_initialize"));
 	gc_phase__prev = GC_PHASE_0;
 	gc_phase__mark = GC_PHASE_1;
+	gc_major__threshold = GC_MAJOR_MINIMUM;
 
 	DBUG_PRINT("", ("AGED = %p", GC_AGED_LIST));
 	GC_SET_NEXT(GC_AGED_LIST, GC_AGED_LIST);
@@ -46,11 +203,15 @@ gc_initialize()
 	GC_SET_NEXT(GC_FREE_LIST, GC_FREE_LIST);
 	GC_SET_PREV(GC_FREE_LIST, GC_FREE_LIST);
 
-	DBUG_PRINT("", ("PERM = %p", GC_PERM_LIST));
-	GC_SET_NEXT(GC_PERM_LIST, GC_PERM_LIST);
-	GC_SET_PREV(GC_PERM_LIST, GC_PERM_LIST);
+	DBUG_PRINT("", ("OLD = %p", GC_OLD_LIST));
+	GC_SET_NEXT(GC_OLD_LIST, GC_OLD_LIST);
+	GC_SET_PREV(GC_OLD_LIST, GC_OLD_LIST);
+
+	DBUG_PRINT("", ("RSET = %p", GC_RSET_LIST));
+	GC_SET_NEXT(GC_RSET_LIST, GC_RSET_LIST);
+	GC_SET_PREV(GC_RSET_LIST, GC_RSET_LIST);
 
-	DBUG_HEXDUMP(GC_AGED_LIST, 5 * sizeof(CELL)); /**/
+	DBUG_HEXDUMP(GC_AGED_LIST, 7 * sizeof(CELL)); /**/
 }
 
 void
@@ -192,14 +353,9 @@ gc_sanity_check(CELL* list)
 }
 
 static void
-gc_age_cells()
-/* move "fresh" cells to the "aged" list for possible collection */
+gc_flip_phase()
+/* exchange current and previous phase markers */
 {
-	DBUG_ENTER("gc_age_cells");
-	DBUG_PRINT("gc", ("%u cells available in free list", GC_SIZE(GC_FREE_LIST)));
-	DBUG_PRINT("gc", ("moving %u cells from fresh to aged", GC_SIZE(GC_FRESH_LIST)));
-	gc_append_list(GC_AGED_LIST, GC_FRESH_LIST);
-	DBUG_PRINT("gc", ("%u cells on aged list to be scanned", GC_SIZE(GC_AGED_LIST)));
 	if (gc_phase__mark == GC_PHASE_0) {
 		gc_phase__prev = GC_PHASE_0;
 		gc_phase__mark = GC_PHASE_1;
@@ -208,265 +364,4185 @@ gc_age_cells()
 		gc_phase__mark = GC_PHASE_0;
 	}
 	DBUG_PRINT("gc", ("gc_phase = 0x%x", gc_phase__mark));
-	DBUG_RETURN;
 }
 
-static void
-gc_scan_cell(CELL* p)
-/* move a live cell (from the "aged" list) to the "scan" list */
+static WORD
+gc_elapsed_us(struct timespec* t0)
+/* microseconds elapsed since <t0> */
 {
-	WORD mark;
+	struct timespec t1;
 
-	DBUG_ENTER("gc_scan_cell");
-	DBUG_PRINT("gc", ("p = %p", p));
-	mark = GC_MARK(p);
-	if (mark == gc_phase__mark) {
-		DBUG_PRINT("gc", ("cell already marked"));
-		DBUG_RETURN;		/* cell already marked in this phase */
+	if (clock_gettime(CLOCK_MONOTONIC, &t1) != 0) {
+		return 0;
 	}
-	assert(mark == gc_phase__prev);
-	GC_SET_SIZE(GC_AGED_LIST, GC_SIZE(GC_AGED_LIST) - 1);
-	p = gc_extract(p);	
-	GC_SET_MARK(p, gc_phase__mark);
-	gc_put(GC_SCAN_LIST, p);
-	DBUG_RETURN;
+	return (((t1.tv_sec - t0->tv_sec) * 1000000) + ((t1.tv_nsec - t0->tv_nsec) / 1000));
 }
 
-static BOOL
-gc_scan_value(CONS* s)
-/* consider a value for addition to the "scan" list, return TRUE if queued */
+static WORD
+gc_lap_us(struct timespec* t)
+/* microseconds elapsed since <t>, which is then reset to now */
 {
-	DBUG_ENTER("gc_scan_value");
-	DBUG_PRINT("gc", ("s = 16#%08lx", (ulint)s));
-	if (!nilp(s)) {
-		if (actorp(s)) {
-			s = MK_CONS(s);
-		}
-		if (consp(s)) {
-			gc_scan_cell(as_cell(s));
-			DBUG_RETURN TRUE;
-		}
+	struct timespec t1;
+	WORD us;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t1) != 0) {
+		return 0;
 	}
-	DBUG_RETURN FALSE;
+	us = ((t1.tv_sec - t->tv_sec) * 1000000) + ((t1.tv_nsec - t->tv_nsec) / 1000);
+	*t = t1;
+	return us;
 }
 
-static BOOL
-gc_refresh_cell()
-/* process a cell from the "scan" list, return FALSE if none remain */
+static void
+gc_record_pause(WORD us)
+/* count a pause of <us> microseconds in the statistics */
 {
-	CELL* p;
+	int i = 0;
 
-	DBUG_ENTER("gc_refresh_cell");
-	if (GC_SIZE(GC_SCAN_LIST) == 0) {
-		DBUG_PRINT("gc", ("empty scan list"));
-		DBUG_RETURN FALSE;
+	++gc_stats__total.pause_cnt;
+	gc_stats__total.pause_us += us;
+	if (us > gc_stats__total.pause_max_us) {
+		gc_stats__total.pause_max_us = us;
 	}
-	p = gc_pop(GC_SCAN_LIST);
-	assert(p != NULL);
-	gc_scan_value(GC_FIRST(p));
-	gc_scan_value(GC_REST(p));
-	gc_push(GC_FRESH_LIST, p);
-	DBUG_RETURN TRUE;
+	while ((i < (GC_PAUSE_BUCKETS - 1)) && (us >= (as_word(2) << i))) {
+		++i;
+	}
+	++gc_stats__total.pause_hist[i];
 }
 
 static void
-gc_free_cells()
-/* move unmarked "aged" cells to "free" list after scanning */
+gc_start_cycle()
+/* count the start of a collection cycle in the statistics */
 {
-	DBUG_ENTER("gc_free_cells");
-	DBUG_PRINT("gc", ("%u cells marked in-use on fresh list", GC_SIZE(GC_FRESH_LIST)));
-	gc_append_list(GC_FREE_LIST, GC_AGED_LIST);	
-	DBUG_PRINT("gc", ("%u cells available in free list", GC_SIZE(GC_FREE_LIST)));
-#if 1	/* FIXME: eventually remove these checks for better performance */
-	gc_sanity_check(GC_AGED_LIST);
-	gc_sanity_check(GC_SCAN_LIST);
-	gc_sanity_check(GC_FRESH_LIST);
-	gc_sanity_check(GC_FREE_LIST);
-#endif
-	DBUG_RETURN;
+	gc_cycle__active = TRUE;
+	++gc_stats__total.cycles_started;
+	if (GC_PACKED_HEAP || gc_major__cycle) {
+		++gc_stats__total.major_cycles;
+	}
 }
 
-void
-gc_full_collection(CONS* root)
-/* perform a full garbage collection (NOT CONCURRENT!) */
+static void
+gc_pace_heap(BOOL full)
+/* grow the heap toward its target size, or return chunks beyond it after a <full> cycle */
 {
-	DBUG_ENTER("gc_full_collection");
-	gc_age_cells();
-	assert(consp(root));
-	if (!nilp(root)) {
-		gc_scan_cell(as_cell(root));	/* scan "root" */
+	WORD live;
+	WORD target;
+
+	DBUG_ENTER("gc_pace_heap");
+	live = gc_heap__cnt - GC_FREE_COUNT;
+	target = (live / 100) * (gc_growth__ratio - 100);	/* free cells to allocate before next cycle */
+	if (target < gc_high__water) {
+		target = gc_high__water;
+	}
+	DBUG_PRINT("gc", ("%lu live cells, %lu free, target %lu", live, GC_FREE_COUNT, target));
+	if (GC_FREE_COUNT < target) {
+		gc_grow_heap(target);
+	} else if (full) {		/* the treadmill walks the free list to find empty chunks */
+		gc_release_chunks((target > gc_retain__cells) ? target : gc_retain__cells);
 	}
-	while (gc_refresh_cell() == TRUE)
-		;
-	gc_free_cells();
 	DBUG_RETURN;
 }
 
-/**
-gc_scanning_actor:
-	BEHAVIOR {}
-	$ignored -> [
-		IF gc_refresh_cell() [
-			SEND SELF NIL
-		] ELSE [
-			gc_free_cells()
-		]
-	]
-	DONE
-**/
-BEH_DECL(gc_scanning_actor)
+static void
+gc_pace_cycle(BOOL full)
+/* end a (<full>) collection cycle, growing the heap toward its target size */
 {
-	DBUG_ENTER("gc_scanning_actor");
-	if (gc_refresh_cell() == TRUE) {
-		SEND(SELF, NIL);			/* more aged cells to scan */
+	WORD us;
+	WORD n;
+
+	DBUG_ENTER("gc_pace_cycle");
+	gc_cycle__active = FALSE;
+#if GC_COLLECTOR_THREAD
+	gc_thread__state = GC_THREAD_IDLE;
+#endif
+	gc_scan__rate = 0;
+	++gc_stats__total.cycles_completed;
+	n = gc_stats__total.cells_allocated - gc_stats__alloc;
+	if (gc_stats__time.tv_sec != 0) {
+		us = gc_lap_us(&gc_stats__time);
+		gc_stats__total.alloc_rate = ((us > 0) ? ((n * 1000000) / us) : 0);
 	} else {
-		gc_free_cells();			/* scanning complete */
+		clock_gettime(CLOCK_MONOTONIC, &gc_stats__time);	/* first cycle */
 	}
+	gc_stats__alloc = gc_stats__total.cells_allocated;
+	gc_pace_heap(full);
 	DBUG_RETURN;
 }
 
-void
-gc_actor_collection(CONFIG* cfg, CONS* root)
-/* initiate actor-based (CONCURRENT) garbage collection */
+#define	GC_CHUNK_BITS	16
+#define	GC_CHUNK_SIZE	(1 << GC_CHUNK_BITS)				/* 64Kb chunks */
+
+/*
+ * The chunk map is a two-level radix table from a cell address to its chunk.
+ * The top level is indexed by address bits 32..46, each leaf by bits 16..31.
+ * Cells outside the heap (NIL, the CONFIG queue) map to NULL.
+ */
+#define	GC_MAP_TOP		(1 << 15)
+#define	GC_MAP_LEAF		(1 << (32 - GC_CHUNK_BITS))
+#define	GC_MAP_HI(a)	(((a) >> 32) & (GC_MAP_TOP - 1))
+#define	GC_MAP_LO(a)	(((a) >> GC_CHUNK_BITS) & (GC_MAP_LEAF - 1))
+
+typedef struct gc_chunk GC_CHUNK;	/* defined by each heap layout */
+
+static GC_CHUNK**	gc_chunk__map[GC_MAP_TOP];		/* cell address -> chunk */
+static GC_CHUNK*	gc_heap__chunks = NULL;			/* chunks of collectable cells */
+static GC_CHUNK*	gc_spare__chunks = NULL;		/* empty chunks returned to the OS */
+
+static void
+gc_map_chunk(GC_CHUNK* c, void* p)
+/* enter chunk <c>, starting at <p>, in the chunk map */
 {
-	CONS* actor;
+	GC_CHUNK** leaf;
+	WORD a = as_word(p);
 
-	DBUG_ENTER("gc_actor_collection");
-	gc_age_cells();			/* cells allocated after this are "fresh" */
-	assert(consp(root));
-	if (!nilp(root)) {
-		gc_scan_cell(as_cell(root));	/* scan "root" */
+	assert((a >> 47) == 0);		/* beyond the reach of the chunk map */
+	leaf = gc_chunk__map[GC_MAP_HI(a)];
+	if (leaf == NULL) {
+		leaf = NEWxN(GC_CHUNK*, GC_MAP_LEAF);
+		assert(leaf != NULL);
+		gc_chunk__map[GC_MAP_HI(a)] = leaf;
 	}
-	actor = CFG_ACTOR(cfg, gc_scanning_actor, NIL);
-	CFG_SEND(cfg, actor, NIL);
-	DBUG_RETURN;
+	leaf[GC_MAP_LO(a)] = c;
 }
 
-#if 0
-#define	GC_CELLS_ALLOCATED	((1 << 8) / sizeof(CELL))		/* 256b allocation */
-#else
-#define	GC_CELLS_ALLOCATED	((1 << 12) / sizeof(CELL))		/* 4Kb allocation */
+static GC_CHUNK*
+gc_chunk_of(void* p)
+/* find the chunk containing cell <p>, NULL if not in the heap */
+{
+	WORD a = as_word(p);
+	GC_CHUNK** leaf = gc_chunk__map[GC_MAP_HI(a)];
+
+	return (leaf ? leaf[GC_MAP_LO(a)] : NULL);
+}
+
+#if GC_PACKED_HEAP
+
+#define	GC_CHUNK_CELLS	(GC_CHUNK_SIZE / sizeof(CONS))		/* 4096 cells per chunk */
+#define	GC_WORD_BITS	(8 * sizeof(ulint))
+#define	GC_CHUNK_WORDS	(GC_CHUNK_CELLS / GC_WORD_BITS)		/* 64 bitmap words per chunk */
+
+#define	GC_CHUNK_HEAP	1		/* chunk of collectable cells */
+#define	GC_CHUNK_PERM	2		/* chunk of permanent cells */
+#define	GC_CHUNK_SPARE	3		/* empty chunk, memory returned to the OS */
+
+struct gc_chunk {
+	GC_CHUNK*	next;					/* next chunk of the same kind */
+	CONS*		base;					/* first cell (chunk aligned) */
+	int			kind;					/* GC_CHUNK_HEAP, GC_CHUNK_PERM or GC_CHUNK_SPARE */
+	WORD		free;					/* number of unallocated cells */
+	WORD		hint;					/* first bitmap word that may have free cells */
+	ulint		used[GC_CHUNK_WORDS];	/* 1 = allocated cell */
+	ulint		mark[GC_CHUNK_WORDS];	/* 1 = marked in GC_PHASE_1, 0 = GC_PHASE_0 */
+#if GC_CDR_CODING
+	ulint		code[GC_CHUNK_WORDS];	/* 1 = cell holds two coded elements */
+	ulint		split[2 * GC_CHUNK_WORDS];	/* 1 = slot refers to the cell replacing its element */
 #endif
+};
 
-static void
-gc_allocate_cells(CELL* list_head)
-/* allocate a new block of free cells */
-{
-	size_t n;
-	CELL* p;
-	char* tag;
+#define	GC_BIT_WORD(i)	((i) / GC_WORD_BITS)
+#define	GC_BIT_MASK(i)	(1UL << ((i) % GC_WORD_BITS))
+#define	GC_PHASE_BITS	((gc_phase__mark == GC_PHASE_1) ? ~0UL : 0UL)
+#define	GC_AGED(c,i)	(((c)->mark[GC_BIT_WORD(i)] ^ GC_PHASE_BITS) & GC_BIT_MASK(i))
+#define	GC_REFRESH(c,i)	((c)->mark[GC_BIT_WORD(i)] ^= GC_BIT_MASK(i))
+#define	GC_SET_FRESH(c,i) ((c)->mark[GC_BIT_WORD(i)] = ((c)->mark[GC_BIT_WORD(i)] \
+							& ~GC_BIT_MASK(i)) | (GC_PHASE_BITS & GC_BIT_MASK(i)))
+#define	GC_CELL_INDEX(c,p)	((as_word(p) - as_word((c)->base)) / as_word(sizeof(CONS)))
 
-	DBUG_ENTER("gc_alloc_cells");
-	gc_initialize();
-	tag = ((list_head == GC_FREE_LIST) ? "free" : "permanent");
-	n = GC_CELLS_ALLOCATED;		/* 4Kb allocation */
-#if 0
-	p = NEWxN(CELL, n + 1);
-	p = as_cell((as_word(p) + (sizeof(CELL) >> 1)) & ~(sizeof(CELL) - 1)); /* align */
+#if defined(__GNUC__)
+#define	gc_lowest_bit(x)	__builtin_ctzl(x)
+#define	gc_count_bits(x)	__builtin_popcountl(x)
 #else
-	p = NEWxN(CELL, n);
-#endif
-	DBUG_PRINT("gc", ("%lu %s cells allocated starting at %p", n, tag, p));
-	while (n > 0) {
-		--n;
-		GC_SET_MARK(p, GC_PHASE_Z);
-		gc_put(list_head, p);
-		++p;
+static int
+gc_lowest_bit(ulint x)
+{
+	int n = 0;
+
+	while (!(x & 1)) {
+		x >>= 1;
+		++n;
 	}
-	DBUG_PRINT("gc", ("%lu cells available in %s list", GC_SIZE(list_head), tag));
-	DBUG_RETURN;
+	return n;
 }
 
-CONS*
-gc_perm(CONS* first, CONS* rest)
-/* allocate and initialize a permanent cell (never garbage collected) */
+static int
+gc_count_bits(ulint x)
 {
-	CELL* p;
-	CONS* s;
+	int n = 0;
 
-	if (GC_SIZE(GC_PERM_LIST) == 0) {
-		gc_allocate_cells(GC_PERM_LIST);
+	while (x) {
+		x &= (x - 1);
+		++n;
 	}
-	p = gc_pop(GC_PERM_LIST);
-	assert(p != NULL);
-	GC_SET_MARK(p, GC_PHASE_X);
-	GC_SET_FIRST(p, first);
-	GC_SET_REST(p, rest);
-	s = as_cons(p);
-	assert(consp(s));
-	return s;
+	return n;
 }
+#endif
 
-CONS*
-gc_cons(CONS* first, CONS* rest)
-/* allocate and initialize a new "cons" cell */
+static GC_CHUNK*	gc_perm__chunks = NULL;			/* chunks of permanent cells */
+static GC_CHUNK*	gc_alloc__chunk = NULL;			/* chunk currently allocated from */
+static CONS**		gc_mark__stack = NULL;			/* marked cells waiting to be scanned */
+static WORD			gc_mark__depth = 0;				/* cells on the mark stack */
+static WORD			gc_mark__limit = 0;				/* capacity of the mark stack */
+
+#if GC_CDR_CODING
+
+/*
+ * A coded cell holds two list elements, one per slot, and no rest pointer.
+ * The rest of an element is the next slot, so the rest of the second
+ * element is the following cell. An element is referred to by the address
+ * of its slot. gc_list() lays out a run of coded cells ending in a normal
+ * cell, inside one bitmap word, so a run never leaves its chunk. Marking a
+ * coded cell marks the following cell too. Storing the rest of a coded
+ * element splits it off: a normal cell takes its place, and the slot
+ * refers to that cell (flagged in the split bitmap).
+ */
+#define	GC_SLOT_INDEX(c,s)	((as_word(s) - as_word((c)->base)) / as_word(sizeof(CONS*)))
+#define	GC_CELL_OF(s)		as_cons(as_word(s) & ~as_word(sizeof(CONS) - 1))
+#define	GC_RUN_MAX			as_word(2 * (GC_WORD_BITS - 1))	/* most elements in a run */
+
+static BOOL
+gc_coded_cell(CONS* p)
+/* return TRUE if heap cell <p> holds two coded elements */
 {
-	CELL* p;
-	CONS* s;
+	GC_CHUNK* c = gc_chunk_of(p);
+	WORD i;
 
-	if (GC_SIZE(GC_FREE_LIST) == 0) {
-		gc_allocate_cells(GC_FREE_LIST);
+	if (c == NULL) {
+		return FALSE;
 	}
-	p = gc_pop(GC_FREE_LIST);
-	assert(p != NULL);
-	GC_SET_MARK(p, gc_phase__mark);
-	GC_SET_FIRST(p, first);
-	GC_SET_REST(p, rest);
-	gc_put(GC_FRESH_LIST, p);
-	/* FIXME: start gc scan if too few free cells remain */
-	s = as_cons(p);
-	assert(consp(s));
-	return s;
+	i = GC_CELL_INDEX(c, p);
+	return ((c->code[GC_BIT_WORD(i)] & GC_BIT_MASK(i)) ? TRUE : FALSE);
 }
 
-static CELL*
-gc_check_access(CONS* cell)
-/* ensure that accessed cells are considered "live" */
+#endif /* GC_CDR_CODING */
+
+#if GC_COMPRESSED_REFS
+
+/*
+ * Every cell (permanent or collectable) lies in a single arena, so a cell
+ * holds 32-bit references (REF) rather than 64-bit values:
+ *	2#...xxx1	fixnum, 31 bits (signed)
+ *	2#...x000	cons, byte offset from gc_ref__base (cells are 8-byte aligned)
+ *	2#...x010	actor
+ *	2#...x100	atom
+ *	2#...x110	wide value, index in the wide value table
+ * Offsets below the first chunk are never cells: offset 0 is NIL, and
+ * offset 8 is the null pointer (BOOLEAN(FALSE) and BOOLEAN(TRUE)).
+ * Wide values (larger numbers, function and native pointers) are interned.
+ * After a collection, gc_wide_reclaim() frees the entries that no allocated
+ * cell refers to, once the table has doubled since it last ran.
+ */
+#define	GC_REF_RESERVE	as_word((size_t)1 << 32)	/* bytes addressed from gc_ref__base */
+#define	GC_REF_KIND		as_word(7)					/* 2#0000...0111 */
+#define	GC_REF_WIDE		as_word(6)					/* 2#0000...0110 */
+#define	GC_REF_NULL		as_word(8)					/* offset of the null pointer */
+#define	GC_REF_FIXNUM	(as_word(1) << 30)			/* fixnums in [-2^30, 2^30) fit in a REF */
+
+#define	GC_WIDE_BITS	12
+#define	GC_WIDE_BLOCK	(1 << GC_WIDE_BITS)			/* wide values per block */
+#define	GC_WIDE_BLOCKS	(1 << 17)					/* 2^29 wide values at most */
+#define	GC_WIDE_MAX		(as_word(GC_WIDE_BLOCKS) * GC_WIDE_BLOCK)
+#define	GC_WIDE_VALUE(i)	(gc_wide__block[(i) >> GC_WIDE_BITS][(i) & (GC_WIDE_BLOCK - 1)])
+
+static ARENA*	gc_ref__arena = NULL;		/* region holding every cell */
+static char*	gc_ref__base = NULL;		/* offset 0, one chunk below the region */
+static WORD*	gc_wide__block[GC_WIDE_BLOCKS];	/* wide values, blocks never move */
+static WORD		gc_wide__cnt = 0;			/* entries used so far (live or free) */
+static WORD		gc_wide__live = 0;			/* wide values interned */
+static WORD		gc_wide__swept = 0;			/* wide values live after gc_wide_reclaim() */
+static WORD		gc_wide__free = 0;			/* index + 1 of the first free entry */
+static WORD*	gc_wide__hash = NULL;		/* open-addressed table of index + 1 */
+static WORD		gc_wide__size = 0;			/* slots in gc_wide__hash, a power of 2 */
+
+static void*
+gc_chunk_memory()
+/* take memory for a new chunk from the region addressed by references */
 {
-	CELL* p;
+	void* p;
 
-	assert(consp(cell));
-	p = as_cell(cell);
-	if (GC_MARK(p) == gc_phase__prev) {
-		gc_scan_cell(p);	/* any "aged" cell accessed must be "live", so scan it */
+	if (gc_ref__arena == NULL) {
+		gc_ref__arena = arena_new((size_t)GC_REF_RESERVE - ARENA_HUGE_PAGE);
+		if (gc_ref__arena == NULL) {
+			return NULL;
+		}
+	}
+	p = arena_take(gc_ref__arena, GC_CHUNK_SIZE, GC_CHUNK_SIZE);
+	if ((p != NULL) && (gc_ref__base == NULL)) {
+		gc_ref__base = (char*)p - GC_CHUNK_SIZE;	/* the first chunk is at offset GC_CHUNK_SIZE */
 	}
 	return p;
 }
 
-CONS*
-gc_first(CONS* cell)
+static WORD
+gc_wide_hash(WORD v)
 {
-	if (nilp(cell)) {
-		return NIL;
-	}
-	return GC_FIRST(gc_check_access(cell));
+	ulint h = (ulint)v;
+
+	h ^= (h >> 29);
+	h *= 2654435761UL;
+	return as_word(h ^ (h >> 32));
 }
 
-CONS*
-gc_rest(CONS* cell)
+static void
+gc_wide_rehash(WORD size)
+/* rebuild the wide value index with <size> slots */
 {
-	if (nilp(cell)) {
-		return NIL;
+	WORD* old = gc_wide__hash;
+	WORD n = gc_wide__size;
+	WORD i;
+	WORD j;
+
+	DBUG_ENTER("gc_wide_rehash");
+	gc_wide__size = size;
+	gc_wide__hash = NEWxN(WORD, gc_wide__size);
+	if (gc_wide__hash == NULL) {
+		gc_out_of_memory("wide values");
+	}
+	for (i = 0; i < n; ++i) {
+		if (old[i] != 0) {
+			j = gc_wide_hash(GC_WIDE_VALUE(old[i] - 1)) & (gc_wide__size - 1);
+			while (gc_wide__hash[j] != 0) {
+				j = (j + 1) & (gc_wide__size - 1);
+			}
+			gc_wide__hash[j] = old[i];
+		}
+	}
+	if (old != NULL) {
+		FREE(old);
 	}
-	return GC_REST(gc_check_access(cell));
+	DBUG_PRINT("gc", ("%lu wide values, index of %lu", gc_wide__live, gc_wide__size));
+	DBUG_RETURN;
 }
 
-void
-gc_set_first(CONS* cell, CONS* first)
+static void
+gc_wide_mark(ulint* mark, REF ref)
+/* set the bit of <mark> for the wide value entry <ref> refers to */
 {
-	assert(!nilp(cell));
-	GC_SET_FIRST(gc_check_access(cell), first);
-}
+	WORD k;
 
-void
-gc_set_rest(CONS* cell, CONS* rest)
-{
-	assert(!nilp(cell));
-	GC_SET_REST(gc_check_access(cell), rest);
+	if ((ref & GC_REF_KIND) == GC_REF_WIDE) {
+		k = as_word(ref) >> 3;
+		mark[GC_BIT_WORD(k)] |= GC_BIT_MASK(k);
+	}
+}
+
+static void
+gc_wide_reclaim()
+/* free the wide value entries no allocated cell refers to */
+{
+	ulint* mark;
+	GC_CHUNK* c;
+	CONS* p;
+	ulint bits;
+	WORD w;
+	WORD i;
+	WORD k;
+	WORD n = 0;
+
+	DBUG_ENTER("gc_wide_reclaim");
+	mark = NEWxN(ulint, GC_BIT_WORD(gc_wide__cnt) + 1);
+	if (mark == NULL) {
+		DBUG_PRINT("gc", ("no memory to mark %lu wide values", gc_wide__cnt));
+		DBUG_RETURN;
+	}
+	for (i = 0; i < 2; ++i) {
+		for (c = (i ? gc_perm__chunks : gc_heap__chunks); c != NULL; c = c->next) {
+			for (w = 0; w < GC_CHUNK_WORDS; ++w) {
+				for (bits = c->used[w]; bits != 0; bits &= (bits - 1)) {
+					p = c->base + ((w * GC_WORD_BITS) + gc_lowest_bit(bits));
+					gc_wide_mark(mark, p->first);
+					gc_wide_mark(mark, p->rest);
+				}
+			}
+		}
+	}
+	for (i = 0; i < gc_wide__size; ++i) {
+		k = gc_wide__hash[i];
+		if ((k != 0) && !(mark[GC_BIT_WORD(k - 1)] & GC_BIT_MASK(k - 1))) {
+			GC_WIDE_VALUE(k - 1) = gc_wide__free;	/* chain the free entry */
+			gc_wide__free = k;
+			gc_wide__hash[i] = 0;
+			++n;
+		}
+	}
+	FREE(mark);
+	gc_wide__live -= n;
+	gc_wide__swept = gc_wide__live;
+	if (n > 0) {
+		gc_wide_rehash(gc_wide__size);	/* removed slots broke the probe sequences */
+	}
+	DBUG_PRINT("gc", ("%lu wide values freed, %lu live", n, gc_wide__live));
+	DBUG_RETURN;
+}
+
+static WORD
+gc_wide_index(WORD v)
+/* find (or intern) wide value <v>, return its index */
+{
+	WORD i;
+	WORD k;
+
+	if ((gc_wide__free == 0) && (gc_wide__cnt >= GC_WIDE_MAX)) {
+		gc_wide_reclaim();		/* the table is full */
+	}
+	if ((2 * (gc_wide__live + 1)) > gc_wide__size) {
+		gc_wide_rehash(gc_wide__size ? (2 * gc_wide__size) : GC_WIDE_BLOCK);
+	}
+	i = gc_wide_hash(v) & (gc_wide__size - 1);
+	while ((k = gc_wide__hash[i]) != 0) {
+		if (GC_WIDE_VALUE(k - 1) == v) {
+			return (k - 1);
+		}
+		i = (i + 1) & (gc_wide__size - 1);
+	}
+	if (gc_wide__free != 0) {
+		k = gc_wide__free - 1;
+		gc_wide__free = GC_WIDE_VALUE(k);
+	} else {
+		k = gc_wide__cnt;
+		if (k >= GC_WIDE_MAX) {
+			gc_out_of_memory("wide values");
+		}
+		if (gc_wide__block[k >> GC_WIDE_BITS] == NULL) {
+			gc_wide__block[k >> GC_WIDE_BITS] = NEWxN(WORD, GC_WIDE_BLOCK);
+			if (gc_wide__block[k >> GC_WIDE_BITS] == NULL) {
+				gc_out_of_memory("wide values");
+			}
+		}
+		++gc_wide__cnt;
+	}
+	GC_WIDE_VALUE(k) = v;
+	gc_wide__hash[i] = k + 1;
+	++gc_wide__live;
+	return k;
+}
+
+REF
+gc_encode(CONS* value)
+/* return the 32-bit reference stored in a cell for <value> */
+{
+	WORD v = as_word(value);
+	WORD a;
+
+	if (TYPE_OF(v) == BF_NUMBER) {
+		a = v >> 2;
+		if ((a >= -GC_REF_FIXNUM) && (a < GC_REF_FIXNUM)) {
+			return as_ref((a << 1) | 1);
+		}
+		return as_ref((gc_wide_index(v) << 3) | GC_REF_WIDE);
+	}
+	a = v & ~BM_TYPE;
+	if (a == as_word(NIL)) {
+		a = 0;
+	} else if (a == 0) {
+		a = GC_REF_NULL;
+	} else {
+		a -= as_word(gc_ref__base);
+		assert((a >= GC_CHUNK_SIZE) && (a < GC_REF_RESERVE));	/* not a cell */
+		assert((a & GC_REF_KIND) == 0);
+	}
+	return as_ref(a | (TYPE_OF(v) << 1));
+}
+
+CONS*
+gc_decode(REF ref)
+/* return the value of the 32-bit reference <ref>, see gc_encode() */
+{
+	WORD a;
+
+	if (ref & 1) {
+		return as_cons((as_word(as_int(ref)) << 1) | 1);	/* fixnum */
+	}
+	a = as_word(ref) & ~GC_REF_KIND;
+	if ((ref & GC_REF_KIND) == GC_REF_WIDE) {
+		return as_cons(GC_WIDE_VALUE(a >> 3));
+	}
+	if (a >= GC_CHUNK_SIZE) {
+		a += as_word(gc_ref__base);
+	} else if (a == 0) {
+		a = as_word(NIL);
+	} else {
+		a = 0;
+	}
+	return as_cons(a | ((ref >> 1) & BM_TYPE));
+}
+
+static CONS*
+gc_hide(CONS* p)
+/* disguise cell reference <p> as a fixnum, see GC_WEAK_TARGET() */
+{
+	return MK_NUMBER(as_word(as_int(gc_encode(p) | 1)) >> 1);
+}
+
+static CONS*
+gc_unhide(CONS* s)
+/* return the cell reference disguised by gc_hide() */
+{
+	return gc_decode(as_ref(as_word(s) >> 1) & ~as_ref(1));
+}
+
+#endif /* GC_COMPRESSED_REFS */
+
+static void
+gc_age_cells()
+/* flip the phase, making every collectable cell "aged" at once */
+{
+	DBUG_ENTER("gc_age_cells");
+	DBUG_PRINT("gc", ("%lu cells available of %lu", gc_free__cnt, gc_heap__cnt));
+	assert(gc_mark__depth == 0);
+	gc_flip_phase();
+	DBUG_RETURN;
+}
+
+static void
+gc_scan_cell(CONS* p)
+/* mark a live "aged" cell and push it on the mark stack */
+{
+	GC_CHUNK* c;
+	WORD i;
+
+	DBUG_ENTER("gc_scan_cell");
+	DBUG_PRINT("gc", ("p = %p", p));
+	c = gc_chunk_of(p);
+	if ((c == NULL) || (c->kind != GC_CHUNK_HEAP)) {
+		DBUG_PRINT("gc", ("cell not collectable"));
+		DBUG_RETURN;
+	}
+	i = GC_CELL_INDEX(c, p);
+	assert(c->used[GC_BIT_WORD(i)] & GC_BIT_MASK(i));	/* reference to a free cell */
+	if (!GC_AGED(c, i)) {
+		DBUG_PRINT("gc", ("cell already marked"));
+		DBUG_RETURN;
+	}
+	GC_REFRESH(c, i);
+	if (gc_mark__depth >= gc_mark__limit) {
+		gc_mark__limit = (gc_mark__limit ? (2 * gc_mark__limit) : GC_CHUNK_CELLS);
+		gc_mark__stack = (CONS**)realloc(gc_mark__stack, gc_mark__limit * sizeof(CONS*));
+		assert(gc_mark__stack != NULL);
+	}
+	gc_mark__stack[gc_mark__depth++] = c->base + i;
+	DBUG_RETURN;
+}
+
+static BOOL
+gc_scan_value(CONS* s)
+/* consider a value for addition to the mark stack, return TRUE if a cell */
+{
+	DBUG_ENTER("gc_scan_value");
+	DBUG_PRINT("gc", ("s = 16#%08lx", (ulint)s));
+	if (!nilp(s)) {
+		if (actorp(s)) {
+			s = MK_CONS(s);
+		}
+		if (consp(s)) {
+			gc_scan_cell(s);
+			DBUG_RETURN TRUE;
+		}
+	}
+	DBUG_RETURN FALSE;
+}
+
+static BOOL
+gc_dying_value(CONS* s)
+/* return TRUE if <s> refers to a cell that gc_free_cells() will free */
+{
+	GC_CHUNK* c;
+	WORD i;
+
+	if (actorp(s)) {
+		s = MK_CONS(s);
+	}
+	if (!consp(s) || nilp(s)) {
+		return FALSE;
+	}
+	c = gc_chunk_of(s);
+	if ((c == NULL) || (c->kind != GC_CHUNK_HEAP)) {
+		return FALSE;
+	}
+	i = GC_CELL_INDEX(c, s);
+	return ((GC_AGED(c, i) != 0) ? TRUE : FALSE);
+}
+
+static BOOL
+gc_refresh_cell()
+/* process a cell from the mark stack, return FALSE if none remain */
+{
+	CONS* p;
+
+	DBUG_ENTER("gc_refresh_cell");
+	if (gc_mark__depth == 0) {
+		DBUG_PRINT("gc", ("empty mark stack"));
+		DBUG_RETURN FALSE;
+	}
+	p = gc_mark__stack[--gc_mark__depth];
+	++gc_stats__total.cells_scanned;
+	gc_scan_value(GC_FIRST(p));
+	gc_scan_value(GC_REST(p));
+#if GC_CDR_CODING
+	if (gc_coded_cell(p)) {
+		gc_scan_cell(p + 1);	/* rest of the second element */
+	}
+#endif
+	DBUG_RETURN TRUE;
+}
+
+static void
+gc_free_cells()
+/* sweep the bitmaps, freeing allocated cells still marked "aged" */
+{
+	GC_CHUNK* c;
+	ulint phase;
+	ulint dead;
+	WORD w;
+	WORD n;
+	WORD before = gc_free__cnt;
+
+	DBUG_ENTER("gc_free_cells");
+	assert(gc_mark__depth == 0);
+	gc_clear_weak();
+	gc_queue_finalizers();
+	phase = GC_PHASE_BITS;
+	for (c = gc_heap__chunks; c != NULL; c = c->next) {
+		for (w = 0; w < GC_CHUNK_WORDS; ++w) {	/* word-at-a-time, vectorizable */
+			dead = c->used[w] & (c->mark[w] ^ phase);
+			c->used[w] &= ~dead;
+		}
+		n = 0;
+		for (w = 0; w < GC_CHUNK_WORDS; ++w) {
+			n += gc_count_bits(~c->used[w]);
+		}
+		gc_free__cnt += n - c->free;
+		c->free = n;
+		c->hint = 0;
+	}
+#if GC_COMPRESSED_REFS
+	if (gc_wide__live > ((2 * gc_wide__swept) + GC_WIDE_BLOCK)) {
+		gc_wide_reclaim();		/* only live cells are still allocated */
+	}
+#endif
+	DBUG_PRINT("gc", ("%lu cells available of %lu", gc_free__cnt, gc_heap__cnt));
+	gc_stats__total.cells_freed += gc_free__cnt - before;
+	gc_major__cycle = FALSE;	/* every packed cycle is a full cycle */
+	gc_pace_cycle(TRUE);
+	DBUG_RETURN;
+}
+
+static void
+gc_release_chunks(WORD keep)
+/* return empty chunks to the OS, keeping at least <keep> free cells */
+{
+	GC_CHUNK** pp;
+	GC_CHUNK* c;
+	WORD n = 0;
+
+	DBUG_ENTER("gc_release_chunks");
+	pp = &gc_heap__chunks;
+	while (((c = *pp) != NULL) && (gc_free__cnt >= (keep + GC_CHUNK_CELLS))) {
+		if (c->free < GC_CHUNK_CELLS) {
+			pp = &c->next;
+			continue;
+		}
+		*pp = c->next;
+		if (gc_alloc__chunk == c) {
+			gc_alloc__chunk = NULL;
+		}
+		c->kind = GC_CHUNK_SPARE;
+		c->free = 0;
+		c->next = gc_spare__chunks;
+		gc_spare__chunks = c;
+		gc_heap__cnt -= GC_CHUNK_CELLS;
+		gc_free__cnt -= GC_CHUNK_CELLS;
+		arena_release(c->base, GC_CHUNK_SIZE);
+		++n;
+	}
+	DBUG_PRINT("gc", ("%lu chunks released, %lu cells in heap", n, gc_heap__cnt));
+	DBUG_RETURN;
+}
+
+#if GC_PARALLEL_MARK
+static BOOL
+gc_mark_atomic(CONS* p)
+/* mark an aged cell <p>, return TRUE if this thread marked it */
+{
+	GC_CHUNK* c;
+	WORD i;
+	ulint b;
+	ulint old;
+
+	c = gc_chunk_of(p);
+	if ((c == NULL) || (c->kind != GC_CHUNK_HEAP)) {
+		return FALSE;
+	}
+	i = GC_CELL_INDEX(c, p);
+	b = GC_BIT_MASK(i);
+	if (!GC_AGED(c, i)) {
+		return FALSE;			/* already marked */
+	}
+	if (GC_PHASE_BITS) {
+		old = __sync_fetch_and_or(&c->mark[GC_BIT_WORD(i)], b);
+		return ((old & b) == 0);
+	}
+	old = __sync_fetch_and_and(&c->mark[GC_BIT_WORD(i)], ~b);
+	return ((old & b) != 0);
+}
+
+static void
+gc_survive_marked()
+/* nothing to do, the sweep reads the mark bitmaps directly */
+{
+}
+#endif /* GC_PARALLEL_MARK */
+
+#define	gc_lock_shared()			(FALSE)		/* a single allocating thread */
+#define	gc_unlock_shared(locked)	((void)(locked))
+
+#else /* treadmill */
+
+#define	GC_CHUNK_CELLS	(GC_CHUNK_SIZE / sizeof(CELL))		/* 2048 cells per chunk */
+
+struct gc_chunk {
+	GC_CHUNK*	next;					/* next chunk of collectable cells */
+	CELL*		base;					/* first cell (chunk aligned) */
+	WORD		free;					/* cells on the free list, see gc_release_chunks() */
+};
+
+#define	GC_PERM_RESERVE	((size_t)1 << 30)	/* bytes reserved for permanent cells */
+#define	GC_PERM_CEILING	as_word((GC_PERM_RESERVE / sizeof(CONS) / 100) * (100 - GC_LIMIT_RESERVE))	/* see gc_perm() */
+
+static ARENA*	gc_perm__arena = NULL;		/* region of permanent cells, see gc_perm() */
+static CONS*	gc_perm__base = NULL;		/* first permanent cell */
+static CONS*	gc_perm__next = NULL;		/* next unallocated permanent cell */
+
+#define	GC_PERM_CELL(p)	((as_word(p) >= as_word(gc_perm__base)) \
+						&& (as_word(p) < as_word(gc_perm__next)))
+
+/*
+ * A thread allocation buffer lets a thread allocate without touching the
+ * shared lists. It claims GC_TLAB_CELLS free cells at a time (under a lock),
+ * and keeps the cells it allocates on its own fresh list, which
+ * gc_age_cells() hands to the collector. A thread with no buffer attached
+ * allocates from GC_FREE_LIST directly, so while buffers are attached
+ * every allocating thread must have one. Cycles (and compaction) must
+ * start while no other thread allocates.
+ */
+#define	GC_TLAB_CELLS	as_word(1 << 8)		/* free cells claimed at a time */
+
+#if defined(__GNUC__)
+#define	GC_THREAD_LOCAL	__thread
+#else
+#define	GC_THREAD_LOCAL			/* a single allocating thread */
+#endif
+
+typedef struct gc_tlab GC_TLAB;
+struct gc_tlab {
+	GC_TLAB*	next;					/* next attached buffer */
+	CELL		free;					/* list head for claimed free cells */
+	CELL		fresh;					/* list head for cells allocated since aging */
+	WORD		allocated;				/* cells allocated, not yet in gc_stats__total */
+};
+
+static GC_TLAB*			gc_tlab__list = NULL;	/* attached buffers */
+static pthread_mutex_t	gc_tlab__lock = PTHREAD_MUTEX_INITIALIZER;	/* guards refills */
+static GC_THREAD_LOCAL GC_TLAB*	gc_tlab__self = NULL;	/* buffer of the calling thread */
+static GC_THREAD_LOCAL int		gc_tlab__depth = 0;		/* times gc_tlab__lock is held by the calling thread */
+
+/*
+ * gc_tlab__lock guards the shared lists (GC_FREE_LIST included) against
+ * other allocating threads. It is taken after gc_lock(), never before,
+ * and may be taken again by the thread holding it (scanning a cell
+ * can remember it, see gc_remember_cell()).
+ */
+static void
+gc_enter_shared()
+/* take gc_tlab__lock */
+{
+	if (gc_tlab__depth++ == 0) {
+		pthread_mutex_lock(&gc_tlab__lock);
+	}
+}
+
+static void
+gc_leave_shared()
+/* release gc_tlab__lock taken by gc_enter_shared() */
+{
+	if (--gc_tlab__depth == 0) {
+		pthread_mutex_unlock(&gc_tlab__lock);
+	}
+}
+
+static BOOL
+gc_lock_shared()
+/* exclude other allocating threads while buffers are attached, return TRUE if locked */
+{
+	if (gc_tlab__list == NULL) {
+		return FALSE;		/* a single allocating thread */
+	}
+	gc_enter_shared();
+	return TRUE;
+}
+
+static void
+gc_unlock_shared(BOOL locked)
+/* release the lock taken by gc_lock_shared() */
+{
+	if (locked) {
+		gc_leave_shared();
+	}
+}
+
+static void
+gc_return_tlabs(BOOL unused)
+/* hand fresh cells (and <unused> free cells) of every buffer back to the shared lists */
+{
+	GC_TLAB* t;
+
+	for (t = gc_tlab__list; t != NULL; t = t->next) {
+		gc_append_list(GC_FRESH_LIST, &t->fresh);
+		if (unused) {
+			gc_append_list(GC_FREE_LIST, &t->free);
+		}
+		gc_stats__total.cells_allocated += t->allocated;
+		t->allocated = 0;
+	}
+}
+
+static void
+gc_age_old_list(CELL* list)
+/* demote cells on an old-generation <list> so they may be collected */
+{
+	CELL* p;
+
+	for (p = GC_NEXT(list); p != list; p = GC_NEXT(p)) {
+		GC_SET_MARK(p, gc_phase__mark);		/* becomes "previous" at phase flip */
+		GC_SET_FLAGS(p, GC_FLAG_AGE);		/* survivors are promoted again */
+	}
+	gc_append_list(GC_AGED_LIST, list);
+}
+
+static void gc_scan_remembered();	/* forward */
+
+static void
+gc_age_cells()
+/* move "fresh" (young) cells to the "aged" list for possible collection */
+{
+	DBUG_ENTER("gc_age_cells");
+	DBUG_PRINT("gc", ("%u cells available in free list", GC_SIZE(GC_FREE_LIST)));
+	gc_return_tlabs(FALSE);
+	DBUG_PRINT("gc", ("moving %u cells from fresh to aged", GC_SIZE(GC_FRESH_LIST)));
+	gc_append_list(GC_AGED_LIST, GC_FRESH_LIST);
+	if (gc_major__cycle) {
+		DBUG_PRINT("gc", ("moving %u old cells to aged", GC_SIZE(GC_OLD_LIST) + GC_SIZE(GC_RSET_LIST)));
+		gc_age_old_list(GC_OLD_LIST);
+		gc_age_old_list(GC_RSET_LIST);
+	}
+	DBUG_PRINT("gc", ("%u cells on aged list to be scanned", GC_SIZE(GC_AGED_LIST)));
+	gc_flip_phase();
+	gc_scan_remembered();	/* old-to-young references are roots of a minor cycle */
+	DBUG_RETURN;
+}
+
+static void
+gc_scan_cell(CELL* p)
+/* move a live cell (from the "aged" list) to the "scan" list */
+{
+	WORD mark;
+
+	DBUG_ENTER("gc_scan_cell");
+	DBUG_PRINT("gc", ("p = %p", p));
+	mark = GC_MARK(p);
+	if (mark != gc_phase__prev) {
+		DBUG_PRINT("gc", ("cell already marked (or not collectable)"));
+		DBUG_RETURN;		/* cell already marked in this phase, or old */
+	}
+	GC_SET_SIZE(GC_AGED_LIST, GC_SIZE(GC_AGED_LIST) - 1);
+	p = gc_extract(p);	
+	GC_SET_MARK(p, gc_phase__mark);
+	gc_put(GC_SCAN_LIST, p);
+	DBUG_RETURN;
+}
+
+static BOOL
+gc_scan_value(CONS* s)
+/* consider a value for addition to the "scan" list, return TRUE if queued */
+{
+	DBUG_ENTER("gc_scan_value");
+	DBUG_PRINT("gc", ("s = 16#%08lx", (ulint)s));
+	if (!nilp(s)) {
+		if (actorp(s)) {
+			s = MK_CONS(s);
+		}
+		if (consp(s) && !GC_PERM_CELL(s)) {
+			gc_scan_cell(as_cell(s));
+			DBUG_RETURN TRUE;
+		}
+	}
+	DBUG_RETURN FALSE;
+}
+
+static BOOL
+gc_young_value(CONS* s)
+/* return TRUE if <s> refers to a collectable cell in the young generation */
+{
+	WORD mark;
+
+	if (actorp(s)) {
+		s = MK_CONS(s);
+	}
+	if (!consp(s) || nilp(s) || GC_PERM_CELL(s)) {
+		return FALSE;
+	}
+	mark = GC_MARK(as_cell(s));
+	return ((mark == gc_phase__mark) || (mark == gc_phase__prev));
+}
+
+static BOOL
+gc_dying_value(CONS* s)
+/* return TRUE if <s> refers to a cell that gc_free_cells() will free */
+{
+	if (actorp(s)) {
+		s = MK_CONS(s);
+	}
+	if (!consp(s) || nilp(s) || GC_PERM_CELL(s)) {
+		return FALSE;
+	}
+	return (GC_MARK(as_cell(s)) == gc_phase__prev);
+}
+
+static void
+gc_remember_cell(CELL* p)
+/* move an old cell <p> to the remembered set */
+{
+	BOOL locked;
+
+	assert(GC_FLAGS(p) & GC_FLAG_OLD);
+	locked = gc_lock_shared();	/* check again, another thread may remember it */
+	if (!(GC_FLAGS(p) & GC_FLAG_RSET)) {
+		GC_SET_SIZE(GC_OLD_LIST, GC_SIZE(GC_OLD_LIST) - 1);
+		p = gc_extract(p);
+		GC_SET_FLAGS(p, GC_FLAGS(p) | GC_FLAG_RSET);
+		gc_put(GC_RSET_LIST, p);
+	}
+	gc_unlock_shared(locked);
+}
+
+static void
+gc_scan_remembered()
+/* scan old cells that may refer to young cells */
+{
+	CELL* p;
+
+	DBUG_ENTER("gc_scan_remembered");
+	DBUG_PRINT("gc", ("%u cells in remembered set", GC_SIZE(GC_RSET_LIST)));
+	for (p = GC_NEXT(GC_RSET_LIST); p != GC_RSET_LIST; p = GC_NEXT(p)) {
+		gc_scan_value(GC_FIRST(p));
+		gc_scan_value(GC_REST(p));
+	}
+	DBUG_RETURN;
+}
+
+static void
+gc_prune_remembered()
+/* forget remembered cells that no longer refer to young cells */
+{
+	CELL* p;
+	CELL* q;
+
+	DBUG_ENTER("gc_prune_remembered");
+	for (p = GC_NEXT(GC_RSET_LIST); p != GC_RSET_LIST; p = q) {
+		q = GC_NEXT(p);
+		if (!gc_young_value(GC_FIRST(p)) && !gc_young_value(GC_REST(p))) {
+			GC_SET_SIZE(GC_RSET_LIST, GC_SIZE(GC_RSET_LIST) - 1);
+			p = gc_extract(p);
+			GC_SET_FLAGS(p, GC_FLAGS(p) & ~GC_FLAG_RSET);
+			gc_put(GC_OLD_LIST, p);
+		}
+	}
+	DBUG_PRINT("gc", ("%u cells remain in remembered set", GC_SIZE(GC_RSET_LIST)));
+	DBUG_RETURN;
+}
+
+static void
+gc_survive_cell(CELL* p)
+/* retain a scanned cell, promoting it if it has survived before */
+{
+	if (!(GC_FLAGS(p) & GC_FLAG_AGE)) {
+		GC_SET_FLAGS(p, GC_FLAG_AGE);
+		gc_push(GC_FRESH_LIST, p);
+		return;
+	}
+	++gc_promote__cnt;
+	GC_SET_MARK(p, GC_PHASE_X);				/* invisible to minor cycles */
+	GC_SET_FLAGS(p, GC_FLAG_AGE | GC_FLAG_OLD);
+	gc_push(GC_OLD_LIST, p);
+	if (gc_young_value(GC_FIRST(p)) || gc_young_value(GC_REST(p))) {
+		gc_remember_cell(p);
+	}
+}
+
+static BOOL
+gc_refresh_cell()
+/* process a cell from the "scan" list, return FALSE if none remain */
+{
+	CELL* p;
+
+	DBUG_ENTER("gc_refresh_cell");
+	if (GC_SIZE(GC_SCAN_LIST) == 0) {
+		DBUG_PRINT("gc", ("empty scan list"));
+		DBUG_RETURN FALSE;
+	}
+	p = gc_pop(GC_SCAN_LIST);
+	assert(p != NULL);
+	++gc_stats__total.cells_scanned;
+	gc_scan_value(GC_FIRST(p));
+	gc_scan_value(GC_REST(p));
+	gc_survive_cell(p);
+	DBUG_RETURN TRUE;
+}
+
+#if GC_COLLECTOR_THREAD
+
+#define	GC_THREAD_BATCH	as_word(256)	/* most cells scanned per lock by the collector thread */
+
+static void
+gc_shade_value(CONS* s)
+/* gc_scan_value() for the collector thread (no dbug calls here!) */
+{
+	CELL* p;
+
+	if (nilp(s)) {
+		return;
+	}
+	if (actorp(s)) {
+		s = MK_CONS(s);
+	}
+	if (!consp(s) || GC_PERM_CELL(s)) {
+		return;
+	}
+	p = as_cell(s);
+	if (GC_MARK(p) != gc_phase__prev) {
+		return;				/* cell already marked in this phase, or old */
+	}
+	GC_SET_SIZE(GC_AGED_LIST, GC_SIZE(GC_AGED_LIST) - 1);
+	p = gc_extract(p);
+	GC_SET_MARK(p, gc_phase__mark);
+	gc_put(GC_SCAN_LIST, p);
+}
+
+static void*
+gc_collector_thread(void* arg)
+/* scan cells whenever a cycle is started (no dbug calls here!) */
+{
+	CELL* p;
+	WORD n;
+
+	pthread_mutex_lock(&gc_thread__lock);
+	for (;;) {
+		while (gc_thread__state != GC_THREAD_SCAN) {
+			pthread_cond_wait(&gc_thread__wake, &gc_thread__lock);
+		}
+		for (n = 0; (n < GC_THREAD_BATCH) && (gc_thread__waiting == 0); ++n) {
+			if (GC_SIZE(GC_SCAN_LIST) == 0) {
+				gc_thread__state = GC_THREAD_DONE;	/* mutator frees the cells */
+				break;
+			}
+			p = gc_pop(GC_SCAN_LIST);
+			++gc_stats__total.cells_scanned;
+			gc_shade_value(GC_FIRST(p));
+			gc_shade_value(GC_REST(p));
+			gc_survive_cell(p);
+		}
+		pthread_mutex_unlock(&gc_thread__lock);
+		while (gc_thread__waiting > 0) {
+			sched_yield();		/* the mutator has priority */
+		}
+		pthread_mutex_lock(&gc_thread__lock);
+	}
+	return NULL;
+}
+
+static void
+gc_wake_collector()
+/* hand a newly aged heap to the collector thread (lock held) */
+{
+	DBUG_ENTER("gc_wake_collector");
+	if (!gc_thread__started) {
+		if (pthread_create(&gc_thread__id, NULL, gc_collector_thread, NULL) != 0) {
+			DBUG_PRINT("gc", ("pthread_create failed, scanning with actor"));
+			DBUG_RETURN;
+		}
+		gc_thread__started = TRUE;
+	}
+	gc_thread__state = GC_THREAD_SCAN;
+	pthread_cond_signal(&gc_thread__wake);
+	DBUG_RETURN;
+}
+
+#endif /* GC_COLLECTOR_THREAD */
+
+static void
+gc_free_cells()
+/* move unmarked "aged" cells to "free" list after scanning */
+{
+	DBUG_ENTER("gc_free_cells");
+	DBUG_PRINT("gc", ("%u cells marked in-use on fresh list", GC_SIZE(GC_FRESH_LIST)));
+	DBUG_PRINT("gc", ("%u cells promoted to old list", gc_promote__cnt));
+	gc_clear_weak();
+	gc_queue_finalizers();
+	gc_stats__total.cells_freed += GC_SIZE(GC_AGED_LIST);
+	gc_append_list(GC_FREE_LIST, GC_AGED_LIST);	
+	DBUG_PRINT("gc", ("%u cells available in free list", GC_SIZE(GC_FREE_LIST)));
+	gc_prune_remembered();
+	if (gc_major__cycle) {
+		gc_major__threshold = 2 * (GC_SIZE(GC_OLD_LIST) + GC_SIZE(GC_RSET_LIST));
+		if (gc_major__threshold < GC_MAJOR_MINIMUM) {
+			gc_major__threshold = GC_MAJOR_MINIMUM;
+		}
+		DBUG_PRINT("gc", ("next major cycle at %u old cells", gc_major__threshold));
+		gc_major__cycle = FALSE;
+		gc_pace_cycle(TRUE);
+	} else {
+		gc_pace_cycle(FALSE);
+	}
+#if 1	/* FIXME: eventually remove these checks for better performance */
+	gc_sanity_check(GC_AGED_LIST);
+	gc_sanity_check(GC_SCAN_LIST);
+	gc_sanity_check(GC_FRESH_LIST);
+	gc_sanity_check(GC_FREE_LIST);
+	gc_sanity_check(GC_OLD_LIST);
+	gc_sanity_check(GC_RSET_LIST);
+#endif
+	DBUG_RETURN;
+}
+
+static void
+gc_release_chunks(WORD keep)
+/* return empty chunks to the OS, keeping at least <keep> free cells */
+{
+	GC_CHUNK** pp;
+	GC_CHUNK* c;
+	CELL* p;
+	CELL* q;
+	WORD excess;
+	WORD n = 0;
+
+	DBUG_ENTER("gc_release_chunks");
+	if (GC_SIZE(GC_FREE_LIST) < (keep + GC_CHUNK_CELLS)) {
+		DBUG_RETURN;			/* not enough free cells to release a chunk */
+	}
+	for (c = gc_heap__chunks; c != NULL; c = c->next) {
+		c->free = 0;
+	}
+	for (p = GC_NEXT(GC_FREE_LIST); p != GC_FREE_LIST; p = GC_NEXT(p)) {
+		++gc_chunk_of(p)->free;
+	}
+	excess = (GC_SIZE(GC_FREE_LIST) - keep) / GC_CHUNK_CELLS;
+	pp = &gc_heap__chunks;
+	while (((c = *pp) != NULL) && (n < excess)) {
+		if (c->free < GC_CHUNK_CELLS) {
+			pp = &c->next;
+			continue;
+		}
+		*pp = c->next;			/* move the empty chunk to the spare list */
+		c->next = gc_spare__chunks;
+		gc_spare__chunks = c;
+		c->free = -1;			/* flag cells for removal */
+		++n;
+	}
+	if (n == 0) {
+		DBUG_RETURN;
+	}
+	for (p = GC_NEXT(GC_FREE_LIST); p != GC_FREE_LIST; p = q) {
+		q = GC_NEXT(p);
+		if (gc_chunk_of(p)->free < 0) {
+			gc_extract(p);
+		}
+	}
+	GC_SET_SIZE(GC_FREE_LIST, GC_SIZE(GC_FREE_LIST) - (n * GC_CHUNK_CELLS));
+	gc_heap__cnt -= n * GC_CHUNK_CELLS;
+	for (c = gc_spare__chunks; (c != NULL) && (c->free < 0); c = c->next) {
+		c->free = 0;
+		arena_release(c->base, GC_CHUNK_SIZE);
+	}
+	DBUG_PRINT("gc", ("%lu chunks released, %lu cells in heap", n, gc_heap__cnt));
+	DBUG_RETURN;
+}
+
+#if GC_PARALLEL_MARK
+static BOOL
+gc_mark_atomic(CONS* s)
+/* mark an aged cell <s>, return TRUE if this thread marked it */
+{
+	CELL* p = as_cell(s);
+	WORD w;
+
+	if (GC_PERM_CELL(p)) {
+		return FALSE;			/* permanent */
+	}
+	w = p->_prev;
+	if ((w & GC_PHASE_MASK) != gc_phase__prev) {
+		return FALSE;			/* already marked, or old */
+	}
+	return __sync_bool_compare_and_swap(&p->_prev, w, ((w & ~GC_PHASE_MASK) | gc_phase__mark));
+}
+
+static void
+gc_survive_marked()
+/* move aged cells marked by parallel workers to their survivor lists */
+{
+	CELL* p;
+	CELL* q;
+
+	DBUG_ENTER("gc_survive_marked");
+	for (p = GC_NEXT(GC_AGED_LIST); p != GC_AGED_LIST; p = q) {
+		q = GC_NEXT(p);
+		if (GC_MARK(p) == gc_phase__mark) {
+			GC_SET_SIZE(GC_AGED_LIST, GC_SIZE(GC_AGED_LIST) - 1);
+			gc_survive_cell(gc_extract(p));
+		}
+	}
+	DBUG_PRINT("gc", ("%u unmarked cells on aged list", GC_SIZE(GC_AGED_LIST)));
+	DBUG_RETURN;
+}
+#endif /* GC_PARALLEL_MARK */
+
+#endif /* GC_PACKED_HEAP */
+
+#if GC_PARALLEL_MARK
+
+#define	GC_DEQUE_SIZE		(1 << 12)		/* cells per work-stealing deque (power of 2) */
+#define	GC_DEQUE_MASK		(GC_DEQUE_SIZE - 1)
+#define	GC_MARK_THREADS_MAX	64				/* most threads in a parallel mark */
+#define	GC_PARALLEL_MINIMUM	as_word(1 << 16) /* least heap cells worth marking in parallel */
+
+/*
+ * Each marking thread owns a Chase-Lev deque. The owner pushes and pops
+ * marked cells at the bottom, idle threads steal from the top. Cells that
+ * do not fit in the deque go to a private spill stack.
+ */
+typedef struct gc_worker GC_WORKER;
+struct gc_worker {
+	volatile WORD	top;					/* steal end, advanced by thieves */
+	volatile WORD	bottom;					/* owner end */
+	CONS*			deque[GC_DEQUE_SIZE];	/* marked cells waiting to be scanned */
+	CONS**			spill;					/* private overflow stack */
+	WORD			spill_depth;
+	WORD			spill_limit;
+	WORD			marked;					/* cells marked by this worker */
+	int				id;
+	pthread_t		thread;
+};
+
+static GC_WORKER*	gc_worker__pool = NULL;		/* one worker per marking thread */
+static volatile int	gc_idle__cnt = 0;			/* workers with no work */
+static volatile int	gc_active__cnt = 0;			/* workers taking part (threads started) */
+static int			gc_spawn__max = GC_MARK_THREADS_MAX;	/* threads that may start (lowered by tests) */
+static WORD			gc_parallel__minimum = GC_PARALLEL_MINIMUM;
+
+static void
+gc_deque_push(GC_WORKER* w, CONS* p)
+/* push a cell on the owner end of the deque */
+{
+	WORD b = w->bottom;
+
+	if ((b - w->top) >= GC_DEQUE_SIZE) {
+		if (w->spill_depth >= w->spill_limit) {
+			w->spill_limit = (w->spill_limit ? (2 * w->spill_limit) : GC_DEQUE_SIZE);
+			w->spill = (CONS**)realloc(w->spill, w->spill_limit * sizeof(CONS*));
+			assert(w->spill != NULL);
+		}
+		w->spill[w->spill_depth++] = p;
+		return;
+	}
+	w->deque[b & GC_DEQUE_MASK] = p;
+	__sync_synchronize();		/* publish the cell before the new bottom */
+	w->bottom = b + 1;
+}
+
+static CONS*
+gc_deque_pop(GC_WORKER* w)
+/* pop a cell from the owner end of the deque, NULL if empty */
+{
+	WORD b;
+	WORD t;
+	CONS* p;
+
+	b = w->bottom - 1;
+	w->bottom = b;
+	__sync_synchronize();
+	t = w->top;
+	if (t > b) {
+		w->bottom = b + 1;		/* empty */
+		return NULL;
+	}
+	p = w->deque[b & GC_DEQUE_MASK];
+	if (t == b) {				/* last cell, race against thieves */
+		if (!__sync_bool_compare_and_swap(&w->top, t, t + 1)) {
+			p = NULL;
+		}
+		w->bottom = b + 1;
+	}
+	return p;
+}
+
+static CONS*
+gc_deque_steal(GC_WORKER* w)
+/* steal a cell from the far end of another worker's deque, NULL if none */
+{
+	WORD t;
+	WORD b;
+	CONS* p;
+
+	t = w->top;
+	__sync_synchronize();
+	b = w->bottom;
+	if (t >= b) {
+		return NULL;
+	}
+	p = w->deque[t & GC_DEQUE_MASK];
+	if (!__sync_bool_compare_and_swap(&w->top, t, t + 1)) {
+		return NULL;			/* lost the race */
+	}
+	return p;
+}
+
+static CONS*
+gc_worker_take(GC_WORKER* w)
+/* take a cell from the worker's own deque or spill stack */
+{
+	CONS* p;
+
+	p = gc_deque_pop(w);
+	if ((p == NULL) && (w->spill_depth > 0)) {
+		p = w->spill[--w->spill_depth];
+		while ((w->spill_depth > 0) && ((w->bottom - w->top) < (GC_DEQUE_SIZE / 2))) {
+			gc_deque_push(w, w->spill[--w->spill_depth]);	/* make work stealable */
+		}
+	}
+	return p;
+}
+
+static void
+gc_worker_mark(GC_WORKER* w, CONS* s)
+/* mark the cell referenced by value <s>, and queue it for scanning */
+{
+	if (actorp(s)) {
+		s = MK_CONS(s);
+	}
+	if (consp(s) && !nilp(s) && gc_mark_atomic(s)) {
+		++w->marked;
+#if GC_CDR_CODING
+		s = GC_CELL_OF(s);
+#endif
+		gc_deque_push(w, s);
+	}
+}
+
+static void
+gc_worker_scan(GC_WORKER* w, CONS* p)
+/* mark the cells referenced by marked cell <p> */
+{
+	gc_worker_mark(w, GC_FIRST(p));
+	gc_worker_mark(w, GC_REST(p));
+#if GC_CDR_CODING
+	if (gc_coded_cell(p)) {
+		gc_worker_mark(w, p + 1);	/* rest of the second element */
+	}
+#endif
+}
+
+static CONS*
+gc_worker_steal(GC_WORKER* w)
+/* look for work in other deques, return NULL when all workers are idle */
+{
+	GC_WORKER* v;
+	CONS* p;
+	int n;
+	int i;
+
+	__sync_fetch_and_add(&gc_idle__cnt, 1);
+	while (gc_idle__cnt < (n = gc_active__cnt)) {	/* drops if a thread fails to start */
+		for (i = 1; i < n; ++i) {
+			v = &gc_worker__pool[(w->id + i) % n];
+			if (v->top < v->bottom) {
+				__sync_fetch_and_sub(&gc_idle__cnt, 1);
+				p = gc_deque_steal(v);
+				if (p != NULL) {
+					return p;
+				}
+				__sync_fetch_and_add(&gc_idle__cnt, 1);
+			}
+		}
+		sched_yield();
+	}
+	return NULL;				/* marking complete */
+}
+
+static void*
+gc_mark_worker(void* arg)
+/* scan marked cells until no work remains anywhere (no dbug calls here!) */
+{
+	GC_WORKER* w = (GC_WORKER*)arg;
+	CONS* p;
+
+	for (;;) {
+		while ((p = gc_worker_take(w)) != NULL) {
+			gc_worker_scan(w, p);
+		}
+		p = gc_worker_steal(w);
+		if (p == NULL) {
+			break;
+		}
+		gc_worker_scan(w, p);
+	}
+	return NULL;
+}
+
+static void
+gc_parallel_mark(CONS* root)
+/* mark everything reachable from <root> using all marking threads */
+{
+	GC_WORKER* w;
+	WORD marked = 0;
+	int n;
+	int i;
+
+	DBUG_ENTER("gc_parallel_mark");
+	n = gc_mark__threads;
+	if (gc_worker__pool == NULL) {
+		gc_worker__pool = NEWxN(GC_WORKER, GC_MARK_THREADS_MAX);
+		assert(gc_worker__pool != NULL);
+	}
+	for (i = 0; i < n; ++i) {
+		w = &gc_worker__pool[i];
+		w->top = 0;
+		w->bottom = 0;
+		w->spill_depth = 0;
+		w->marked = 0;
+		w->id = i;
+	}
+	gc_idle__cnt = 0;
+	gc_active__cnt = n;
+	gc_worker_mark(&gc_worker__pool[0], root);
+	for (i = 1; i < n; ++i) {
+		w = &gc_worker__pool[i];
+		if ((i >= gc_spawn__max)
+		||  (pthread_create(&w->thread, NULL, gc_mark_worker, w) != 0)) {
+			DBUG_PRINT("gc", ("pthread_create failed, %d threads", i));
+			n = i;
+			gc_active__cnt = n;	/* the rest never take part */
+			break;
+		}
+	}
+	gc_mark_worker(&gc_worker__pool[0]);
+	for (i = 1; i < n; ++i) {
+		pthread_join(gc_worker__pool[i].thread, NULL);
+	}
+	for (i = 0; i < n; ++i) {
+		marked += gc_worker__pool[i].marked;
+	}
+	DBUG_PRINT("gc", ("%lu cells marked by %d threads", marked, n));
+	gc_stats__total.cells_scanned += marked;
+	gc_survive_marked();
+	DBUG_RETURN;
+}
+
+#endif /* GC_PARALLEL_MARK */
+
+void
+gc_full_collection(CONS* root)
+/* perform a full garbage collection (NOT CONCURRENT!) */
+{
+	struct timespec t0;
+	struct timespec t;
+	BOOL locked;
+
+	DBUG_ENTER("gc_full_collection");
+	locked = gc_lock();		/* stop the collector thread, if scanning */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	t = t0;
+	gc_collect__requested = FALSE;
+	++gc_stats__total.full_collections;
+	if (gc_cycle__active) {
+		DBUG_PRINT("gc", ("finishing concurrent cycle"));
+		while (gc_refresh_cell() == TRUE)
+			;
+		gc_stats__total.mark_us += gc_lap_us(&t);
+		gc_free_cells();
+		gc_stats__total.sweep_us += gc_lap_us(&t);
+	}
+	gc_major__cycle = TRUE;	/* collect old cells too */
+	gc_start_cycle();
+	gc_age_cells();
+	gc_stats__total.start_us += gc_lap_us(&t);
+	assert(consp(root));
+#if GC_PARALLEL_MARK
+	if (gc_mark__threads == 0) {
+		gc_set_mark_threads(0);
+	}
+	if ((gc_mark__threads > 1) && (gc_heap__cnt >= gc_parallel__minimum)) {
+		while (gc_refresh_cell() == TRUE)
+			;
+		gc_parallel_mark(root);
+		root = NIL;			/* already marked */
+	}
+#endif
+	gc_scan_roots(root);
+	while (gc_refresh_cell() == TRUE)
+		;
+	gc_stats__total.mark_us += gc_lap_us(&t);
+	gc_free_cells();
+	gc_check_limit();
+	gc_stats__total.sweep_us += gc_lap_us(&t);
+	gc_record_pause(gc_elapsed_us(&t0));
+	gc_unlock(locked);
+	DBUG_RETURN;
+}
+
+static void
+gc_adapt_batch(WORD n, WORD us)
+/* adjust batch size after scanning <n> cells in <us> microseconds */
+{
+	if (us > gc_scan__budget) {
+		gc_scan__batch >>= 1;		/* over budget, scan less next time */
+		if (gc_scan__batch < GC_SCAN_CHECK) {
+			gc_scan__batch = GC_SCAN_CHECK;
+		}
+	} else if ((n >= gc_scan__batch) && (us < (gc_scan__budget >> 1))) {
+		gc_scan__batch <<= 1;		/* well under budget, scan more next time */
+		if (gc_scan__batch > GC_SCAN_BATCH_MAX) {
+			gc_scan__batch = GC_SCAN_BATCH_MAX;
+		}
+	}
+	DBUG_PRINT("gc", ("%lu cells in %luus, next batch %lu", n, us, gc_scan__batch));
+}
+
+/**
+gc_scanning_actor:
+	BEHAVIOR {}
+	$ignored -> [
+		IF NOT gc_cycle__active [
+			# cycle already finished by gc_full_collection()
+		] ELSE [
+			# scan up to gc_scan__batch cells, within gc_scan__budget usecs
+			IF gc_refresh_cell() [
+				SEND SELF NIL
+			] ELSE [
+				gc_free_cells()
+			]
+		]
+	]
+	DONE
+**/
+BEH_DECL(gc_scanning_actor)
+{
+	struct timespec t0;
+	struct timespec t;
+	WORD n;
+	WORD us;
+	BOOL locked;
+
+	DBUG_ENTER("gc_scanning_actor");
+	if (!gc_cycle__active) {
+		DBUG_PRINT("gc", ("no cycle in progress"));
+		DBUG_RETURN;
+	}
+#if GC_COLLECTOR_THREAD
+	if ((gc_thread__state == GC_THREAD_SCAN) && (CFG->q_count > 0)) {
+		SEND(SELF, NIL);			/* collector thread is scanning, check again later */
+		DBUG_RETURN;
+	}
+#endif
+	locked = gc_lock();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	t = t0;
+	for (n = 0; n < gc_scan__batch; ++n) {
+		if (gc_refresh_cell() == FALSE) {
+			gc_stats__total.mark_us += gc_lap_us(&t);
+			gc_free_cells();		/* scanning complete */
+			gc_stats__total.sweep_us += gc_lap_us(&t);
+			gc_record_pause(gc_elapsed_us(&t0));
+			gc_unlock(locked);
+			DBUG_RETURN;
+		}
+		if ((((n + 1) % GC_SCAN_CHECK) == 0)
+		&& (gc_elapsed_us(&t0) >= gc_scan__budget)) {
+			++n;
+			break;					/* time budget spent */
+		}
+	}
+	us = gc_elapsed_us(&t0);
+	gc_stats__total.mark_us += us;
+	gc_record_pause(us);
+	gc_unlock(locked);
+	gc_adapt_batch(n, us);
+	SEND(SELF, NIL);				/* more aged cells to scan */
+	DBUG_RETURN;
+}
+
+void
+gc_actor_collection(CONFIG* cfg, CONS* root)
+/* initiate actor-based (CONCURRENT) garbage collection */
+{
+	struct timespec t0;
+	CONS* actor;
+	BOOL locked;
+	WORD us;
+
+	DBUG_ENTER("gc_actor_collection");
+	gc_initialize();
+	if (gc_cycle__active) {
+		DBUG_PRINT("gc", ("collection already in progress"));
+		DBUG_RETURN;
+	}
+	gc_cycle__active = TRUE;
+	locked = gc_lock();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+#if !GC_PACKED_HEAP
+	gc_major__cycle = ((GC_SIZE(GC_OLD_LIST) + GC_SIZE(GC_RSET_LIST)) >= gc_major__threshold);
+	DBUG_PRINT("gc", ("starting %s cycle", (gc_major__cycle ? "major" : "minor")));
+#endif
+	gc_start_cycle();
+	gc_age_cells();			/* cells allocated after this are "fresh" */
+	assert(consp(root));
+	gc_scan_roots(root);
+	us = gc_elapsed_us(&t0);
+	gc_stats__total.start_us += us;
+	gc_record_pause(us);
+#if GC_COLLECTOR_THREAD
+	gc_wake_collector();	/* scan on the collector thread, free at a message boundary */
+#else
+	/* scan enough cells per allocation to finish before the free cells run out */
+	gc_scan__rate = 1 + ((gc_heap__cnt - GC_FREE_COUNT) / (GC_FREE_COUNT + 1));
+	DBUG_PRINT("gc", ("scanning %lu cells per allocation", gc_scan__rate));
+#endif
+	gc_unlock(locked);
+	actor = CFG_ACTOR(cfg, gc_scanning_actor, NIL);
+	CFG_SEND(cfg, actor, NIL);
+	DBUG_RETURN;
+}
+
+BOOL
+gc_cycle_active()
+/* return TRUE while a concurrent collection is in progress */
+{
+	return gc_cycle__active;
+}
+
+BOOL
+gc_collection_due()
+/* return TRUE if allocation has used up enough free cells to start a collection */
+{
+	return (!gc_cycle__active && (GC_FREE_COUNT < gc_low__water));
+}
+
+void
+gc_request_collection()
+/* ask for a full collection at the next message boundary */
+{
+	gc_collect__requested = TRUE;
+}
+
+BOOL
+gc_collection_requested()
+/* return TRUE if a full collection has been asked for, and not yet done */
+{
+	return gc_collect__requested;
+}
+
+void
+gc_request_snapshot()
+/* ask for a heap snapshot at the next message boundary (safe in a signal handler) */
+{
+	gc_snap__requested = 1;
+}
+
+BOOL
+gc_snapshot_requested()
+/* return TRUE if a heap snapshot has been asked for, and not yet written */
+{
+	return (gc_snap__requested != 0);
+}
+
+void
+gc_get_stats(GC_STATS* stats)
+/* copy the collector statistics into <stats> */
+{
+	BOOL locked;
+
+	locked = gc_lock();
+	*stats = gc_stats__total;
+#if !GC_PACKED_HEAP
+	stats->cells_promoted = gc_promote__cnt;
+#endif
+	stats->heap_cells = gc_heap__cnt;
+	stats->free_cells = GC_FREE_COUNT;
+	gc_unlock(locked);
+}
+
+#define	GC_JSON_FIELD(f,s,name)	fprintf((f), "  \"%s\": %ld,\n", #name, (long)(s).name)
+
+void
+gc_dump_stats(FILE* f)
+/* write the collector statistics to <f> as a JSON object */
+{
+	GC_STATS s;
+	int i;
+
+	gc_get_stats(&s);
+	fprintf(f, "{\n");
+	GC_JSON_FIELD(f, s, cycles_started);
+	GC_JSON_FIELD(f, s, cycles_completed);
+	GC_JSON_FIELD(f, s, major_cycles);
+	GC_JSON_FIELD(f, s, full_collections);
+	GC_JSON_FIELD(f, s, cells_allocated);
+	GC_JSON_FIELD(f, s, cells_scanned);
+	GC_JSON_FIELD(f, s, cells_freed);
+	GC_JSON_FIELD(f, s, cells_promoted);
+	GC_JSON_FIELD(f, s, weak_cleared);
+	GC_JSON_FIELD(f, s, cells_finalized);
+	GC_JSON_FIELD(f, s, heap_cells);
+	GC_JSON_FIELD(f, s, free_cells);
+	GC_JSON_FIELD(f, s, alloc_rate);
+	GC_JSON_FIELD(f, s, start_us);
+	GC_JSON_FIELD(f, s, mark_us);
+	GC_JSON_FIELD(f, s, sweep_us);
+	GC_JSON_FIELD(f, s, compact_us);
+	GC_JSON_FIELD(f, s, pause_cnt);
+	GC_JSON_FIELD(f, s, pause_us);
+	GC_JSON_FIELD(f, s, pause_max_us);
+	fprintf(f, "  \"pause_hist\": [");
+	for (i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+		fprintf(f, "%s%ld", (i ? ", " : ""), (long)s.pause_hist[i]);
+	}
+	fprintf(f, "]\n}\n");
+}
+
+void
+gc_set_pacing(WORD low_water, WORD high_water, WORD growth_ratio)
+/* set free cell watermarks and heap growth ratio (percent of live cells) */
+{
+	assert(low_water <= high_water);
+	assert(growth_ratio >= 100);
+	gc_low__water = low_water;
+	gc_high__water = high_water;
+	gc_growth__ratio = growth_ratio;
+}
+
+void
+gc_set_scan_budget(WORD batch, WORD usecs)
+/* set initial cells and microseconds per scanning actor message */
+{
+	assert(batch > 0);
+	assert(usecs > 0);
+	gc_scan__batch = batch;
+	gc_scan__budget = usecs;
+}
+
+static WORD
+gc_growth_step()
+/* free cells to add when the free cells run out (geometric growth) */
+{
+	WORD n;
+
+	n = (gc_heap__cnt / 100) * gc_heap__growth;
+	return ((n > gc_high__water) ? n : gc_high__water);
+}
+
+void
+gc_set_heap_growth(WORD percent)
+/* set the cells added when the heap must grow, percent of the heap */
+{
+	assert(percent >= 0);
+	gc_heap__growth = percent;
+}
+
+void
+gc_set_retention(WORD n)
+/* set the free cells kept when empty chunks are returned to the OS */
+{
+	assert(n >= 0);
+	gc_retain__cells = n;
+}
+
+void
+gc_set_heap_limit(WORD n)
+/* limit the heap to <n> collectable cells (0 = no limit) */
+{
+	DBUG_ENTER("gc_set_heap_limit");
+	gc_heap__limit = n;
+	gc_heap__ceiling = n;
+	gc_heap__exhausted = FALSE;
+	DBUG_PRINT("gc", ("heap_limit=%lu", n));
+	DBUG_RETURN;
+}
+
+BOOL
+gc_heap_exhausted()
+/* return TRUE if the last full collection left too few free cells under the limit */
+{
+	return gc_heap__exhausted;
+}
+
+static BOOL
+gc_heap_room()
+/* return TRUE if another chunk of cells fits under the heap ceiling */
+{
+	return ((gc_heap__ceiling == 0) || ((gc_heap__cnt + GC_CHUNK_CELLS) <= gc_heap__ceiling));
+}
+
+static void
+gc_out_of_memory(char* what)
+/* the OS refused memory for <what>, and nothing is left in reserve */
+{
+	fprintf(stderr, "\nOut of memory for %s!\n", what);
+	abort();	/* abnormal termination */
+}
+
+static void
+gc_emergency()
+/*
+ * The free cells ran out and the heap can not grow under its limit.
+ * Raise the ceiling into a reserve, so the message being delivered
+ * can finish, and ask for a full collection at the next message boundary.
+ * If that message uses up the reserve too, mark the heap exhausted
+ * (so run_configuration() drops the messages of the computation)
+ * and give it a second reserve to finish in.
+ */
+{
+	WORD reserve;
+
+	DBUG_ENTER("gc_emergency");
+	if (gc_heap__limit == 0) {
+		gc_heap__limit = gc_heap__cnt;	/* the OS refused more memory */
+	}
+	reserve = (gc_heap__limit / 100) * GC_LIMIT_RESERVE;
+	if (reserve < GC_CHUNK_CELLS) {
+		reserve = GC_CHUNK_CELLS;
+	}
+	if (gc_heap__ceiling == gc_heap__limit) {
+		gc_heap__ceiling += reserve;
+		DBUG_PRINT("gc", ("heap limit %lu reached, ceiling %lu", gc_heap__limit, gc_heap__ceiling));
+		gc_collect__requested = TRUE;
+		gc_grow_heap(gc_growth_step());
+	}
+	if ((GC_FREE_COUNT == 0) && (gc_heap__ceiling == (gc_heap__limit + reserve))) {
+		gc_heap__ceiling += reserve;	/* a single message used up the reserve */
+		gc_heap__exhausted = TRUE;
+		DBUG_PRINT("gc", ("heap limit %lu exhausted, ceiling %lu", gc_heap__limit, gc_heap__ceiling));
+		gc_grow_heap(gc_growth_step());
+	}
+	if (GC_FREE_COUNT == 0) {
+		gc_out_of_memory("collectable cells");
+	}
+	DBUG_RETURN;
+}
+
+static void
+gc_check_limit()
+/* after a full collection, lower the ceiling and check that live cells fit under the limit */
+{
+	WORD live;
+
+	if (gc_heap__limit == 0) {
+		return;
+	}
+	gc_heap__ceiling = gc_heap__limit;
+	if ((gc_heap__cnt > gc_heap__limit) && (GC_FREE_COUNT > (gc_heap__cnt - gc_heap__limit))) {
+		gc_release_chunks(GC_FREE_COUNT - (gc_heap__cnt - gc_heap__limit));	/* give back the reserve */
+	}
+	live = gc_heap__cnt - GC_FREE_COUNT;
+	gc_heap__exhausted = ((live + gc_low__water) > gc_heap__limit);
+	DBUG_PRINT("gc", ("%lu live cells, limit %lu%s", live, gc_heap__limit,
+		(gc_heap__exhausted ? ", exhausted" : "")));
+}
+
+void
+gc_presize_heap(WORD n)
+/* grow the heap until at least <n> collectable cells are free */
+{
+	DBUG_ENTER("gc_presize_heap");
+	gc_initialize();
+	if (GC_FREE_COUNT < n) {
+		gc_grow_heap(n);
+	}
+	DBUG_PRINT("gc", ("%lu cells in heap, %lu free", gc_heap__cnt, GC_FREE_COUNT));
+	DBUG_RETURN;
+}
+
+void
+gc_set_mark_threads(int n)
+/* set the number of threads marking in a full collection (0 = one per cpu) */
+{
+	DBUG_ENTER("gc_set_mark_threads");
+#if GC_PARALLEL_MARK
+	if (n <= 0) {
+		n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (n > GC_MARK_THREADS_MAX) {
+		n = GC_MARK_THREADS_MAX;
+	}
+#endif
+	if (n < 1) {
+		n = 1;
+	}
+	gc_mark__threads = n;
+	DBUG_PRINT("gc", ("mark_threads=%d", gc_mark__threads));
+	DBUG_RETURN;
+}
+
+void
+gc_set_major_threshold(WORD n)
+/* set the number of old cells that will trigger a major (full) cycle */
+{
+	gc_initialize();
+	gc_major__threshold = n;
+}
+
+static void
+gc_pace_allocation()
+/* during a cycle, scan cells in proportion to allocation */
+{
+	WORD n;
+
+	for (n = gc_scan__rate; n > 0; --n) {
+		if (gc_refresh_cell() == FALSE) {
+			break;
+		}
+	}
+}
+
+#if GC_PACKED_HEAP
+
+static GC_CHUNK*
+gc_allocate_chunk(int kind)
+/* allocate a new chunk of cells and enter it in the chunk map */
+{
+	GC_CHUNK* c;
+	void* p;
+
+	DBUG_ENTER("gc_allocate_chunk");
+	gc_initialize();
+	if ((kind == GC_CHUNK_HEAP) && (gc_spare__chunks != NULL)) {
+		c = gc_spare__chunks;	/* reuse a released chunk */
+		gc_spare__chunks = c->next;
+		p = c->base;
+		arena_recommit(p, GC_CHUNK_SIZE);
+		memset(c->used, 0, sizeof(c->used));
+		c->hint = 0;
+	} else {
+#if GC_COMPRESSED_REFS
+		p = gc_chunk_memory();
+#else
+		p = arena_alloc(GC_CHUNK_SIZE, GC_CHUNK_SIZE);
+#endif
+		if (p == NULL) {
+			DBUG_PRINT("gc", ("no memory for a new chunk"));
+			DBUG_RETURN NULL;
+		}
+		c = NEW(GC_CHUNK);
+		assert(c != NULL);
+		c->base = as_cons(p);
+		gc_map_chunk(c, p);
+	}
+	c->kind = kind;
+	c->free = GC_CHUNK_CELLS;
+	if (kind == GC_CHUNK_HEAP) {
+		c->next = gc_heap__chunks;
+		gc_heap__chunks = c;
+		gc_heap__cnt += GC_CHUNK_CELLS;
+		gc_free__cnt += GC_CHUNK_CELLS;
+	} else {
+		c->next = gc_perm__chunks;
+		gc_perm__chunks = c;
+	}
+	DBUG_PRINT("gc", ("%lu %s cells allocated starting at %p", GC_CHUNK_CELLS,
+		((kind == GC_CHUNK_HEAP) ? "free" : "permanent"), p));
+	DBUG_RETURN c;
+}
+
+static void
+gc_grow_heap(WORD n)
+/* add chunks until at least <n> collectable cells are free, or the heap is full */
+{
+	do {
+		if (!gc_heap_room() || (gc_allocate_chunk(GC_CHUNK_HEAP) == NULL)) {
+			break;
+		}
+	} while (gc_free__cnt < n);
+}
+
+void
+gc_compact_collection(CONS* root, CONS* pinned)
+/* perform a full garbage collection (cells of the packed heap are not moved) */
+{
+	DBUG_ENTER("gc_compact_collection");
+	DBUG_PRINT("gc", ("packed heap is not compacted, pinned=%p", pinned));
+	gc_full_collection(root);
+	DBUG_RETURN;
+}
+
+static CONS*
+gc_take_cell(GC_CHUNK* c)
+/* claim the first free cell in chunk <c>, marked in the current phase */
+{
+	WORD w;
+	WORD i;
+	ulint bits;
+
+	assert(c->free > 0);
+	for (w = c->hint; w < GC_CHUNK_WORDS; ++w) {
+		bits = ~c->used[w];
+		if (bits) {
+			i = (w * GC_WORD_BITS) + gc_lowest_bit(bits);
+			c->used[w] |= GC_BIT_MASK(i);
+			GC_SET_FRESH(c, i);
+#if GC_CDR_CODING
+			c->code[w] &= ~GC_BIT_MASK(i);
+			c->split[GC_BIT_WORD(2 * i)] &= ~(3UL << ((2 * i) % GC_WORD_BITS));
+#endif
+			c->hint = w;
+			--c->free;
+			return (c->base + i);
+		}
+	}
+	assert(FALSE);	/* free count mismatch */
+	return NULL;
+}
+
+CONS*
+gc_perm(CONS* first, CONS* rest)
+/* allocate and initialize a permanent cell (never garbage collected) */
+{
+	GC_CHUNK* c;
+	CONS* p;
+
+	c = gc_perm__chunks;
+	if ((c == NULL) || (c->free == 0)) {
+		c = gc_allocate_chunk(GC_CHUNK_PERM);
+		if (c == NULL) {
+			gc_out_of_memory("permanent cells");
+		}
+	}
+	p = gc_take_cell(c);
+	++gc_perm__cnt;
+	gc_scan_value(first);	/* values stored during a cycle are live */
+	gc_scan_value(rest);
+	GC_SET_FIRST(p, first);
+	GC_SET_REST(p, rest);
+	assert(consp(p));
+	return p;
+}
+
+static GC_CHUNK*
+gc_next_chunk()
+/* return the chunk to allocate from, moving on to one with free cells */
+{
+	GC_CHUNK* c;
+
+	c = gc_alloc__chunk;
+	if ((c == NULL) || (c->free == 0)) {
+		if (gc_free__cnt == 0) {
+			gc_grow_heap(gc_growth_step());
+			if (gc_free__cnt == 0) {
+				gc_emergency();
+			}
+			c = gc_heap__chunks;	/* newest chunk */
+		} else {
+			do {	/* resume after the last chunk used, wrapping around */
+				c = (((c == NULL) || (c->next == NULL)) ? gc_heap__chunks : c->next);
+			} while (c->free == 0);
+		}
+		gc_alloc__chunk = c;
+	}
+	return c;
+}
+
+CONS*
+gc_cons(CONS* first, CONS* rest)
+/* allocate and initialize a new "cons" cell */
+{
+	CONS* p;
+
+	p = gc_take_cell(gc_next_chunk());
+	--gc_free__cnt;
+	++gc_stats__total.cells_allocated;
+	gc_scan_value(first);	/* values stored during a cycle are live */
+	gc_scan_value(rest);
+	GC_SET_FIRST(p, first);
+	GC_SET_REST(p, rest);
+	gc_pace_allocation();	/* keep scanning ahead of allocation */
+	assert(consp(p));
+	return p;
+}
+
+#if GC_CDR_CODING
+static CONS*
+gc_take_run(GC_CHUNK* c, WORD m)
+/* claim <m> adjacent free cells in chunk <c>, within one bitmap word, NULL if none */
+{
+	WORD w;
+	WORD i;
+	WORD k;
+	WORD n;
+	ulint bits;
+	ulint mask;
+
+	if (c->free < m) {
+		return NULL;
+	}
+	for (w = c->hint; w < GC_CHUNK_WORDS; ++w) {
+		bits = ~c->used[w];
+		for (n = 1; bits && (n < m); n += k) {	/* bit j set: cells j..j+n-1 free */
+			k = (((m - n) < n) ? (m - n) : n);
+			bits &= (bits >> k);
+		}
+		if (bits) {
+			i = (w * GC_WORD_BITS) + gc_lowest_bit(bits);
+			mask = ((m < GC_WORD_BITS) ? ((1UL << m) - 1) : ~0UL) << (i % GC_WORD_BITS);
+			c->used[w] |= mask;
+			c->mark[w] = (c->mark[w] & ~mask) | (GC_PHASE_BITS & mask);	/* fresh */
+			c->code[w] &= ~mask;
+			for (k = 2 * i; k < (2 * (i + m)); ++k) {
+				c->split[GC_BIT_WORD(k)] &= ~GC_BIT_MASK(k);
+			}
+			c->free -= m;
+			gc_free__cnt -= m;
+			gc_stats__total.cells_allocated += m;
+			return (c->base + i);
+		}
+	}
+	return NULL;
+}
+
+static CONS*
+gc_fill_run(CONS* p, CONS** values, WORD n, CONS* tail)
+/* store a run of <n> values (at least 3) ending in <tail>, from cell <p> */
+{
+	GC_CHUNK* c = gc_chunk_of(p);
+	CONS* q = p;
+	WORD i;
+	WORD j = 0;
+
+	for (i = 0; i < n; ++i) {
+		gc_scan_value(values[i]);	/* values stored during a cycle are live */
+	}
+	gc_scan_value(tail);
+	if ((n & 1) == 0) {				/* even count, the first cell is normal */
+		GC_SET_FIRST(q, values[0]);
+		GC_SET_REST(q, q + 1);
+		++q;
+		j = 1;
+	}
+	while (j < (n - 1)) {
+		i = GC_CELL_INDEX(c, q);
+		c->code[GC_BIT_WORD(i)] |= GC_BIT_MASK(i);
+		GC_SET_FIRST(q, values[j]);
+		GC_SET_REST(q, values[j + 1]);
+		++q;
+		j += 2;
+	}
+	GC_SET_FIRST(q, values[j]);		/* the last cell is normal */
+	GC_SET_REST(q, tail);
+	gc_pace_allocation();
+	return p;
+}
+#endif /* GC_CDR_CODING */
+
+#if !GC_SATB_BARRIER
+static CONS*
+gc_check_access(CONS* cell)
+/* ensure that accessed cells are considered "live" */
+{
+	GC_CHUNK* c;
+
+	assert(consp(cell));
+	c = gc_chunk_of(cell);
+	if ((c != NULL) && (c->kind == GC_CHUNK_HEAP) && GC_AGED(c, GC_CELL_INDEX(c, cell))) {
+		gc_scan_cell(cell);	/* any "aged" cell accessed must be "live", so scan it */
+	}
+	return cell;
+}
+#endif /* !GC_SATB_BARRIER */
+
+static void
+gc_write_barrier(CONS* p, CONS* old, CONS* s)
+/* record the store of <s> over <old> in cell <p> */
+{
+#if GC_SATB_BARRIER
+	gc_scan_value(old);		/* values overwritten during a cycle stay live */
+#else
+	gc_scan_value(s);		/* values stored during a cycle are live */
+#endif
+}
+
+#else /* treadmill */
+
+static GC_CHUNK*
+gc_new_chunk()
+/* take a chunk for collectable cells, reusing a released chunk if possible, NULL if none */
+{
+	GC_CHUNK* c;
+	CELL* p;
+
+	if (gc_spare__chunks != NULL) {
+		c = gc_spare__chunks;	/* reuse a released chunk */
+		gc_spare__chunks = c->next;
+		arena_recommit(c->base, GC_CHUNK_SIZE);
+	} else {
+		p = (CELL*)arena_alloc(GC_CHUNK_SIZE, GC_CHUNK_SIZE);
+		if (p == NULL) {
+			return NULL;
+		}
+		c = NEW(GC_CHUNK);
+		assert(c != NULL);
+		c->base = p;
+		gc_map_chunk(c, c->base);
+	}
+	c->next = NULL;
+	c->free = 0;
+	gc_heap__cnt += GC_CHUNK_CELLS;
+	return c;
+}
+
+static BOOL
+gc_allocate_cells(CELL* list_head)
+/* allocate a new block of free cells, return FALSE if there is no memory */
+{
+	size_t n;
+	CELL* p;
+	GC_CHUNK* c;
+
+	DBUG_ENTER("gc_alloc_cells");
+	gc_initialize();
+	assert(list_head == GC_FREE_LIST);	/* permanent cells are not linked, see gc_perm() */
+	n = GC_CHUNK_CELLS;		/* collectable cells come in mapped chunks */
+	c = gc_new_chunk();
+	if (c == NULL) {
+		DBUG_PRINT("gc", ("no memory for a new chunk"));
+		DBUG_RETURN FALSE;
+	}
+	c->next = gc_heap__chunks;
+	gc_heap__chunks = c;
+	p = c->base;
+	DBUG_PRINT("gc", ("%lu free cells allocated starting at %p", n, p));
+	while (n > 0) {
+		--n;
+		GC_SET_MARK(p, GC_PHASE_Z);
+		gc_put(list_head, p);
+		++p;
+	}
+	DBUG_PRINT("gc", ("%lu cells available in free list", GC_SIZE(list_head)));
+	DBUG_RETURN TRUE;
+}
+
+static void
+gc_grow_heap(WORD n)
+/* add chunks until at least <n> collectable cells are free, or the heap is full */
+{
+	do {
+		if (!gc_heap_room() || !gc_allocate_cells(GC_FREE_LIST)) {
+			break;
+		}
+	} while (GC_SIZE(GC_FREE_LIST) < n);
+}
+
+/*
+ * Compaction copies live cells out of the heap chunks ("from-space",
+ * flagged by free < 0) into new chunks, Cheney-style. Each copied cell
+ * is followed at once by the cells of its rest chain, so the spine of a
+ * list ends up in adjacent cells. A copied cell is left behind as a
+ * forwarding cell: its _next is zero and its first is the new cell.
+ * Pinned cells are not copied, and their chunks (free == -2) are kept.
+ */
+static CELL**		gc_pin__cells = NULL;		/* cells referenced from outside the heap */
+static WORD			gc_pin__cnt = 0;			/* number of pinned cells */
+static GC_CHUNK*	gc_copy__chunks = NULL;		/* chunks cells are copied into */
+static GC_CHUNK*	gc_copy__tail = NULL;		/* chunk being filled */
+static CELL*		gc_copy__next = NULL;		/* next cell to fill */
+static CELL*		gc_copy__limit = NULL;		/* end of chunk being filled */
+
+static CELL*
+gc_from_cell(CONS* s)
+/* return the from-space cell <s> refers to, NULL if none */
+{
+	CELL* p;
+	GC_CHUNK* c;
+	WORD i;
+
+	if (actorp(s)) {
+		s = MK_CONS(s);
+	}
+	if (!consp(s) || nilp(s)) {
+		return NULL;
+	}
+	p = as_cell(s);
+	c = gc_chunk_of(p);
+	if ((c == NULL) || (c->free >= 0)) {
+		return NULL;		/* permanent, or already copied */
+	}
+	if ((p->_next != 0) && (GC_MARK(p) == GC_PHASE_Z)) {
+		return NULL;		/* free cell, the reference is stale */
+	}
+	if (c->free == -2) {
+		for (i = 0; i < gc_pin__cnt; ++i) {
+			if (gc_pin__cells[i] == p) {
+				return NULL;	/* pinned */
+			}
+		}
+	}
+	return p;
+}
+
+static CELL*
+gc_copy_cell(CELL* p)
+/* copy live cell <p> to to-space, leaving a forwarding cell behind */
+{
+	CELL* q;
+	CELL* list;
+	GC_CHUNK* c;
+
+	if (gc_copy__next == gc_copy__limit) {
+		c = gc_new_chunk();
+		if (gc_copy__tail == NULL) {
+			gc_copy__chunks = c;
+		} else {
+			gc_copy__tail->next = c;
+		}
+		gc_copy__tail = c;
+		gc_copy__next = c->base;
+		gc_copy__limit = c->base + GC_CHUNK_CELLS;
+	}
+	q = gc_copy__next++;
+	if (GC_FLAGS(p) & GC_FLAG_RSET) {
+		list = GC_RSET_LIST;
+	} else if (GC_FLAGS(p) & GC_FLAG_OLD) {
+		list = GC_OLD_LIST;
+	} else {
+		list = GC_FRESH_LIST;
+	}
+	GC_SET_SIZE(list, GC_SIZE(list) - 1);
+	gc_extract(p);
+	q->_prev = GC_MARK(p);
+	q->_next = GC_FLAGS(p);
+	GC_SET_FIRST(q, GC_FIRST(p));
+	GC_SET_REST(q, GC_REST(p));
+	gc_put(list, q);
+	p->_next = 0;			/* forwarded */
+	GC_SET_FIRST(p, as_cons(q));
+	return q;
+}
+
+static CONS*
+gc_forward_value(CONS* s)
+/* return the to-space equivalent of value <s>, copying its cells if needed */
+{
+	CELL* p;
+	CELL* q;
+	CONS* r;
+
+	p = gc_from_cell(s);
+	if (p == NULL) {
+		return s;
+	}
+	if (p->_next == 0) {
+		q = as_cell(GC_FIRST(p));	/* already copied */
+		return (actorp(s) ? MK_ACTOR(q) : as_cons(q));
+	}
+	q = gc_copy_cell(p);
+	s = (actorp(s) ? MK_ACTOR(q) : as_cons(q));
+	for (;;) {				/* keep the rest chain adjacent */
+		r = GC_REST(q);
+		p = gc_from_cell(r);
+		if ((p == NULL) || (p->_next == 0)) {
+			break;
+		}
+		p = gc_copy_cell(p);
+		GC_SET_REST(q, (actorp(r) ? MK_ACTOR(p) : as_cons(p)));
+		q = p;
+	}
+	return s;
+}
+
+static void
+gc_forward_cell(CELL* p)
+/* forward the references held by cell <p> */
+{
+	GC_SET_FIRST(p, gc_forward_value(GC_FIRST(p)));
+	GC_SET_REST(p, gc_forward_value(GC_REST(p)));
+}
+
+static void
+gc_pin_value(CONS* s)
+/* keep the cell <s> refers to (and its chunk) in place */
+{
+	CELL* p = gc_from_cell(s);
+
+	if (p != NULL) {
+		gc_chunk_of(p)->free = -2;
+		gc_pin__cells[gc_pin__cnt++] = p;
+	}
+}
+
+static WORD	gc_root__cnt = 0;	/* roots counted by gc_count_root() */
+
+static void
+gc_count_root(CONS* s)
+/* count a root value, see gc_visit_roots() */
+{
+	++gc_root__cnt;
+}
+
+static CONS*
+gc_moved_value(CONS* s)
+/* return the to-space equivalent of value <s>, if its cell has been copied */
+{
+	CELL* p = gc_from_cell(s);
+
+	if ((p == NULL) || (p->_next != 0)) {
+		return s;
+	}
+	p = as_cell(GC_FIRST(p));
+	return (actorp(s) ? MK_ACTOR(p) : as_cons(p));
+}
+
+static void
+gc_move_weak()
+/* follow copied weak references, and their copied targets (or registered cells) */
+{
+	GC_FINAL* f;
+	CONS* w;
+	CONS* next;
+	CONS* prev = NULL;
+
+	for (f = gc_final__list; f != NULL; f = f->next) {
+		f->cell = gc_moved_value(f->cell);
+	}
+
+	for (w = gc_weak__list; w != NULL; w = next) {
+		w = gc_moved_value(w);
+		next = GC_WEAK_NEXT(w);
+		GC_SET_FIRST(w, GC_HIDE(gc_moved_value(GC_WEAK_TARGET(w))));
+		if (prev == NULL) {
+			gc_weak__list = w;
+		} else {
+			GC_SET_REST(prev, GC_HIDE(w));
+		}
+		prev = w;
+	}
+}
+
+void
+gc_compact_collection(CONS* root, CONS* pinned)
+/* perform a full garbage collection, then copy live cells together (NOT CONCURRENT!) */
+{
+	GC_CHUNK** pp;
+	GC_CHUNK* c;
+	GC_FINAL* f;
+	CELL* p;
+	CELL* q;
+	CONS* s;
+	WORD i;
+	WORD n = 0;
+	WORD m = 0;
+	WORD us;
+	struct timespec t0;
+	BOOL locked;
+
+	DBUG_ENTER("gc_compact_collection");
+	gc_full_collection(root);
+	locked = gc_lock();		/* the collector thread is idle, but keep it that way */
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	gc_return_tlabs(TRUE);	/* claimed cells may be in from-space */
+	for (c = gc_heap__chunks; c != NULL; c = c->next) {
+		c->free = -1;		/* every chunk is from-space */
+	}
+	for (p = GC_NEXT(GC_FREE_LIST); p != GC_FREE_LIST; p = GC_NEXT(p)) {
+		GC_SET_MARK(p, GC_PHASE_Z);	/* tell free cells from live ones */
+	}
+	for (i = 0, s = pinned; consp(s) && !nilp(s); s = GC_REST(as_cell(s))) {
+		++i;
+	}
+	gc_root__cnt = 0;
+	gc_visit_roots(gc_count_root);
+	gc_pin__cells = NEWxN(CELL*, 2 * i + gc_root__cnt + 1);
+	assert(gc_pin__cells != NULL);
+	gc_pin__cnt = 0;
+	for (s = pinned; consp(s) && !nilp(s); s = GC_REST(as_cell(s))) {
+		gc_pin_value(s);		/* the list itself is held outside the heap */
+		gc_pin_value(GC_FIRST(as_cell(s)));
+	}
+	gc_visit_roots(gc_pin_value);	/* root sets are held outside the heap */
+	gc_copy__chunks = NULL;
+	gc_copy__tail = NULL;
+	gc_copy__next = NULL;
+	gc_copy__limit = NULL;
+	/* roots: the root list, pinned cells, permanent cells, and finalizer state */
+	gc_forward_value(root);
+	for (i = 0; i < gc_pin__cnt; ++i) {
+		gc_forward_cell(gc_pin__cells[i]);
+	}
+	for (s = gc_perm__base; s != gc_perm__next; ++s) {
+		GC_SET_FIRST(s, gc_forward_value(GC_FIRST(s)));
+		GC_SET_REST(s, gc_forward_value(GC_REST(s)));
+	}
+	for (f = gc_final__list; f != NULL; f = f->next) {
+		f->state = gc_forward_value(f->state);
+	}
+	for (f = gc_final__ready; f != NULL; f = f->next) {
+		f->state = gc_forward_value(f->state);
+	}
+	/* scan copied cells, in the order they were copied */
+	c = gc_copy__chunks;
+	p = (c ? c->base : NULL);
+	while (p != gc_copy__next) {
+		if (p == (c->base + GC_CHUNK_CELLS)) {
+			c = c->next;
+			p = c->base;
+			continue;
+		}
+		gc_forward_cell(p);
+		++p;
+	}
+	gc_move_weak();			/* weak targets are live, or already cleared */
+	FREE(gc_pin__cells);
+	gc_pin__cnt = 0;
+	/* from-space now holds only free, forwarding and pinned cells */
+	for (p = GC_NEXT(GC_FREE_LIST); p != GC_FREE_LIST; p = q) {
+		q = GC_NEXT(p);
+		if (gc_chunk_of(p)->free == -1) {
+			gc_extract(p);
+			++m;
+		}
+	}
+	GC_SET_SIZE(GC_FREE_LIST, GC_SIZE(GC_FREE_LIST) - m);
+	pp = &gc_heap__chunks;
+	while ((c = *pp) != NULL) {
+		if (c->free == -2) {
+			for (p = c->base; p < (c->base + GC_CHUNK_CELLS); ++p) {
+				if (p->_next == 0) {
+					GC_SET_MARK(p, GC_PHASE_Z);
+					gc_put(GC_FREE_LIST, p);	/* copied cells of a kept chunk are free */
+				}
+			}
+		}
+		if (c->free != -1) {
+			pp = &c->next;
+			continue;
+		}
+		*pp = c->next;			/* move the empty chunk to the spare list */
+		c->next = gc_spare__chunks;
+		gc_spare__chunks = c;
+		c->free = 0;
+		arena_release(c->base, GC_CHUNK_SIZE);
+		gc_heap__cnt -= GC_CHUNK_CELLS;
+		++n;
+	}
+	if (gc_copy__tail != NULL) {
+		for (p = gc_copy__next; p < gc_copy__limit; ++p) {
+			GC_SET_MARK(p, GC_PHASE_Z);
+			gc_put(GC_FREE_LIST, p);	/* the rest of the last chunk is free */
+		}
+		gc_copy__tail->next = gc_heap__chunks;
+		gc_heap__chunks = gc_copy__chunks;
+	}
+	for (c = gc_heap__chunks; c != NULL; c = c->next) {
+		c->free = 0;
+	}
+	DBUG_PRINT("gc", ("%lu chunks compacted, %lu cells in heap", n, gc_heap__cnt));
+	gc_pace_heap(TRUE);		/* restore the free cell target */
+	gc_sanity_check(GC_FRESH_LIST);
+	gc_sanity_check(GC_FREE_LIST);
+	gc_sanity_check(GC_OLD_LIST);
+	gc_sanity_check(GC_RSET_LIST);
+	us = gc_elapsed_us(&t0);
+	gc_stats__total.compact_us += us;
+	gc_record_pause(us);
+	gc_unlock(locked);
+	DBUG_RETURN;
+}
+
+CONS*
+gc_perm(CONS* first, CONS* rest)
+/* allocate and initialize a permanent cell (never garbage collected) */
+{
+	CONS* p;
+	BOOL locked;
+	BOOL shared;
+
+	locked = gc_lock();
+	shared = gc_lock_shared();	/* other threads may take permanent cells too */
+	if (gc_perm__arena == NULL) {
+		gc_perm__arena = arena_new(GC_PERM_RESERVE);
+	}
+	p = ((gc_perm__arena == NULL) ? NULL
+		: as_cons(arena_take(gc_perm__arena, sizeof(CONS), sizeof(CONS))));
+	if (p == NULL) {
+		gc_out_of_memory("permanent cells");	/* the region is full */
+	}
+	if (gc_perm__cnt >= GC_PERM_CEILING) {
+		gc_heap__exhausted = TRUE;	/* drop the computation, see gc_emergency() */
+	}
+	if (gc_perm__base == NULL) {
+		gc_perm__base = p;
+	}
+	assert((gc_perm__next == NULL) || (p == gc_perm__next));	/* contiguous */
+	gc_perm__next = p + 1;
+	++gc_perm__cnt;
+	gc_scan_value(first);	/* values stored during a cycle are live */
+	gc_scan_value(rest);
+	GC_SET_FIRST(p, first);
+	GC_SET_REST(p, rest);
+	gc_unlock_shared(shared);
+	gc_unlock(locked);
+	assert(consp(p));
+	return p;
+}
+
+static void
+gc_refill_tlab(GC_TLAB* t)
+/* claim free cells from GC_FREE_LIST for buffer <t> */
+{
+	CELL* p;
+	CELL* q;
+	WORD n;
+	WORD i;
+	BOOL locked;
+
+	assert(GC_SIZE(&t->free) == 0);
+	locked = gc_lock();
+	gc_enter_shared();
+	if (GC_SIZE(GC_FREE_LIST) == 0) {
+		gc_grow_heap(gc_growth_step());
+		if (GC_SIZE(GC_FREE_LIST) == 0) {
+			gc_emergency();
+		}
+	}
+	n = GC_SIZE(GC_FREE_LIST);
+	if (n > GC_TLAB_CELLS) {
+		n = GC_TLAB_CELLS;
+	}
+	p = GC_NEXT(GC_FREE_LIST);	/* move cells p..q, the first <n>, to <t> */
+	for (q = p, i = 1; i < n; ++i) {
+		q = GC_NEXT(q);
+	}
+	GC_SET_NEXT(GC_FREE_LIST, GC_NEXT(q));
+	GC_SET_PREV(GC_NEXT(q), GC_FREE_LIST);
+	GC_SET_SIZE(GC_FREE_LIST, GC_SIZE(GC_FREE_LIST) - n);
+	GC_SET_PREV(p, &t->free);
+	GC_SET_NEXT(q, &t->free);
+	GC_SET_NEXT(&t->free, p);
+	GC_SET_PREV(&t->free, q);
+	GC_SET_SIZE(&t->free, n);
+	gc_leave_shared();
+	gc_unlock(locked);
+}
+
+void
+gc_attach_thread()
+/* give the calling thread its own allocation buffer */
+{
+	GC_TLAB* t;
+
+	DBUG_ENTER("gc_attach_thread");
+	if (gc_tlab__self != NULL) {
+		DBUG_RETURN;		/* already attached */
+	}
+	gc_initialize();
+	t = NEW(GC_TLAB);
+	assert(t != NULL);
+	GC_SET_NEXT(&t->free, &t->free);
+	GC_SET_PREV(&t->free, &t->free);
+	GC_SET_SIZE(&t->free, 0);
+	GC_SET_NEXT(&t->fresh, &t->fresh);
+	GC_SET_PREV(&t->fresh, &t->fresh);
+	GC_SET_SIZE(&t->fresh, 0);
+	gc_enter_shared();
+	t->next = gc_tlab__list;
+	gc_tlab__list = t;
+	gc_leave_shared();
+	gc_tlab__self = t;
+	DBUG_RETURN;
+}
+
+void
+gc_detach_thread()
+/* hand the calling thread's buffer back to the shared lists */
+{
+	GC_TLAB** pp;
+	GC_TLAB* t = gc_tlab__self;
+	BOOL locked;
+
+	DBUG_ENTER("gc_detach_thread");
+	if (t == NULL) {
+		DBUG_RETURN;		/* not attached */
+	}
+	locked = gc_lock();
+	gc_enter_shared();
+	gc_append_list(GC_FRESH_LIST, &t->fresh);
+	gc_append_list(GC_FREE_LIST, &t->free);
+	gc_stats__total.cells_allocated += t->allocated;
+	for (pp = &gc_tlab__list; *pp != t; pp = &(*pp)->next)
+		;
+	*pp = t->next;
+	gc_leave_shared();
+	gc_unlock(locked);
+	FREE(t);
+	gc_tlab__self = NULL;
+	DBUG_RETURN;
+}
+
+CONS*
+gc_cons(CONS* first, CONS* rest)
+/* allocate and initialize a new "cons" cell */
+{
+	CELL* p;
+	CONS* s;
+	BOOL locked;
+	BOOL shared;
+	GC_TLAB* t = gc_tlab__self;
+
+	if (t != NULL) {		/* no shared state, unless a cycle is active */
+		if (GC_SIZE(&t->free) == 0) {
+			gc_refill_tlab(t);
+		}
+		p = gc_pop(&t->free);
+		++t->allocated;
+		GC_SET_MARK(p, gc_phase__mark);
+		GC_SET_FLAGS(p, 0);		/* new cells are young */
+		GC_SET_FIRST(p, first);
+		GC_SET_REST(p, rest);
+		gc_put(&t->fresh, p);
+		if (gc_cycle__active) {
+			locked = gc_lock();
+			gc_enter_shared();	/* scanning relinks the shared lists */
+			gc_scan_value(first);	/* values stored during a cycle are live */
+			gc_scan_value(rest);
+			gc_pace_allocation();
+			gc_leave_shared();
+			gc_unlock(locked);
+		}
+		s = as_cons(p);
+		assert(consp(s));
+		return s;
+	}
+	locked = gc_lock();
+	shared = gc_lock_shared();	/* buffers are refilled from GC_FREE_LIST */
+	if (GC_SIZE(GC_FREE_LIST) == 0) {
+		gc_grow_heap(gc_growth_step());
+		if (GC_SIZE(GC_FREE_LIST) == 0) {
+			gc_emergency();
+		}
+	}
+	p = gc_pop(GC_FREE_LIST);
+	assert(p != NULL);
+	++gc_stats__total.cells_allocated;
+	gc_scan_value(first);	/* values stored during a cycle are live */
+	gc_scan_value(rest);
+	GC_SET_MARK(p, gc_phase__mark);
+	GC_SET_FLAGS(p, 0);		/* new cells are young */
+	GC_SET_FIRST(p, first);
+	GC_SET_REST(p, rest);
+	gc_put(GC_FRESH_LIST, p);
+	gc_pace_allocation();	/* keep scanning ahead of allocation */
+	gc_unlock_shared(shared);
+	gc_unlock(locked);
+	s = as_cons(p);
+	assert(consp(s));
+	return s;
+}
+
+#if !GC_SATB_BARRIER
+static CELL*
+gc_check_access(CONS* cell)
+/* ensure that accessed cells are considered "live" */
+{
+	CELL* p;
+	BOOL locked;
+
+	assert(consp(cell));
+	p = as_cell(cell);
+	if (!GC_PERM_CELL(p) && (GC_MARK(p) == gc_phase__prev)) {
+		locked = gc_lock();	/* marks only change from "previous", so check again */
+		if (GC_MARK(p) == gc_phase__prev) {
+			gc_scan_cell(p);	/* any "aged" cell accessed must be "live", so scan it */
+		}
+		gc_unlock(locked);
+	}
+	return p;
+}
+#endif /* !GC_SATB_BARRIER */
+
+static void
+gc_write_barrier(CELL* p, CONS* old, CONS* s)
+/* record the store of <s> over <old> in cell <p> */
+{
+#if GC_SATB_BARRIER
+	gc_scan_value(old);		/* values overwritten during a cycle stay live */
+#else
+	gc_scan_value(s);		/* values stored during a cycle are live */
+#endif
+	if (!GC_PERM_CELL(p)
+	&& ((GC_FLAGS(p) & (GC_FLAG_OLD | GC_FLAG_RSET)) == GC_FLAG_OLD)
+	&& gc_young_value(s)) {
+		gc_remember_cell(p);	/* old-to-young reference */
+	}
+}
+
+#endif /* GC_PACKED_HEAP */
+
+#if GC_PACKED_HEAP
+typedef CONS	GC_CELL;	/* heap cells are bare pairs */
+#else
+typedef CELL	GC_CELL;
+#endif
+
+#if GC_SATB_BARRIER
+#define	gc_check_access(cell)	((GC_CELL*)(cell))	/* loads need no barrier */
+#endif
+
+#if GC_CDR_CODING
+static CONS*
+gc_element(CONS* s, CONS*** slot)
+/* return the normal cell for element <s>, or NULL and its <slot> if coded */
+{
+	GC_CHUNK* c = gc_chunk_of(s);
+	WORD i;
+
+	*slot = NULL;
+	if (c == NULL) {
+		return s;
+	}
+	i = GC_CELL_INDEX(c, s);
+	if (!(c->code[GC_BIT_WORD(i)] & GC_BIT_MASK(i))) {
+		return s;
+	}
+	i = GC_SLOT_INDEX(c, s);
+	*slot = ((CONS**)c->base) + i;
+	if (c->split[GC_BIT_WORD(i)] & GC_BIT_MASK(i)) {
+		return gc_check_access(**slot);	/* split off */
+	}
+	return NULL;
+}
+#endif /* GC_CDR_CODING */
+
+CONS*
+gc_first(CONS* cell)
+{
+	GC_CELL* p;
+#if GC_CDR_CODING
+	CONS** slot;
+#endif
+
+	if (nilp(cell)) {
+		return NIL;
+	}
+	p = gc_check_access(cell);
+#if GC_CDR_CODING
+	p = gc_element(p, &slot);
+	if (p == NULL) {
+		return *slot;
+	}
+#endif
+	return GC_FIRST(p);
+}
+
+CONS*
+gc_rest(CONS* cell)
+{
+	GC_CELL* p;
+#if GC_CDR_CODING
+	CONS** slot;
+#endif
+
+	if (nilp(cell)) {
+		return NIL;
+	}
+	p = gc_check_access(cell);
+#if GC_CDR_CODING
+	p = gc_element(p, &slot);
+	if (p == NULL) {
+		return as_cons(slot + 1);	/* the next slot */
+	}
+#endif
+	return GC_REST(p);
+}
+
+void
+gc_set_first(CONS* cell, CONS* first)
+{
+	GC_CELL* p;
+	BOOL locked;
+#if GC_CDR_CODING
+	CONS** slot;
+#endif
+
+	assert(!nilp(cell));
+	p = gc_check_access(cell);
+#if GC_CDR_CODING
+	p = gc_element(p, &slot);
+	if (p == NULL) {
+		locked = gc_lock();
+		gc_write_barrier(cell, *slot, first);
+		*slot = first;
+		gc_unlock(locked);
+		return;
+	}
+#endif
+	locked = gc_lock();		/* the collector must see the barrier and the store together */
+	gc_write_barrier(p, GC_FIRST(p), first);
+	GC_SET_FIRST(p, first);
+	gc_unlock(locked);
+}
+
+void
+gc_set_rest(CONS* cell, CONS* rest)
+{
+	GC_CELL* p;
+	BOOL locked;
+#if GC_CDR_CODING
+	CONS** slot;
+	GC_CHUNK* c;
+	WORD i;
+#endif
+
+	assert(!nilp(cell));
+	p = gc_check_access(cell);
+#if GC_CDR_CODING
+	p = gc_element(p, &slot);
+	if (p == NULL) {		/* split the element off its run */
+		p = gc_cons(*slot, rest);
+		c = gc_chunk_of(cell);
+		i = GC_SLOT_INDEX(c, cell);
+		locked = gc_lock();
+		gc_write_barrier(cell, *slot, p);
+		*slot = p;
+		c->split[GC_BIT_WORD(i)] |= GC_BIT_MASK(i);
+		gc_unlock(locked);
+		return;
+	}
+#endif
+	locked = gc_lock();		/* the collector must see the barrier and the store together */
+	gc_write_barrier(p, GC_REST(p), rest);
+	GC_SET_REST(p, rest);
+	gc_unlock(locked);
+}
+
+CONS*
+gc_list(CONS** values, WORD n, CONS* tail)
+/* allocate a list of <n> <values> ending in <tail>, coded in runs if GC_CDR_CODING */
+{
+#if GC_CDR_CODING
+	CONS* p;
+	WORD k;
+
+	while (n > 0) {
+		k = ((n < GC_RUN_MAX) ? n : GC_RUN_MAX);
+		p = NULL;
+		while ((k >= 3) && ((p = gc_take_run(gc_next_chunk(), (k / 2) + 1)) == NULL)) {
+			k /= 2;			/* no room for a run this long */
+		}
+		if (p == NULL) {
+			tail = gc_cons(values[--n], tail);	/* moves on to a chunk with room */
+			continue;
+		}
+		n -= k;
+		tail = gc_fill_run(p, values + n, k, tail);
+	}
+#else
+	while (n > 0) {
+		tail = gc_cons(values[--n], tail);
+	}
+#endif
+	return tail;
+}
+
+CONS*
+gc_weak(CONS* target)
+/* allocate a weak reference to <target>, which does not keep <target> alive */
+{
+	CONS* w;
+	BOOL shared;
+
+	w = gc_cons(GC_HIDE(target), GC_HIDE(NULL));
+	shared = gc_lock_shared();	/* mutator threads share the list */
+	GC_SET_REST(w, GC_HIDE(gc_weak__list));
+	gc_weak__list = w;		/* only the mutator uses the list, see gc_clear_weak() */
+	gc_unlock_shared(shared);
+	return w;
+}
+
+CONS*
+gc_weak_get(CONS* weak)
+/* return the target of <weak>, or NIL if the target has been collected */
+{
+	CONS* s;
+	BOOL locked;
+
+	s = GC_UNHIDE(gc_first(weak));
+	locked = gc_lock();
+	if (gc_cycle__active) {
+		gc_scan_value(s);	/* the target is strongly held from now on */
+	}
+	gc_unlock(locked);
+	return s;
+}
+
+BOOL
+gc_weak_cleared(CONS* weak)
+/* return TRUE if the target of <weak> has been collected (the target stays weak) */
+{
+	return nilp(GC_UNHIDE(gc_first(weak)));
+}
+
+static void
+gc_clear_weak()
+/* forget dying weak references, and clear weak references to dying cells */
+{
+	CONS* w;
+	CONS* next;
+	CONS* prev = NULL;
+	WORD n = 0;
+
+	DBUG_ENTER("gc_clear_weak");
+	for (w = gc_weak__list; w != NULL; w = next) {
+		next = GC_WEAK_NEXT(w);
+		if (gc_dying_value(w)) {
+			if (prev == NULL) {
+				gc_weak__list = next;
+			} else {
+				GC_SET_REST(prev, GC_HIDE(next));
+			}
+			continue;
+		}
+		if (gc_dying_value(GC_WEAK_TARGET(w))) {
+			GC_SET_FIRST(w, GC_HIDE(NIL));
+			++n;
+		}
+		prev = w;
+	}
+	gc_stats__total.weak_cleared += n;
+	DBUG_PRINT("gc", ("%lu weak references cleared", n));
+	DBUG_RETURN;
+}
+
+CONS*
+gc_weak_map_get(CONS* map, CONS* key, CONS* def)
+/* return the value bound to <key> in weak-keyed <map>, or <def> if not found */
+{
+	CONS* entry;
+
+	while (consp(map) && !nilp(map)) {
+		entry = gc_first(map);
+		if (GC_UNHIDE(gc_first(gc_first(entry))) == key) {
+			return gc_rest(entry);
+		}
+		map = gc_rest(map);
+	}
+	return def;
+}
+
+CONS*
+gc_weak_map_put(CONS* map, CONS* key, CONS* value)
+/*
+ * Bind <key> (held weakly) to <value> (held strongly) in <map>,
+ * returning the new map. Entries whose keys have been collected
+ * are removed from <map> along the way.
+ */
+{
+	CONS* p;
+	CONS* q;
+
+	while (consp(map) && !nilp(map) && gc_weak_cleared(gc_first(gc_first(map)))) {
+		map = gc_rest(map);
+	}
+	for (p = map; consp(p) && !nilp(p); p = q) {
+		q = gc_rest(p);
+		while (consp(q) && !nilp(q) && gc_weak_cleared(gc_first(gc_first(q)))) {
+			q = gc_rest(q);
+			gc_set_rest(p, q);	/* unlink the dead entry */
+		}
+	}
+	return gc_cons(gc_cons(gc_weak(key), value), map);
+}
+
+void
+gc_finalize(CONS* cell, CONS* beh, CONS* state)
+/*
+ * Register <cell> for finalization. Once the collector finds <cell>
+ * unreachable, <beh> and <state> are queued for gc_next_finalizer().
+ * <state> is kept alive until then, so it must not refer to <cell>.
+ */
+{
+	GC_FINAL* f;
+	BOOL locked;
+
+	DBUG_ENTER("gc_finalize");
+	f = NEW(GC_FINAL);
+	assert(f != NULL);
+	f->cell = cell;
+	f->beh = beh;
+	f->state = state;
+	locked = gc_lock_shared();	/* mutator threads share the list */
+	f->next = gc_final__list;
+	gc_final__list = f;		/* only the mutator uses the list, see gc_queue_finalizers() */
+	gc_unlock_shared(locked);
+	locked = gc_lock();
+	if (gc_cycle__active) {
+		gc_scan_value(state);	/* not a root when this cycle started */
+	}
+	gc_unlock(locked);
+	DBUG_RETURN;
+}
+
+BOOL
+gc_finalization_pending()
+/* return TRUE if gc_next_finalizer() has a finalizer to run */
+{
+	return (gc_final__ready != NULL);
+}
+
+BOOL
+gc_next_finalizer(CONS** beh, CONS** state)
+/* remove the next finalizer from the queue, return FALSE if there is none */
+{
+	GC_FINAL* f = gc_final__ready;
+
+	if (f == NULL) {
+		return FALSE;
+	}
+	gc_final__ready = f->next;
+	*beh = f->beh;
+	*state = f->state;
+	FREE(f);
+	return TRUE;
+}
+
+void
+gc_add_roots(GC_ROOTS roots, void* ctx)
+/* register a root set, scanned by every collection */
+{
+	GC_ROOT_SET* r;
+
+	DBUG_ENTER("gc_add_roots");
+	r = NEW(GC_ROOT_SET);
+	assert(r != NULL);
+	r->roots = roots;
+	r->ctx = ctx;
+	r->next = gc_root__sets;
+	gc_root__sets = r;
+	DBUG_RETURN;
+}
+
+static void
+gc_visit_roots(GC_VISIT visit)
+/* apply <visit> to the roots of every root set */
+{
+	GC_ROOT_SET* r;
+
+	for (r = gc_root__sets; r != NULL; r = r->next) {
+		(*r->roots)(r->ctx, visit);
+	}
+}
+
+static void
+gc_scan_root(CONS* s)
+/* scan a root value, see gc_visit_roots() */
+{
+	gc_scan_value(s);
+}
+
+static void
+gc_scan_roots(CONS* root)
+/* scan <root>, the root sets, and the state of each finalizer (registered or queued) */
+{
+	GC_FINAL* f;
+
+	gc_scan_value(root);
+	gc_visit_roots(gc_scan_root);
+	for (f = gc_final__list; f != NULL; f = f->next) {
+		gc_scan_value(f->state);
+	}
+	for (f = gc_final__ready; f != NULL; f = f->next) {
+		gc_scan_value(f->state);
+	}
+}
+
+static void
+gc_queue_finalizers()
+/* move the registrations of dying cells to the finalizer queue */
+{
+	GC_FINAL** pp = &gc_final__list;
+	GC_FINAL* f;
+	WORD n = 0;
+
+	DBUG_ENTER("gc_queue_finalizers");
+	while ((f = *pp) != NULL) {
+		if (!gc_dying_value(f->cell)) {
+			pp = &f->next;
+			continue;
+		}
+		*pp = f->next;
+		f->cell = NIL;
+		f->next = gc_final__ready;
+		gc_final__ready = f;
+		++n;
+	}
+	gc_stats__total.cells_finalized += n;
+	DBUG_PRINT("gc", ("%lu cells queued for finalization", n));
+	DBUG_RETURN;
+}
+
+static BOOL
+gc_snap_cell(FILE* f, CONS* p, WORD flags, WORD* n)
+/* write the snapshot record for allocated cell <p>, counting records in <n> */
+{
+	WORD w[3];
+#if GC_CDR_CODING
+	GC_CHUNK* c;
+	CONS** slot;
+	WORD i;
+	WORD j;
+
+	if (gc_coded_cell(p)) {		/* a record per element, a split element refers to its cell */
+		c = gc_chunk_of(p);
+		slot = (CONS**)p;
+		for (j = 0; j < 2; ++j) {
+			i = GC_SLOT_INDEX(c, slot + j);
+			w[0] = as_word(slot + j) | flags;
+			w[1] = as_word(slot[j]);
+			w[2] = as_word((c->split[GC_BIT_WORD(i)] & GC_BIT_MASK(i)) ? NIL : as_cons(slot + j + 1));
+			if (fwrite(w, sizeof(WORD), 3, f) != 3) {
+				return FALSE;
+			}
+			++*n;
+		}
+		return TRUE;
+	}
+#endif
+	w[0] = as_word(p) | flags;
+	w[1] = as_word(GC_FIRST(p));
+	w[2] = as_word(GC_REST(p));
+	++*n;
+	return (fwrite(w, sizeof(WORD), 3, f) == 3);
+}
+
+#if !GC_PACKED_HEAP
+static BOOL
+gc_snap_list(FILE* f, CELL* list, WORD flags, WORD* n)
+/* write snapshot records for the cells on <list> */
+{
+	CELL* p;
+
+	for (p = GC_NEXT(list); p != list; p = GC_NEXT(p)) {
+		if (!gc_snap_cell(f, as_cons(p), flags, n)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+#endif /* !GC_PACKED_HEAP */
+
+BOOL
+gc_write_snapshot(FILE* f, CONS* root)
+/*
+ * Write every allocated cell to <f>, in a single pass over the heap
+ * (see gc.h for the format). Cells are not traced, so garbage not yet
+ * collected is included; the analyzer finds what is reachable from
+ * <root> and the permanent cells. Returns FALSE on a write error.
+ */
+{
+	WORD w[GC_SNAP_HEADER];
+	WORD n = 0;
+	BOOL ok;
+	BOOL locked;
+	WORD i;
+#if GC_PACKED_HEAP
+	GC_CHUNK* c;
+	WORD j;
+	ulint bits;
+#endif
+
+	DBUG_ENTER("gc_write_snapshot");
+	gc_snap__requested = 0;
+	locked = gc_lock();
+	w[0] = as_word(sizeof(WORD));
+	w[1] = as_word(sizeof(GC_CELL));
+	w[2] = as_word(NIL);
+	w[3] = as_word(root);
+	w[4] = as_word(gc_write_snapshot);
+	ok = (fwrite(GC_SNAP_MAGIC, 1, 8, f) == 8)
+	  && (fwrite(w, sizeof(WORD), GC_SNAP_HEADER, f) == GC_SNAP_HEADER);
+#if GC_PACKED_HEAP
+	for (i = 0; ok && (i < 2); ++i) {
+		for (c = (i ? gc_perm__chunks : gc_heap__chunks); ok && (c != NULL); c = c->next) {
+			for (j = 0; ok && (j < GC_CHUNK_CELLS); j += GC_WORD_BITS) {
+				bits = c->used[j / GC_WORD_BITS];
+				while (ok && (bits != 0)) {
+					ok = gc_snap_cell(f, c->base + j + gc_lowest_bit(bits),
+						(i ? GC_SNAP_PERM : 0), &n);
+					bits &= (bits - 1);
+				}
+			}
+		}
+	}
+#else
+	ok = ok
+	  && gc_snap_list(f, GC_AGED_LIST, 0, &n)
+	  && gc_snap_list(f, GC_SCAN_LIST, 0, &n)
+	  && gc_snap_list(f, GC_FRESH_LIST, 0, &n)
+	  && gc_snap_list(f, GC_OLD_LIST, GC_SNAP_OLD, &n)
+	  && gc_snap_list(f, GC_RSET_LIST, GC_SNAP_OLD, &n);
+	for (i = 0; ok && (i < gc_perm__cnt); ++i) {
+		ok = gc_snap_cell(f, gc_perm__base + i, GC_SNAP_PERM, &n);
+	}
+#endif
+	gc_unlock(locked);
+	w[0] = 0;
+	w[1] = n;
+	w[2] = 0;
+	ok = ok && (fwrite(w, sizeof(WORD), 3, f) == 3) && (fflush(f) == 0);
+	DBUG_PRINT("gc", ("%ld cells written, ok=%d", (long)n, ok));
+	DBUG_RETURN ok;
+}
+
+static void
+test_chunk_release(CONS* root)
+/* empty chunks are returned to the OS, down to the retention floor */
+{
+	WORD h;
+	WORD n;
+
+	DBUG_ENTER("test_chunk_release");
+	gc_set_pacing(0, 0, 100);	/* no automatic heap growth */
+	gc_set_retention(0);
+	gc_full_collection(root);	/* release every empty chunk */
+	h = gc_heap__cnt;
+	n = GC_FREE_COUNT;
+	assert(n < h);
+	gc_presize_heap(n + (4 * GC_CHUNK_CELLS));	/* reuses released chunks */
+	assert(gc_heap__cnt >= (h + (4 * GC_CHUNK_CELLS)));
+	gc_full_collection(root);
+	assert(gc_heap__cnt == h);	/* heap shrinks back after a burst */
+	assert(GC_FREE_COUNT == n);
+#if !GC_PACKED_HEAP
+	gc_presize_heap(n + (4 * GC_CHUNK_CELLS));
+	gc_major__cycle = FALSE;
+	gc_start_cycle();
+	gc_age_cells();
+	gc_scan_roots(root);
+	while (gc_refresh_cell() == TRUE)
+		;
+	gc_free_cells();
+	assert(gc_heap__cnt >= (h + (4 * GC_CHUNK_CELLS)));	/* a minor cycle keeps empty chunks */
+	gc_full_collection(root);
+	assert(gc_heap__cnt == h);
+#endif
+	gc_set_retention(n + (2 * GC_CHUNK_CELLS));
+	gc_presize_heap(n + (4 * GC_CHUNK_CELLS));
+	gc_full_collection(root);
+	assert(gc_heap__cnt == (h + (2 * GC_CHUNK_CELLS)));	/* floor is kept */
+	assert(GC_FREE_COUNT == (n + (2 * GC_CHUNK_CELLS)));
+	gc_set_retention(GC_RETAIN_CELLS);
+	gc_set_pacing(GC_LOW_WATER, GC_HIGH_WATER, GC_GROWTH_RATIO);
+	DBUG_RETURN;
+}
+
+static void
+test_heap_growth()
+/* the heap grows geometrically, and may be pre-sized */
+{
+	WORD n;
+
+	DBUG_ENTER("test_heap_growth");
+	gc_set_pacing(0, 0, 100);	/* no automatic heap growth */
+	n = gc_heap__cnt;
+	gc_presize_heap(GC_FREE_COUNT + 1);
+	assert(gc_heap__cnt > n);
+	gc_set_heap_growth(100);
+	while (GC_FREE_COUNT > 0) {
+		gc_cons(NIL, NIL);		/* garbage */
+	}
+	n = gc_heap__cnt;
+	gc_cons(NIL, NIL);
+	assert(gc_heap__cnt >= (2 * n));	/* heap doubles */
+	gc_set_heap_growth(GC_HEAP_GROWTH);
+	gc_set_pacing(GC_LOW_WATER, GC_HIGH_WATER, GC_GROWTH_RATIO);
+	DBUG_RETURN;
+}
+
+static void
+test_scan_budget()
+/* the scanning batch halves over its time budget, and doubles well under it */
+{
+	DBUG_ENTER("test_scan_budget");
+	gc_set_scan_budget(4 * GC_SCAN_CHECK, 100);
+	gc_adapt_batch(4 * GC_SCAN_CHECK, 101);		/* over budget */
+	assert(gc_scan__batch == (2 * GC_SCAN_CHECK));
+	gc_adapt_batch(2 * GC_SCAN_CHECK, 1000);
+	gc_adapt_batch(GC_SCAN_CHECK, 1000);
+	assert(gc_scan__batch == GC_SCAN_CHECK);	/* at least one clock check */
+	gc_adapt_batch(GC_SCAN_CHECK, 49);			/* well under budget */
+	assert(gc_scan__batch == (2 * GC_SCAN_CHECK));
+	gc_adapt_batch(2 * GC_SCAN_CHECK, 50);		/* within budget */
+	assert(gc_scan__batch == (2 * GC_SCAN_CHECK));
+	gc_adapt_batch(GC_SCAN_CHECK, 0);			/* batch cut short */
+	assert(gc_scan__batch == (2 * GC_SCAN_CHECK));
+	gc_set_scan_budget(GC_SCAN_BATCH_MAX, 100);
+	gc_adapt_batch(GC_SCAN_BATCH_MAX, 0);
+	assert(gc_scan__batch == GC_SCAN_BATCH_MAX);	/* at most the largest batch */
+	gc_set_scan_budget(GC_SCAN_BATCH, GC_SCAN_BUDGET);
+	DBUG_RETURN;
+}
+
+#if GC_COLLECTOR_THREAD
+static void
+test_collector_thread(CONS* root)
+/* the mutator keeps allocating while the collector thread scans */
+{
+	CONS* s = NIL;
+	CONS* p;
+	WORD n = 0;
+	BOOL locked;
+
+	DBUG_ENTER("test_collector_thread");
+	gc_set_pacing(0, 0, 100);	/* no automatic heap growth */
+	gc_cycle__active = TRUE;
+	locked = gc_lock();
+	gc_major__cycle = TRUE;
+	gc_age_cells();
+	gc_scan_value(root);
+	gc_wake_collector();
+	gc_unlock(locked);
+	while (gc_thread__state == GC_THREAD_SCAN) {
+		s = gc_cons(NUMBER(8), s);	/* fresh cells are not scanned */
+		++n;
+	}
+	assert(gc_thread__state == GC_THREAD_DONE);
+	locked = gc_lock();
+	while (gc_refresh_cell() == TRUE)
+		;
+	gc_free_cells();
+	gc_unlock(locked);
+	assert(gc_cycle__active == FALSE);
+	assert(gc_thread__state == GC_THREAD_IDLE);
+	for (p = s; !nilp(p); p = GC_REST(p)) {
+		assert(GC_FIRST(p) == NUMBER(8));
+		--n;
+	}
+	assert(n == 0);
+	gc_set_pacing(GC_LOW_WATER, GC_HIGH_WATER, GC_GROWTH_RATIO);
+	DBUG_RETURN;
+}
+#endif /* GC_COLLECTOR_THREAD */
+
+#if GC_PARALLEL_MARK
+static void
+test_parallel_mark(CONS* root)
+/* parallel marking must retain exactly what serial marking retains */
+{
+	CONS* keep = NIL;
+	CONS* p;
+	WORD i;
+	WORD n;
+
+	DBUG_ENTER("test_parallel_mark");
+	gc_set_pacing(0, 0, 100);	/* no automatic heap growth */
+	gc_set_retention(as_word(1) << 30);	/* no chunks released */
+	for (i = 0; i < (1 << 16); ++i) {
+		p = gc_cons(NUMBER(i), keep);	/* shares the tail of "keep" */
+		gc_cons(p, NIL);				/* garbage */
+		keep = gc_cons(p, keep);
+	}
+	root = gc_cons(keep, root);
+	gc_set_mark_threads(1);
+	gc_full_collection(root);
+	n = GC_FREE_COUNT;
+	gc_parallel__minimum = 0;
+	gc_set_mark_threads(4);
+	gc_full_collection(root);
+	assert(GC_FREE_COUNT == n);
+	for (p = keep; !nilp(p); p = GC_REST(p)) {
+		assert(GC_FIRST(GC_FIRST(p)) == NUMBER(--i));
+		assert(GC_REST(GC_FIRST(p)) == GC_REST(p));
+	}
+	assert(i == 0);
+	gc_spawn__max = 2;			/* as if the third thread failed to start */
+	gc_full_collection(root);
+	assert(GC_FREE_COUNT == n);
+	gc_spawn__max = GC_MARK_THREADS_MAX;
+	gc_full_collection(GC_REST(root));
+	assert(GC_FREE_COUNT == (n + (2 << 16) + 1));
+	gc_parallel__minimum = GC_PARALLEL_MINIMUM;
+	gc_set_mark_threads(0);
+	gc_set_retention(GC_RETAIN_CELLS);
+	gc_set_pacing(GC_LOW_WATER, GC_HIGH_WATER, GC_GROWTH_RATIO);
+	DBUG_RETURN;
+}
+#endif /* GC_PARALLEL_MARK */
+
+static void
+test_gc_stats(CONS* root)
+/* statistics count each cycle, its pause, and the cells involved */
+{
+	GC_STATS s0;
+	GC_STATS s1;
+	WORD n = 0;
+	FILE* f;
+	int i;
+
+	DBUG_ENTER("test_gc_stats");
+	gc_get_stats(&s0);
+	gc_cons(NIL, NIL);		/* garbage */
+	gc_request_collection();
+	assert(gc_collection_requested() == TRUE);
+	gc_full_collection(root);
+	assert(gc_collection_requested() == FALSE);
+	gc_get_stats(&s1);
+	assert(s1.cells_allocated == (s0.cells_allocated + 1));
+	assert(s1.full_collections == (s0.full_collections + 1));
+	assert(s1.cycles_started == (s0.cycles_started + 1));
+	assert(s1.cycles_completed == (s0.cycles_completed + 1));
+	assert(s1.major_cycles == (s0.major_cycles + 1));
+	assert(s1.cells_scanned > s0.cells_scanned);
+	assert(s1.cells_freed > s0.cells_freed);
+	assert(s1.pause_cnt == (s0.pause_cnt + 1));
+	assert(s1.pause_us >= s0.pause_us);
+	assert(s1.heap_cells == gc_heap__cnt);
+	assert(s1.free_cells == GC_FREE_COUNT);
+	for (i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+		n += s1.pause_hist[i];
+	}
+	assert(n == s1.pause_cnt);
+	f = tmpfile();
+	assert(f != NULL);
+	gc_dump_stats(f);
+	rewind(f);
+	assert(fgetc(f) == '{');
+	fclose(f);
+	DBUG_RETURN;
+}
+
+static void
+test_heap_snapshot(CONS* root)
+/* a snapshot holds one record for each allocated cell */
+{
+	char magic[8];
+	WORD w[GC_SNAP_HEADER];
+	WORD n = 0;
+	BOOL found = FALSE;
+	BOOL ok;
+	size_t k;
+	CONS* p;
+	FILE* f;
+
+	DBUG_ENTER("test_heap_snapshot");
+	p = gc_cons(NUMBER(42), root);
+	gc_request_snapshot();
+	assert(gc_snapshot_requested() == TRUE);
+	f = tmpfile();
+	assert(f != NULL);
+	ok = gc_write_snapshot(f, p);
+	assert(ok == TRUE);
+	assert(gc_snapshot_requested() == FALSE);
+	rewind(f);
+	k = fread(magic, 1, 8, f);
+	assert(k == 8);
+	assert(memcmp(magic, GC_SNAP_MAGIC, 8) == 0);
+	k = fread(w, sizeof(WORD), GC_SNAP_HEADER, f);
+	assert(k == GC_SNAP_HEADER);
+	assert(w[0] == as_word(sizeof(WORD)));
+	assert(w[1] == as_word(sizeof(GC_CELL)));
+	assert(w[2] == as_word(NIL));
+	assert(w[3] == as_word(p));
+	for (;;) {
+		k = fread(w, sizeof(WORD), 3, f);
+		assert(k == 3);
+		if ((k != 3) || (w[0] == 0)) {
+			break;
+		}
+		if ((w[0] & ~GC_SNAP_FLAGS) == as_word(p)) {
+			assert((w[0] & GC_SNAP_FLAGS) == 0);	/* young, collectable */
+			assert(w[1] == as_word(NUMBER(42)));
+			assert(w[2] == as_word(root));
+			found = TRUE;
+		}
+		++n;
+	}
+	assert(found);
+	assert(w[1] == n);
+	assert(n >= (gc_heap__cnt - GC_FREE_COUNT));
+	fclose(f);
+	DBUG_RETURN;
+}
+
+static void
+test_weak_refs(CONS* r)
+/* weak references are cleared when their targets are collected */
+{
+	CONS* dead = gc_cons(NUMBER(1), NIL);
+	CONS* live = gc_cons(NUMBER(2), NIL);
+	CONS* w1 = gc_weak(dead);
+	CONS* w2 = gc_weak(MK_ACTOR(live));
+	CONS* map = NIL;
+	CONS* root;
+	GC_STATS stats;
+	WORD n;
+
+	DBUG_ENTER("test_weak_refs");
+	map = gc_weak_map_put(map, dead, NUMBER(3));
+	map = gc_weak_map_put(map, live, NUMBER(4));
+	assert(gc_weak_map_get(map, dead, NIL) == NUMBER(3));
+	root = gc_cons(live, gc_cons(w1, gc_cons(w2, gc_cons(map, r))));
+	gc_get_stats(&stats);
+	n = stats.weak_cleared;
+	gc_full_collection(root);
+	assert(gc_weak_cleared(w1));
+	assert(nilp(gc_weak_get(w1)));
+	assert(!gc_weak_cleared(w2));
+	assert(gc_weak_get(w2) == MK_ACTOR(live));
+	assert(gc_weak_map_get(map, live, NIL) == NUMBER(4));
+	assert(gc_weak_map_get(map, dead, NIL) == NIL);
+	map = gc_weak_map_put(map, live, NUMBER(5));	/* prunes the dead entry */
+	assert(gc_weak_map_get(map, live, NIL) == NUMBER(5));
+	assert(nilp(gc_rest(gc_rest(map))));
+	gc_get_stats(&stats);
+	assert(stats.weak_cleared == (n + 2));		/* "w1" and the key of "dead" */
+	gc_full_collection(r);
+	DBUG_RETURN;
+}
+
+static void
+test_finalization(CONS* r)
+/* registered cells are queued for finalization once unreachable */
+{
+	CONS* dead = gc_cons(NUMBER(1), NIL);
+	CONS* live = gc_cons(NUMBER(2), NIL);
+	CONS* state = gc_cons(NUMBER(3), NIL);	/* held only by the finalizer */
+	CONS* root;
+	CONS* beh;
+	GC_STATS stats;
+	WORD n;
+
+	DBUG_ENTER("test_finalization");
+	gc_finalize(dead, NUMBER(4), state);
+	gc_finalize(MK_ACTOR(live), NUMBER(5), NIL);
+	root = gc_cons(live, r);
+	gc_get_stats(&stats);
+	n = stats.cells_finalized;
+	gc_full_collection(root);
+	assert(gc_finalization_pending());
+	gc_full_collection(root);				/* queued state stays alive */
+	assert(gc_next_finalizer(&beh, &state));
+	assert(beh == NUMBER(4));
+	assert(gc_first(state) == NUMBER(3));
+	assert(!gc_finalization_pending());
+	assert(!gc_next_finalizer(&beh, &state));
+	gc_get_stats(&stats);
+	assert(stats.cells_finalized == (n + 1));
+	gc_full_collection(r);					/* "live" is unreachable now */
+	assert(gc_next_finalizer(&beh, &state));
+	assert(beh == NUMBER(5));
+	assert(!gc_finalization_pending());
+	DBUG_RETURN;
+}
+
+static CONS*	test__root = NIL;	/* visited by test_visit_roots() */
+
+static void
+test_visit_roots(void* ctx, GC_VISIT visit)
+{
+	(*visit)(*(CONS**)ctx);
+}
+
+static void
+test_root_sets(CONS* r)
+/* values visited by a registered root set survive collection */
+{
+	CONS* weak;
+	CONS* root;
+
+	DBUG_ENTER("test_root_sets");
+	gc_add_roots(test_visit_roots, &test__root);
+	test__root = gc_cons(NUMBER(6), NIL);
+	weak = gc_weak(test__root);
+	root = gc_cons(weak, r);
+	gc_full_collection(root);
+	assert(!gc_weak_cleared(weak));
+	assert(gc_first(test__root) == NUMBER(6));
+	test__root = NIL;
+	gc_full_collection(root);
+	assert(gc_weak_cleared(weak));
+	gc_full_collection(r);
+	DBUG_RETURN;
+}
+
+static void
+test_heap_limit(CONS* r)
+/* the heap stops growing at its limit, and a full collection checks the live cells */
+{
+	CONS* list = NIL;
+	WORD limit;
+	WORD n;
+
+	DBUG_ENTER("test_heap_limit");
+	gc_full_collection(r);
+	limit = gc_heap__cnt;
+	gc_set_heap_limit(limit);
+	for (n = GC_FREE_COUNT; n > 0; --n) {
+		list = gc_cons(NUMBER(n), list);
+	}
+	assert(gc_heap__cnt == limit);			/* no growth yet */
+	assert(gc_collection_requested() == FALSE);
+	list = gc_cons(NUMBER(0), list);		/* past the limit */
+	assert(gc_collection_requested() == TRUE);
+	assert(gc_heap__cnt > limit);
+	assert(gc_heap__cnt <= gc_heap__ceiling);
+	while ((GC_FREE_COUNT > 0) || gc_heap_room()) {
+		list = gc_cons(NUMBER(1), list);	/* use up the reserve */
+	}
+	assert(gc_heap_exhausted() == FALSE);
+	limit = gc_heap__ceiling;
+	list = gc_cons(NUMBER(2), list);		/* past the reserve */
+	assert(gc_heap_exhausted() == TRUE);
+	assert(gc_heap__ceiling > limit);
+	limit = gc_heap__limit;
+	gc_full_collection(gc_cons(list, r));
+	assert(gc_heap_exhausted() == TRUE);
+	assert(gc_heap__ceiling == limit);
+	gc_full_collection(r);					/* "list" is garbage now */
+	assert(gc_heap_exhausted() == FALSE);
+	gc_set_heap_limit(0);
+	DBUG_RETURN;
+}
+
+#if GC_PACKED_HEAP
+
+static void
+gc_chunk_check()
+/* check chunk free counts against the allocation bitmaps */
+{
+	GC_CHUNK* c;
+	WORD total = 0;
+	WORD n;
+	WORD w;
+
+	for (c = gc_heap__chunks; c != NULL; c = c->next) {
+		assert(gc_chunk_of(c->base) == c);
+		assert(gc_chunk_of(c->base + (GC_CHUNK_CELLS - 1)) == c);
+		n = 0;
+		for (w = 0; w < GC_CHUNK_WORDS; ++w) {
+			n += gc_count_bits(~c->used[w]);
+		}
+		assert(n == c->free);
+		total += n;
+	}
+	assert(total == gc_free__cnt);
+}
+
+#if GC_COMPRESSED_REFS
+static void
+test_compressed_refs(CONS* r)
+/* values survive encoding as 32-bit references */
+{
+	CONS* p = gc_cons(NUMBER(7), NIL);
+	CONS* v[12];
+	REF w;
+	WORD n;
+	WORD k;
+	int i;
+
+	DBUG_ENTER("test_compressed_refs");
+	assert(sizeof(CONS) == 8);
+	v[0] = NIL;
+	v[1] = BOOLEAN(FALSE);
+	v[2] = BOOLEAN(TRUE);
+	v[3] = NUMBER(0);
+	v[4] = NUMBER(-1);
+	v[5] = MK_NUMBER(GC_REF_FIXNUM - 1);
+	v[6] = MK_NUMBER(-GC_REF_FIXNUM);
+	v[7] = MK_NUMBER(GC_REF_FIXNUM);		/* wide */
+	v[8] = MK_FUNC(test_compressed_refs);	/* wide */
+	v[9] = p;
+	v[10] = MK_ACTOR(p);
+	v[11] = ATOM("compressed");
+	for (i = 0; i < 12; ++i) {
+		assert(gc_decode(gc_encode(v[i])) == v[i]);
+		if (!numberp(v[i])) {	/* weak references hide cell references only */
+			assert(gc_unhide(gc_decode(gc_encode(gc_hide(v[i])))) == v[i]);
+		}
+	}
+	assert((gc_encode(v[5]) & GC_REF_KIND) != GC_REF_WIDE);
+	w = gc_encode(v[8]);
+	assert((w & GC_REF_KIND) == GC_REF_WIDE);
+	assert(gc_encode(MK_FUNC(test_compressed_refs)) == w);	/* interned */
+	gc_set_rest(p, v[8]);
+	gc_full_collection(gc_cons(p, r));
+	assert(gc_rest(p) == v[8]);
+	n = gc_wide__live;
+	for (k = 0; k <= ((2 * gc_wide__swept) + GC_WIDE_BLOCK); ++k) {
+		gc_encode(MK_NUMBER(GC_REF_FIXNUM + 1 + k));	/* wide, never stored */
+	}
+	gc_full_collection(gc_cons(p, r));
+	assert(gc_wide__live <= n);				/* unreferenced values are freed */
+	assert(gc_wide__free != 0);
+	assert(gc_rest(p) == v[8]);
+	k = gc_wide__cnt;
+	w = gc_encode(v[7]);
+	assert(gc_wide__cnt == k);				/* a free entry is reused */
+	assert(gc_decode(w) == v[7]);
+	DBUG_RETURN;
+}
+#endif /* GC_COMPRESSED_REFS */
+
+#if GC_CDR_CODING
+static void
+test_cdr_coding(CONS* r)
+/* coded runs read as plain lists, split when a rest is stored, and survive collection */
+{
+	CONS* v[300];
+	CONS* list;
+	CONS* p;
+	CONS* q;
+	CONS* s;
+	WORD heap;
+	WORD free;
+	WORD i;
+
+	DBUG_ENTER("test_cdr_coding");
+	for (i = 0; i < 300; ++i) {
+		v[i] = NUMBER(i);
+	}
+	gc_full_collection(r);
+	heap = gc_heap__cnt;
+	free = gc_free__cnt;
+	list = gc_list(v, 9, NIL);
+	assert((free - gc_free__cnt) < 9);	/* fewer cells than elements */
+	assert(gc_coded_cell(list));
+	for (i = 0, s = list; !nilp(s); ++i, s = gc_rest(s)) {
+		assert(gc_first(s) == NUMBER(i));
+	}
+	assert(i == 9);
+
+	list = gc_list(v, 300, NIL);		/* several runs */
+	for (i = 0, s = list; i < 5; ++i) {
+		s = gc_rest(s);
+	}
+	p = s;								/* element 5 */
+	for (; i < 150; ++i) {
+		s = gc_rest(s);
+	}
+	q = s;								/* element 150 */
+	gc_set_first(gc_rest(gc_rest(list)), NUMBER(-2));
+	gc_set_rest(p, gc_cons(NUMBER(-1), NIL));	/* splits element 5 off */
+	gc_set_first(p, NUMBER(-5));
+	gc_full_collection(gc_cons(list, gc_cons(q, r)));
+	gc_chunk_check();
+	for (i = 0, s = list; !nilp(s); ++i, s = gc_rest(s)) {
+		assert(gc_first(s) == ((i == 2) ? NUMBER(-2) : ((i == 5) ? NUMBER(-5)
+			: ((i == 6) ? NUMBER(-1) : NUMBER(i)))));
+	}
+	assert(i == 7);
+	for (i = 150, s = q; !nilp(s); ++i, s = gc_rest(s)) {
+		assert(gc_first(s) == NUMBER(i));	/* interior elements keep their run */
+	}
+	assert(i == 300);
+	gc_full_collection(r);
+	assert((gc_free__cnt - free) == (gc_heap__cnt - heap));	/* all garbage now */
+	DBUG_RETURN;
+}
+#endif /* GC_CDR_CODING */
+
+#define	N	GC_CHUNK_CELLS
+
+void
+test_gc()
+/* internal unit test */
+{
+	CONS* r;
+	CONS* s;
+	WORD n;
+
+	DBUG_ENTER("test_gc");
+	TRACE(printf("--test_gc--\n"));
+	assert(sizeof(WORD) == sizeof(CONS*));
+	assert(sizeof(CONS) == (2 * sizeof(REF)));
+	assert((GC_CHUNK_WORDS * GC_WORD_BITS) == GC_CHUNK_CELLS);
+	DBUG_PRINT("", ("gc_phase = 0x%lx", gc_phase__mark));
+	gc_initialize();
+	DBUG_PRINT("", ("gc_phase = 0x%lx", gc_phase__mark));
+	assert(gc_chunk_of(NIL) == NULL);
+	assert(gc_heap__cnt == 0);
+	gc_set_pacing(0, 0, 100);	/* no automatic heap growth */
+
+	s = NIL;
+	s = gc_cons(NUMBER(1), s);
+	s = gc_cons(NUMBER(2), s);
+	s = gc_cons(NUMBER(-2), gc_rest(s));
+	DBUG_PRINT("", ("s@%p = %s", s, cons_to_str(s)));
+	assert(gc_heap__cnt == N);
+	assert(gc_free__cnt == (N - 3));
+	assert(gc_mark__depth == 0);
+	gc_chunk_check();
+
+	gc_age_cells();
+	gc_scan_cell(s);	/* scan "root" */
+	assert(gc_mark__depth == 1);
+
+	r = gc_cons(NUMBER(-1), gc_rest(gc_rest(s)));
+	DBUG_PRINT("", ("r@%p = %s", r, cons_to_str(r)));
+#if GC_SATB_BARRIER
+	assert(gc_mark__depth == 1);	/* plain loads do not scan */
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_mark__depth == 1);
+#else
+	assert(gc_mark__depth == 2);
+#endif
+	assert(gc_free__cnt == (N - 4));
+
+#if !GC_SATB_BARRIER
+	assert(gc_refresh_cell() == TRUE);
+#endif
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == FALSE);
+	gc_free_cells();
+	assert(gc_free__cnt == (N - 3));
+	gc_chunk_check();
+
+	gc_age_cells();
+	gc_scan_cell(r);	/* scan "root" */
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == FALSE);
+	gc_free_cells();
+	assert(gc_free__cnt == (N - 1));
+
+	gc_full_collection(r);	/* all together now... */
+	assert(gc_mark__depth == 0);
+	assert(gc_free__cnt == (N - 1));
+
+	s = gc_cons(NUMBER(3), NIL);
+#if GC_SATB_BARRIER
+	gc_set_rest(r, s);
+	gc_age_cells();			/* "r" and "s" are both aged */
+	gc_scan_cell(r);
+	gc_set_rest(r, NIL);	/* overwriting "s" marks it */
+	assert(gc_mark__depth == 2);
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == FALSE);
+	gc_free_cells();
+	assert(gc_free__cnt == (N - 2));
+	gc_set_rest(r, s);
+#else
+	gc_age_cells();			/* "r" and "s" are both aged */
+	gc_scan_cell(r);
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == FALSE);
+	gc_set_rest(r, s);		/* storing "s" into a scanned cell marks it */
+	assert(gc_mark__depth == 1);
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == FALSE);
+	gc_free_cells();
+	assert(gc_free__cnt == (N - 2));
+#endif
+
+	n = gc_perm__cnt;
+	s = gc_perm(NUMBER(4), NIL);
+	assert(gc_chunk_of(s)->kind == GC_CHUNK_PERM);
+	while (gc_free__cnt > 0) {
+		gc_cons(NIL, NIL);	/* garbage fills the heap */
+	}
+	assert(gc_heap__cnt == N);
+	gc_cons(NIL, NIL);
+	assert(gc_heap__cnt == (2 * N));	/* heap grows only when full */
+	gc_full_collection(r);
+	assert(gc_free__cnt == ((2 * N) - 2));
+	assert(gc_perm__cnt == (n + 1));
+	assert(GC_FIRST(s) == NUMBER(4));
+	gc_chunk_check();
+
+	gc_set_pacing(GC_LOW_WATER, GC_HIGH_WATER, GC_GROWTH_RATIO);
+	assert(gc_collection_due() == FALSE);
+	gc_full_collection(r);
+	assert(gc_free__cnt >= GC_HIGH_WATER);
+#if GC_PARALLEL_MARK
+	test_parallel_mark(r);
+	gc_chunk_check();
+#endif
+	test_heap_growth();
+	test_scan_budget();
+	gc_full_collection(r);
+	gc_chunk_check();
+	test_chunk_release(r);
+	gc_chunk_check();
+	test_gc_stats(r);
+	test_heap_snapshot(r);
+	test_weak_refs(r);
+	test_finalization(r);
+	test_root_sets(r);
+	test_heap_limit(r);
+#if GC_COMPRESSED_REFS
+	test_compressed_refs(r);
+#endif
+#if GC_CDR_CODING
+	test_cdr_coding(r);
+#endif
+	DBUG_RETURN;
+}
+
+void
+report_cell_usage()
+{
+	DBUG_ENTER("report_cell_usage");
+	DBUG_PRINT("gc", ("gc_heap__cnt=%lu", gc_heap__cnt));
+	DBUG_PRINT("gc", ("gc_free__cnt=%lu", gc_free__cnt));
+	DBUG_PRINT("gc", ("gc_perm__cnt=%lu", gc_perm__cnt));
+	DBUG_PRINT("gc", ("gc_mark__depth=%lu", gc_mark__depth));
+	DEBUG(printf("gc_heap__cnt=%lu\n", gc_heap__cnt));
+	DEBUG(printf("gc_free__cnt=%lu\n", gc_free__cnt));
+	DEBUG(printf("gc_perm__cnt=%lu\n", gc_perm__cnt));
+	DEBUG(printf("gc_mark__depth=%lu\n", gc_mark__depth));
+	gc_chunk_check();
+	DBUG_RETURN;
+}
+
+#else /* treadmill */
+
+#define	N	GC_CHUNK_CELLS
+
+static void
+test_perm_cells(CONS* r)
+/* permanent cells are dense pairs, outside the collectable heap */
+{
+	CONS* p;
+	CONS* q;
+	CONS* s;
+	WORD n;
+
+	DBUG_ENTER("test_perm_cells");
+	n = gc_perm__cnt;
+	p = gc_perm(NUMBER(1), NIL);
+	q = gc_perm(NUMBER(2), p);
+	assert(gc_perm__cnt == (n + 2));
+	assert(q == (p + 1));				/* two-word cells, allocated in order */
+	assert(gc_chunk_of(q) == NULL);
+	assert(gc_first(q) == NUMBER(2));
+	assert(gc_rest(q) == p);
+	assert(gc_scan_value(q) == FALSE);	/* never marked */
+	assert(gc_young_value(MK_ACTOR(q)) == FALSE);
+	s = gc_cons(NUMBER(3), NIL);
+	n = GC_SIZE(GC_RSET_LIST);
+	gc_set_rest(p, s);					/* not remembered, see cfg_gather_roots() */
+	assert(GC_SIZE(GC_RSET_LIST) == n);
+	assert(gc_rest(p) == s);
+	gc_set_rest(p, NIL);
+	gc_full_collection(r);
+	assert(gc_first(p) == NUMBER(1));
+	assert(gc_rest(q) == p);
+	DBUG_RETURN;
+}
+
+static void*
+test_buffer_thread(void* arg)
+/* build a list through a thread allocation buffer */
+{
+	CONS* list = NIL;
+	int i;
+
+	gc_attach_thread();
+	for (i = 0; i < 1000; ++i) {
+		list = gc_cons(NUMBER(i), list);
+	}
+	gc_detach_thread();
+	*(CONS**)arg = list;
+	return NULL;
+}
+
+static void
+test_thread_buffers(CONS* r)
+/* buffered cells reach the shared lists at aging, or when the buffer is detached */
+{
+	pthread_t id;
+	CONS* list = NIL;
+	CONS* s;
+	WORD free;
+	WORD fresh;
+	WORD live;
+	int i;
+
+	DBUG_ENTER("test_thread_buffers");
+	gc_full_collection(r);
+	live = gc_heap__cnt - GC_SIZE(GC_FREE_LIST);
+	gc_attach_thread();
+	free = GC_SIZE(GC_FREE_LIST);
+	fresh = GC_SIZE(GC_FRESH_LIST);
+	assert(free > GC_TLAB_CELLS);
+	s = gc_cons(NUMBER(1), NIL);
+	assert(GC_SIZE(GC_FREE_LIST) == (free - GC_TLAB_CELLS));	/* claimed in bulk */
+	assert(GC_SIZE(GC_FRESH_LIST) == fresh);				/* held by the buffer */
+	gc_full_collection(gc_cons(s, r));
+	assert(gc_first(s) == NUMBER(1));
+	assert((gc_heap__cnt - GC_SIZE(GC_FREE_LIST)) == (live + GC_TLAB_CELLS));
+	gc_detach_thread();
+	assert((gc_heap__cnt - GC_SIZE(GC_FREE_LIST)) == (live + 2));
+	gc_full_collection(r);
+	assert((gc_heap__cnt - GC_SIZE(GC_FREE_LIST)) == live);
+
+	i = pthread_create(&id, NULL, test_buffer_thread, &list);
+	assert(i == 0);
+	pthread_join(id, NULL);
+	gc_full_collection(gc_cons(list, r));
+	for (i = 999, s = list; i >= 0; --i, s = gc_rest(s)) {
+		assert(gc_first(s) == NUMBER(i));
+	}
+	assert(nilp(s));
+	gc_sanity_check(GC_FRESH_LIST);
+	gc_sanity_check(GC_FREE_LIST);
+	gc_full_collection(r);
+	assert((gc_heap__cnt - GC_SIZE(GC_FREE_LIST)) == live);
+	DBUG_RETURN;
+}
+
+static void
+test_compaction(CONS* r)
+/* live cells are copied together, a list spine into adjacent cells */
+{
+	CONS* root;
+	CONS* a = NIL;
+	CONS* b = NIL;
+	CONS* w;
+	CELL* p;
+	WORD live;
+	int i;
+
+	DBUG_ENTER("test_compaction");
+	for (i = 0; i < 1000; ++i) {
+		a = gc_cons(NUMBER(i), a);
+		b = gc_cons(NUMBER(i), b);	/* garbage interleaved with "a" */
+	}
+	w = gc_weak(gc_rest(a));
+	root = gc_cons(r, gc_cons(a, gc_cons(w, NIL)));
+	gc_full_collection(root);
+	live = gc_heap__cnt - GC_SIZE(GC_FREE_LIST);
+	gc_compact_collection(root, root);	/* "r", "a" and "root" stay put */
+	assert((gc_heap__cnt - GC_SIZE(GC_FREE_LIST)) == live);
+	assert(GC_FIRST(as_cell(root)) == r);
+	assert(GC_FIRST(as_cell(GC_REST(as_cell(root)))) == a);
+	w = gc_first(gc_rest(gc_rest(root)));
+	assert(gc_weak_get(w) == gc_rest(a));	/* weak targets follow their copies */
+	assert(GC_FIRST(as_cell(a)) == NUMBER(999));
+	p = as_cell(GC_REST(as_cell(a)));
+	for (i = 998; i > 0; --i) {
+		assert(GC_FIRST(p) == NUMBER(i));
+		assert(as_cell(GC_REST(p)) == (p + 1));	/* spine is contiguous */
+		++p;
+	}
+	assert(GC_FIRST(p) == NUMBER(0));
+	assert(nilp(GC_REST(p)));
+	gc_compact_collection(root, root);	/* compacted cells are copied again */
+	assert((gc_heap__cnt - GC_SIZE(GC_FREE_LIST)) == live);
+	assert(GC_FIRST(as_cell(GC_REST(as_cell(a)))) == NUMBER(998));
+	DBUG_RETURN;
 }
 
-#define	N	GC_CELLS_ALLOCATED
-
 void
 test_gc()
 /* internal unit test */
@@ -491,7 +4567,9 @@ test_gc()
 	gc_sanity_check(GC_SCAN_LIST);
 	gc_sanity_check(GC_FRESH_LIST);
 	gc_sanity_check(GC_FREE_LIST);
-	gc_sanity_check(GC_PERM_LIST);
+	gc_sanity_check(GC_OLD_LIST);
+	gc_sanity_check(GC_RSET_LIST);
+	gc_set_pacing(0, 0, 100);	/* no automatic heap growth */
 	
 	gc_allocate_cells(GC_FREE_LIST);
 	DBUG_PRINT("", ("GC_SIZE(GC_FREE_LIST) = %lu", GC_SIZE(GC_FREE_LIST)));
@@ -528,8 +4606,13 @@ test_gc()
 	
 	r = gc_cons(NUMBER(-1), gc_rest(gc_rest(s)));
 	DBUG_PRINT("", ("r@%p = %s", r, cons_to_str(r)));
+#if GC_SATB_BARRIER
+	assert(GC_SIZE(GC_AGED_LIST) == 2);	/* plain loads do not scan */
+	assert(GC_SIZE(GC_SCAN_LIST) == 1);
+#else
 	assert(GC_SIZE(GC_AGED_LIST) == 1);
 	assert(GC_SIZE(GC_SCAN_LIST) == 2);
+#endif
 	assert(GC_SIZE(GC_FRESH_LIST) == 1);
 	assert(GC_SIZE(GC_FREE_LIST) == (N - 4));
 	
@@ -590,14 +4673,107 @@ test_gc()
 	gc_full_collection(r);	/* all together now... */
 	assert(GC_SIZE(GC_AGED_LIST) == 0);
 	assert(GC_SIZE(GC_SCAN_LIST) == 0);
+	assert(GC_SIZE(GC_FRESH_LIST) == 0);
+	assert(GC_SIZE(GC_OLD_LIST) == 1);	/* "r" survived twice, so it was promoted */
+	assert(GC_SIZE(GC_FREE_LIST) == (N - 1));
+
+	s = gc_cons(NUMBER(5), NIL);
+	gc_set_rest(r, s);		/* old-to-young reference */
+	assert(GC_SIZE(GC_FRESH_LIST) == 1);
+	assert(GC_SIZE(GC_OLD_LIST) == 0);
+	assert(GC_SIZE(GC_RSET_LIST) == 1);
+	assert(GC_SIZE(GC_FREE_LIST) == (N - 2));
+
+	gc_age_cells();			/* minor cycle, "s" is reached from the remembered set */
+	assert(GC_SIZE(GC_AGED_LIST) == 0);
+	assert(GC_SIZE(GC_SCAN_LIST) == 1);
+	assert(GC_SIZE(GC_FRESH_LIST) == 0);
+	assert(GC_SIZE(GC_RSET_LIST) == 1);
+
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == FALSE);
+	gc_free_cells();
 	assert(GC_SIZE(GC_FRESH_LIST) == 1);
+	assert(GC_SIZE(GC_OLD_LIST) == 0);
+	assert(GC_SIZE(GC_RSET_LIST) == 1);	/* "s" is still young */
+	assert(GC_SIZE(GC_FREE_LIST) == (N - 2));
+
+	gc_age_cells();			/* "s" survives again, and is promoted */
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == FALSE);
+	gc_free_cells();
+	assert(GC_SIZE(GC_AGED_LIST) == 0);
+	assert(GC_SIZE(GC_SCAN_LIST) == 0);
+	assert(GC_SIZE(GC_FRESH_LIST) == 0);
+	assert(GC_SIZE(GC_OLD_LIST) == 2);
+	assert(GC_SIZE(GC_RSET_LIST) == 0);
+	assert(GC_SIZE(GC_FREE_LIST) == (N - 2));
+
+	gc_set_rest(r, NIL);	/* "s" is garbage, but old */
+	gc_age_cells();			/* minor cycle does not reclaim old cells */
+	assert(GC_SIZE(GC_AGED_LIST) == 0);
+	assert(gc_refresh_cell() == FALSE);
+	gc_free_cells();
+	assert(GC_SIZE(GC_OLD_LIST) == 2);
+	assert(GC_SIZE(GC_FREE_LIST) == (N - 2));
+
+	gc_full_collection(r);	/* major cycle reclaims old garbage */
+	assert(GC_SIZE(GC_AGED_LIST) == 0);
+	assert(GC_SIZE(GC_SCAN_LIST) == 0);
+	assert(GC_SIZE(GC_FRESH_LIST) == 0);
+	assert(GC_SIZE(GC_OLD_LIST) == 1);
+	assert(GC_SIZE(GC_RSET_LIST) == 0);
 	assert(GC_SIZE(GC_FREE_LIST) == (N - 1));
 
+#if GC_SATB_BARRIER
+	s = gc_cons(NUMBER(6), NIL);
+	gc_set_rest(r, s);
+	gc_major__cycle = TRUE;
+	gc_age_cells();			/* "r" and "s" are both aged */
+	gc_scan_cell(as_cell(r));
+	gc_set_rest(r, NIL);	/* overwriting "s" marks it */
+	assert(GC_SIZE(GC_AGED_LIST) == 0);
+	assert(GC_SIZE(GC_SCAN_LIST) == 2);
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == TRUE);
+	assert(gc_refresh_cell() == FALSE);
+	gc_free_cells();		/* "s" was reachable in the snapshot, so it survives */
+	assert(GC_SIZE(GC_FREE_LIST) == (N - 2));
+#endif
+
+	gc_set_pacing(2 * N, 4 * N, GC_GROWTH_RATIO);	/* watermarks above one chunk */
+	assert(gc_collection_due() == TRUE);
+	gc_full_collection(r);	/* heap grows to the high watermark */
+	assert(GC_SIZE(GC_FREE_LIST) >= (4 * N));
+	assert(gc_heap__cnt == (GC_SIZE(GC_FREE_LIST) + 1));
+	assert(gc_collection_due() == FALSE);
+	gc_set_pacing(GC_LOW_WATER, GC_HIGH_WATER, GC_GROWTH_RATIO);
+#if GC_PARALLEL_MARK
+	test_parallel_mark(r);
+#endif
+#if GC_COLLECTOR_THREAD
+	test_collector_thread(r);
+#endif
+	test_heap_growth();
+	test_scan_budget();
+	gc_full_collection(r);
+	test_chunk_release(r);
+	test_perm_cells(r);
+	test_thread_buffers(r);
+	test_compaction(r);
+	test_gc_stats(r);
+	test_heap_snapshot(r);
+	test_weak_refs(r);
+	test_finalization(r);
+	test_root_sets(r);
+	test_heap_limit(r);
+
 	gc_sanity_check(GC_AGED_LIST);
 	gc_sanity_check(GC_SCAN_LIST);
 	gc_sanity_check(GC_FRESH_LIST);
 	gc_sanity_check(GC_FREE_LIST);
-	gc_sanity_check(GC_PERM_LIST);
+	gc_sanity_check(GC_OLD_LIST);
+	gc_sanity_check(GC_RSET_LIST);
 	DBUG_RETURN;
 }
 
@@ -609,16 +4785,23 @@ report_cell_usage()
 	DBUG_PRINT("gc", ("GC_SIZE(GC_SCAN_LIST)=%lu", GC_SIZE(GC_SCAN_LIST)));
 	DBUG_PRINT("gc", ("GC_SIZE(GC_FRESH_LIST)=%lu", GC_SIZE(GC_FRESH_LIST)));
 	DBUG_PRINT("gc", ("GC_SIZE(GC_FREE_LIST)=%lu", GC_SIZE(GC_FREE_LIST)));
-	DBUG_PRINT("gc", ("GC_SIZE(GC_PERM_LIST)=%lu", GC_SIZE(GC_PERM_LIST)));
+	DBUG_PRINT("gc", ("gc_perm__cnt=%lu", gc_perm__cnt));
+	DBUG_PRINT("gc", ("GC_SIZE(GC_OLD_LIST)=%lu", GC_SIZE(GC_OLD_LIST)));
+	DBUG_PRINT("gc", ("GC_SIZE(GC_RSET_LIST)=%lu", GC_SIZE(GC_RSET_LIST)));
 	DEBUG(printf("GC_SIZE(GC_AGED_LIST)=%lu\n", GC_SIZE(GC_AGED_LIST)));
 	DEBUG(printf("GC_SIZE(GC_SCAN_LIST)=%lu\n", GC_SIZE(GC_SCAN_LIST)));
 	DEBUG(printf("GC_SIZE(GC_FRESH_LIST)=%lu\n", GC_SIZE(GC_FRESH_LIST)));
 	DEBUG(printf("GC_SIZE(GC_FREE_LIST)=%lu\n", GC_SIZE(GC_FREE_LIST)));
-	DEBUG(printf("GC_SIZE(GC_PERM_LIST)=%lu\n", GC_SIZE(GC_PERM_LIST)));
+	DEBUG(printf("gc_perm__cnt=%lu\n", gc_perm__cnt));
+	DEBUG(printf("GC_SIZE(GC_OLD_LIST)=%lu\n", GC_SIZE(GC_OLD_LIST)));
+	DEBUG(printf("GC_SIZE(GC_RSET_LIST)=%lu\n", GC_SIZE(GC_RSET_LIST)));
 	gc_sanity_check(GC_AGED_LIST);
 	gc_sanity_check(GC_SCAN_LIST);
 	gc_sanity_check(GC_FRESH_LIST);
 	gc_sanity_check(GC_FREE_LIST);
+	gc_sanity_check(GC_OLD_LIST);
+	gc_sanity_check(GC_RSET_LIST);
 	DBUG_RETURN;
 }
 
+#endif /* GC_PACKED_HEAP */
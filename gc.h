@@ -6,8 +6,31 @@
 #ifndef GC_H
 #define GC_H
 
+#include <stdio.h>
 #include "types.h"
 
+#ifndef GC_PACKED_HEAP
+#define	GC_PACKED_HEAP	0	/* 1 = two-word cells, marks in per-chunk bitmaps */
+#endif
+#ifndef GC_SATB_BARRIER
+#define	GC_SATB_BARRIER	0	/* 1 = snapshot (deletion) barrier, plain car/cdr */
+#endif
+#ifndef GC_COLLECTOR_THREAD
+#define	GC_COLLECTOR_THREAD 0	/* 1 = concurrent cycles scan on a background thread */
+#endif
+#ifndef GC_PARALLEL_MARK
+#define	GC_PARALLEL_MARK 0	/* 1 = full collections mark with several threads */
+#endif
+#ifndef GC_CDR_CODING
+#define	GC_CDR_CODING	0	/* 1 = gc_list() stores runs of elements without rest pointers */
+#endif
+#if GC_COMPRESSED_REFS && !GC_PACKED_HEAP
+#error "GC_COMPRESSED_REFS requires GC_PACKED_HEAP"
+#endif
+#if GC_CDR_CODING && (!GC_PACKED_HEAP || GC_COMPRESSED_REFS)
+#error "GC_CDR_CODING requires GC_PACKED_HEAP, with full-width cells"
+#endif
+
 #define GC_PHASE_INIT	as_word(-1)		/* 2#1111...1111 */
 #define	GC_PHASE_Z		as_word(0)		/* 2#0000...0000 */
 #define	GC_PHASE_X		as_word(1)		/* 2#0000...0001 */
@@ -15,35 +38,107 @@
 #define	GC_PHASE_1		as_word(3)		/* 2#0000...0011 */
 #define	GC_PHASE_MASK	as_word(3)		/* 2#0000...0011 */
 
+#define	GC_FLAG_AGE		as_word(1)		/* survived a collection while young */
+#define	GC_FLAG_OLD		as_word(2)		/* promoted to the old generation */
+#define	GC_FLAG_RSET	as_word(4)		/* member of the remembered set */
+#define	GC_FLAG_MASK	as_word(7)		/* 2#0000...0111 */
+
+#define	GC_LOW_WATER	as_word(1 << 10)	/* default free cells that trigger a collection */
+#define	GC_HIGH_WATER	as_word(1 << 12)	/* default least free cells after heap growth */
+#define	GC_GROWTH_RATIO	as_word(200)		/* default heap target, percent of live cells */
+#define	GC_HEAP_GROWTH	as_word(50)		/* default heap added when cells run out, percent of heap */
+#define	GC_RETAIN_CELLS	as_word(1 << 16)	/* default free cells never returned to the OS */
+#define	GC_LIMIT_RESERVE as_word(10)		/* cells past the heap limit in an emergency, percent of limit */
+#define	GC_SCAN_BATCH	as_word(1 << 10)	/* default cells scanned per scanning message */
+#define	GC_SCAN_BUDGET	as_word(500)		/* default usecs spent per scanning message */
+
+#define	GC_PAUSE_BUCKETS	20				/* pause histogram buckets, powers of 2 usecs */
+
+typedef struct gc_stats GC_STATS;
+struct gc_stats {
+	WORD	cycles_started;		/* collection cycles started (concurrent or full) */
+	WORD	cycles_completed;	/* collection cycles finished */
+	WORD	major_cycles;		/* cycles that also collected old cells */
+	WORD	full_collections;	/* calls to gc_full_collection() */
+	WORD	cells_allocated;	/* collectable cells allocated */
+	WORD	cells_scanned;		/* cells found live and scanned */
+	WORD	cells_freed;		/* cells reclaimed */
+	WORD	cells_promoted;		/* cells promoted to the old generation */
+	WORD	weak_cleared;		/* weak references cleared */
+	WORD	cells_finalized;	/* registered cells queued for finalization */
+	WORD	heap_cells;			/* collectable cells in the heap now */
+	WORD	free_cells;			/* free collectable cells now */
+	WORD	alloc_rate;			/* cells allocated per second, over the last cycle */
+	WORD	start_us;			/* usecs aging cells and scanning roots */
+	WORD	mark_us;			/* usecs scanning, in pauses */
+	WORD	sweep_us;			/* usecs freeing cells and pacing the heap */
+	WORD	compact_us;			/* usecs copying cells, see gc_compact_collection() */
+	WORD	pause_cnt;			/* number of pauses */
+	WORD	pause_us;			/* total usecs paused */
+	WORD	pause_max_us;		/* longest pause */
+	WORD	pause_hist[GC_PAUSE_BUCKETS];	/* pauses under 2^(i+1) usecs, the last is open */
+};
+
+typedef void (*GC_VISIT)(CONS* value);				/* applied to each root value */
+typedef void (*GC_ROOTS)(void* ctx, GC_VISIT visit);	/* visit each root held by <ctx> */
+
+#define	GC_SNAP_MAGIC	"ABEHEAP1"		/* first 8 bytes of a heap snapshot */
+#define	GC_SNAP_PERM	as_word(1)		/* record flag, permanent cell */
+#define	GC_SNAP_OLD		as_word(2)		/* record flag, old generation cell */
+#define	GC_SNAP_FLAGS	as_word(3)		/* record flags, in the low bits of the address */
+
+/*
+ * A heap snapshot (see gc_write_snapshot()) is a sequence of native WORDs:
+ *	header:		magic (8 bytes), sizeof(WORD), sizeof(collectable cell), NIL, root,
+ *				address of gc_write_snapshot() (to relocate function values)
+ *	records:	cell address | flags, first, rest (one per allocated cell)
+ *	trailer:	0, number of records, 0
+ */
+#define	GC_SNAP_HEADER	5				/* header WORDs after the magic */
+
 #define	as_indx(p)		(as_word(p) & ~GC_PHASE_MASK)
 #define	as_addr(p)		as_cell(as_indx(p))
 
 #define	GC_SIZE(p)		as_word((p)->first)
-#define	GC_SET_SIZE(p,n) ((p)->first = as_cons(n))
+#define	GC_SET_SIZE(p,n) ((p)->first = as_ref(n))
 #define	GC_MARK(p)		((p)->_prev & GC_PHASE_MASK)
 #define	GC_SET_MARK(p,m) ((p)->_prev = (((p)->_prev & ~GC_PHASE_MASK) | (m)))
 
+#if GC_COMPRESSED_REFS
+#define	GC_NIL_REF		as_ref(0)		/* NIL, encoded */
+#define	GC_FIRST(p)		gc_decode((p)->first)
+#define	GC_SET_FIRST(p,q) ((p)->first = gc_encode(q))
+#define	GC_REST(p)		gc_decode((p)->rest)
+#define	GC_SET_REST(p,q) ((p)->rest = gc_encode(q))
+#else
+#define	GC_NIL_REF		NIL
 #define	GC_FIRST(p)		((p)->first)
 #define	GC_SET_FIRST(p,q) ((p)->first = (q))
 #define	GC_REST(p)		((p)->rest)
 #define	GC_SET_REST(p,q) ((p)->rest = (q))
+#endif
+
+#define	GC_FLAGS(p)		((p)->_next & GC_FLAG_MASK)
+#define	GC_SET_FLAGS(p,f) ((p)->_next = (((p)->_next & ~GC_FLAG_MASK) | (f)))
 
 #define	GC_PREV(p)		as_addr((p)->_prev)
 #define	GC_SET_PREV(p,q) ((p)->_prev = as_indx(q) | GC_MARK(p))
-#define	GC_NEXT(p)		as_addr((p)->_next)
-#define	GC_SET_NEXT(p,q) ((p)->_next = as_indx(q))
+#define	GC_NEXT(p)		as_cell((p)->_next & ~GC_FLAG_MASK)
+#define	GC_SET_NEXT(p,q) ((p)->_next = (as_word(q) & ~GC_FLAG_MASK) | GC_FLAGS(p))
 
 extern CELL		gc_aged__cell;		/* list head for aged (possibly allocated) cells */
 extern CELL		gc_scan__cell;		/* list head for cells to be scanned */
 extern CELL		gc_fresh__cell;		/* list head for fresh (recently allocated) cells */
 extern CELL		gc_free__cell;		/* list head for free (unallocated) cells */
-extern CELL		gc_perm__cell;		/* list head for permanently allocated cells */
+extern CELL		gc_old__cell;		/* list head for old (tenured) cells */
+extern CELL		gc_rset__cell;		/* list head for old cells that may refer to young cells */
 
 #define	GC_AGED_LIST	(&gc_aged__cell)
 #define	GC_SCAN_LIST	(&gc_scan__cell)
 #define	GC_FRESH_LIST	(&gc_fresh__cell)
 #define	GC_FREE_LIST	(&gc_free__cell)
-#define	GC_PERM_LIST	(&gc_perm__cell)
+#define	GC_OLD_LIST		(&gc_old__cell)
+#define	GC_RSET_LIST	(&gc_rset__cell)
 
 void	gc_insert_before(CELL* p, CELL* item);	/* insert <item> before <p> in list */
 void	gc_insert_after(CELL* p, CELL* item);	/* insert <item> after <p> in list */
@@ -58,15 +153,52 @@ void	gc_append_list(CELL* to, CELL* from);	/* append <from> at the end of <to> *
 WORD	gc_count(CELL* list);					/* count items in <list> */
 void	gc_sanity_check(CELL* list);			/* check <list> for internal consistency */
 
+#if GC_COMPRESSED_REFS
+REF		gc_encode(CONS* value);					/* 32-bit reference to <value> */
+CONS*	gc_decode(REF ref);						/* value of a 32-bit reference */
+#endif
 CONS*	gc_perm(CONS* first, CONS* rest);		/* allocate and initialize a permanent cell */
 CONS*	gc_cons(CONS* first, CONS* rest);		/* allocate and initialize a new "cons" cell */
+CONS*	gc_list(CONS** values, WORD n, CONS* tail);	/* allocate a list of <n> values ending in <tail> */
+#if !GC_PACKED_HEAP
+void	gc_attach_thread();						/* give the calling thread its own allocation buffer */
+void	gc_detach_thread();						/* hand the calling thread's buffer back */
+#endif
+CONS*	gc_weak(CONS* target);					/* allocate a weak reference to <target> */
+CONS*	gc_weak_get(CONS* weak);				/* target of <weak>, NIL once collected */
+BOOL	gc_weak_cleared(CONS* weak);			/* TRUE if the target of <weak> was collected */
+CONS*	gc_weak_map_get(CONS* map, CONS* key, CONS* def);	/* lookup in a weak-keyed map */
+CONS*	gc_weak_map_put(CONS* map, CONS* key, CONS* value);	/* extend a weak-keyed map */
+void	gc_finalize(CONS* cell, CONS* beh, CONS* state);	/* queue <beh> and <state> once <cell> is unreachable */
+BOOL	gc_finalization_pending();				/* TRUE if a finalizer is queued */
+BOOL	gc_next_finalizer(CONS** beh, CONS** state);	/* dequeue a finalizer, FALSE if none */
 CONS*	gc_first(CONS* cell);					/* retrieve the first of the list */
 CONS*	gc_rest(CONS* cell);					/* retrieve the rest of the list */
 void	gc_set_first(CONS* cell, CONS* first);	/* overwrite the first of the list */
 void	gc_set_rest(CONS* cell, CONS* rest);	/* overwrite the rest of the list */
 
+void	gc_add_roots(GC_ROOTS roots, void* ctx);	/* register roots held outside the heap */
 void	gc_full_collection(CONS* root);			/* perform a full garbage collection (NOT CONCURRENT!) */
+void	gc_compact_collection(CONS* root, CONS* pinned); /* full collection, then copy live cells together */
 void	gc_actor_collection(CONFIG* cfg, CONS* root); /* initiate actor-based (CONCURRENT) collection */
+void	gc_request_collection();				/* ask for a full collection at the next message boundary */
+BOOL	gc_collection_requested();				/* TRUE if a full collection has been asked for */
+void	gc_request_snapshot();					/* ask for a heap snapshot (safe in a signal handler) */
+BOOL	gc_snapshot_requested();				/* TRUE if a heap snapshot has been asked for */
+BOOL	gc_write_snapshot(FILE* f, CONS* root);	/* write every allocated cell to <f> */
+void	gc_get_stats(GC_STATS* stats);			/* copy collector statistics */
+void	gc_dump_stats(FILE* f);					/* write collector statistics as JSON */
+void	gc_set_major_threshold(WORD n);			/* old cells that trigger a full (major) collection */
+void	gc_set_pacing(WORD low_water, WORD high_water, WORD growth_ratio); /* automatic collection policy */
+BOOL	gc_collection_due();					/* TRUE if a concurrent collection should start */
+BOOL	gc_cycle_active();						/* TRUE while a concurrent collection is in progress */
+void	gc_set_scan_budget(WORD batch, WORD usecs); /* incremental scanning work per message */
+void	gc_set_heap_growth(WORD percent);		/* heap added when cells run out, percent of heap */
+void	gc_presize_heap(WORD n);				/* grow the heap until <n> cells are free */
+void	gc_set_retention(WORD n);				/* free cells never returned to the OS */
+void	gc_set_heap_limit(WORD n);				/* most collectable cells (0 = no limit) */
+BOOL	gc_heap_exhausted();					/* TRUE if live cells do not fit under the limit */
+void	gc_set_mark_threads(int n);				/* threads marking in a full collection (0 = #cpus) */
 void	test_gc();								/* internal unit test */
 void	report_cell_usage();					/* display cell usage statistics */
 
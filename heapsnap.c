@@ -0,0 +1,611 @@
+/*
+ * heapsnap.c -- offline analyzer for ABE heap snapshots
+ *
+ * Reads a snapshot written by gc_write_snapshot(), finds the cells
+ * reachable from the root and the permanent cells, builds the dominator
+ * tree (Cooper, Harvey & Kennedy, "A Simple, Fast Dominance Algorithm")
+ * and reports retained sizes, per-behavior counts and the largest
+ * subtrees. Behavior functions are named from the symbol table of the
+ * executable that wrote the snapshot (using "nm").
+ *
+ * Copyright 2009-2017 Dale Schumacher.  ALL RIGHTS RESERVED.
+ */
+#define	_GNU_SOURCE		/* for popen(), pclose() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "gc.h"
+
+#define	TAG_MASK	as_word(3)		/* see BM_TYPE in cons.h */
+#define	TAG_CONS	as_word(0)
+#define	TAG_ACTOR	as_word(1)
+#define	TAG_ATOM	as_word(2)
+#define	TAG_FUNC	as_word(3)
+
+#define	TYPE_CONS	0
+#define	TYPE_ACTOR	1
+#define	TYPE_ATOM	2
+#define	N_TYPES		3
+
+static char* type_name[N_TYPES] = { "cons", "actor", "atom" };
+
+typedef struct node NODE;
+struct node {			/* node 0 is the super-root, cells are 1..n */
+	WORD	addr;		/* cell address (flags removed) */
+	WORD	flags;		/* GC_SNAP_PERM, GC_SNAP_OLD */
+	WORD	first;		/* raw first value */
+	WORD	rest;		/* raw rest value */
+	long	succ[2];	/* nodes referenced by first and rest (0 = none) */
+	int		type;		/* TYPE_CONS, TYPE_ACTOR or TYPE_ATOM */
+	long	po;			/* postorder number (-1 = unreachable) */
+	long	idom;		/* immediate dominator (-1 = unreachable) */
+	long	size;		/* retained cells */
+};
+
+typedef struct sym SYM;
+struct sym {
+	WORD	addr;		/* relocated address */
+	char*	name;
+};
+
+typedef struct beh_stat BEH_STAT;
+struct beh_stat {
+	WORD	beh;		/* behavior function address */
+	long	count;		/* actors with this behavior */
+	long	size;		/* cells retained by those actors */
+};
+
+static NODE*	node = NULL;
+static long		n_node = 0;			/* including the super-root */
+static long*	perm = NULL;		/* permanent cells, successors of the super-root */
+static long		n_perm = 0;
+static long		root_node = 0;		/* node of the snapshot root (0 = none) */
+static WORD		cell_size = 0;		/* bytes per collectable cell */
+static WORD		perm_size = 0;		/* bytes per permanent cell */
+static WORD		anchor = 0;			/* runtime address of gc_write_snapshot() */
+static SYM*		sym = NULL;
+static long		n_sym = 0;
+static long*	kids = NULL;		/* dominator tree children, by parent */
+static long*	kid_base = NULL;
+
+static void
+fail(char* msg, char* arg)
+{
+	fprintf(stderr, "heapsnap: %s %s\n", msg, (arg ? arg : ""));
+	exit(EXIT_FAILURE);
+}
+
+static void*
+alloc(size_t n, size_t size)
+{
+	void* p = calloc((n > 0) ? n : 1, size);
+
+	if (p == NULL) {
+		fail("out of memory", NULL);
+	}
+	return p;
+}
+
+static int
+cmp_addr(const void* a, const void* b)
+{
+	WORD x = ((NODE*)a)->addr;
+	WORD y = ((NODE*)b)->addr;
+
+	return ((x < y) ? -1 : ((x > y) ? 1 : 0));
+}
+
+static long
+find_node(WORD v)
+/* return the node for cell reference <v>, or 0 if it is not a cell */
+{
+	WORD a = v & ~TAG_MASK;
+	long lo = 1;
+	long hi = n_node - 1;
+	long mid;
+
+	if ((v & TAG_MASK) == TAG_FUNC) {
+		return 0;				/* number or function */
+	}
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (node[mid].addr == a) {
+			return mid;
+		} else if (node[mid].addr < a) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return 0;
+}
+
+static void
+read_snapshot(char* path)
+/* load the cell records of the snapshot in <path> */
+{
+	FILE* f;
+	char magic[8];
+	WORD hdr[GC_SNAP_HEADER];
+	WORD w[3];
+	WORD root;
+	long cap = 1 << 16;
+	long i;
+	int j;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		fail("unable to open", path);
+	}
+	if ((fread(magic, 1, 8, f) != 8) || (memcmp(magic, GC_SNAP_MAGIC, 8) != 0)) {
+		fail("not a heap snapshot:", path);
+	}
+	if ((fread(hdr, sizeof(WORD), GC_SNAP_HEADER, f) != GC_SNAP_HEADER)
+	|| (hdr[0] != as_word(sizeof(WORD)))) {
+		fail("unsupported word size in", path);
+	}
+	cell_size = hdr[1];
+	perm_size = as_word(2 * sizeof(WORD));	/* a CONS, in the treadmill layout */
+	if (cell_size < perm_size) {
+		perm_size = cell_size;		/* every cell is a compressed CONS */
+	}
+	root = hdr[3];
+	anchor = hdr[4];
+	node = (NODE*)alloc(cap, sizeof(NODE));
+	n_node = 1;
+	for (;;) {
+		if (fread(w, sizeof(WORD), 3, f) != 3) {
+			fail("truncated snapshot", path);
+		}
+		if (w[0] == 0) {
+			break;				/* trailer */
+		}
+		if (n_node == cap) {
+			cap <<= 1;
+			node = (NODE*)realloc(node, cap * sizeof(NODE));
+			if (node == NULL) {
+				fail("out of memory", NULL);
+			}
+		}
+		memset(&node[n_node], 0, sizeof(NODE));
+		node[n_node].addr = w[0] & ~GC_SNAP_FLAGS;
+		node[n_node].flags = w[0] & GC_SNAP_FLAGS;
+		node[n_node].first = w[1];
+		node[n_node].rest = w[2];
+		++n_node;
+	}
+	fclose(f);
+	if (w[1] != (n_node - 1)) {
+		fail("record count mismatch in", path);
+	}
+	qsort(&node[1], n_node - 1, sizeof(NODE), cmp_addr);
+	perm = (long*)alloc(n_node, sizeof(long));
+	for (i = 1; i < n_node; ++i) {
+		node[i].succ[0] = find_node(node[i].first);
+		node[i].succ[1] = find_node(node[i].rest);
+		if (node[i].flags & GC_SNAP_PERM) {
+			perm[n_perm++] = i;
+		}
+	}
+	for (i = 1; i < n_node; ++i) {		/* a cell's type is how it is referenced */
+		for (j = 0; j < 2; ++j) {
+			WORD v = (j ? node[i].rest : node[i].first);
+			long k = node[i].succ[j];
+
+			if ((k != 0) && ((v & TAG_MASK) != TAG_CONS)) {
+				node[k].type = (int)(v & TAG_MASK);
+			}
+		}
+	}
+	root_node = find_node(root);
+	if ((root_node != 0) && ((root & TAG_MASK) != TAG_CONS)) {
+		node[root_node].type = (int)(root & TAG_MASK);
+	}
+}
+
+static long
+successor(long v, long k)
+/* return the <k>th successor of node <v>, 0 for none, -1 past the last */
+{
+	if (v == 0) {
+		if (k == 0) {
+			return root_node;
+		}
+		return ((k <= n_perm) ? perm[k - 1] : -1);
+	}
+	return ((k < 2) ? node[v].succ[k] : -1);
+}
+
+static long*
+postorder()
+/* number the reachable nodes in depth-first postorder, return them in that order (-1 ends) */
+{
+	long* order = (long*)alloc(n_node + 1, sizeof(long));
+	long* stack = (long*)alloc(n_node, sizeof(long));
+	long* edge = (long*)alloc(n_node, sizeof(long));
+	long sp = 0;
+	long n = 0;
+	long v;
+	long w;
+	long i;
+
+	for (i = 0; i < n_node; ++i) {
+		node[i].po = -1;
+		node[i].idom = -1;
+	}
+	node[0].po = -2;			/* on the stack */
+	stack[sp++] = 0;
+	while (sp > 0) {
+		v = stack[sp - 1];
+		w = successor(v, edge[v]++);
+		if (w < 0) {
+			--sp;
+			node[v].po = n;
+			order[n++] = v;
+		} else if ((w > 0) && (node[w].po == -1)) {
+			node[w].po = -2;
+			stack[sp++] = w;
+		}
+	}
+	free(edge);
+	free(stack);
+	order[n] = -1;
+	return order;
+}
+
+static long
+intersect(long a, long b)
+{
+	while (a != b) {
+		while (node[a].po < node[b].po) {
+			a = node[a].idom;
+		}
+		while (node[b].po < node[a].po) {
+			b = node[b].idom;
+		}
+	}
+	return a;
+}
+
+static long*
+compress_rows(long* row, long n)
+/* turn <n> row lengths, stored at row[1..n], into row starts, return fill positions */
+{
+	long* fill = (long*)alloc(n + 1, sizeof(long));
+	long i;
+
+	for (i = 0; i < n; ++i) {
+		row[i + 1] += row[i];
+	}
+	memcpy(fill, row, (n + 1) * sizeof(long));
+	return fill;
+}
+
+static long
+dominators(long* order)
+/* compute immediate dominators and retained sizes, return the reachable cell count */
+{
+	long* pred_base = (long*)alloc(n_node + 1, sizeof(long));
+	long* pred;
+	long* fill;
+	long n;
+	long i;
+	long k;
+	long v;
+	long w;
+	long d;
+	int changed;
+
+	for (n = 0; order[n] >= 0; ++n)
+		;
+	for (i = 0; i < n; ++i) {		/* predecessors, in compressed rows */
+		for (k = 0; (w = successor(order[i], k)) >= 0; ++k) {
+			if (w > 0) {
+				++pred_base[w + 1];
+			}
+		}
+	}
+	fill = compress_rows(pred_base, n_node);
+	pred = (long*)alloc(pred_base[n_node], sizeof(long));
+	for (i = 0; i < n; ++i) {
+		v = order[i];
+		for (k = 0; (w = successor(v, k)) >= 0; ++k) {
+			if (w > 0) {
+				pred[fill[w]++] = v;
+			}
+		}
+	}
+	free(fill);
+	node[0].idom = 0;
+	do {
+		changed = 0;
+		for (i = n - 2; i >= 0; --i) {	/* reverse postorder, after the super-root */
+			v = order[i];
+			d = -1;
+			for (k = pred_base[v]; k < pred_base[v + 1]; ++k) {
+				w = pred[k];
+				if (node[w].idom >= 0) {
+					d = ((d < 0) ? w : intersect(w, d));
+				}
+			}
+			if (node[v].idom != d) {
+				node[v].idom = d;
+				changed = 1;
+			}
+		}
+	} while (changed);
+	free(pred);
+	free(pred_base);
+	for (i = 0; i < (n - 1); ++i) {	/* children before their dominators */
+		v = order[i];
+		node[v].size += 1;
+		node[node[v].idom].size += node[v].size;
+	}
+	return n - 1;
+}
+
+static int
+cmp_sym(const void* a, const void* b)
+{
+	WORD x = ((SYM*)a)->addr;
+	WORD y = ((SYM*)b)->addr;
+
+	return ((x < y) ? -1 : ((x > y) ? 1 : 0));
+}
+
+static void
+read_symbols(char* exe)
+/* load function symbols from <exe>, relocated to match the snapshot */
+{
+	char cmd[1024];
+	char line[1024];
+	char name[1024];
+	unsigned long addr;
+	char type;
+	WORD slide = 0;
+	long cap = 1024;
+	long i;
+	FILE* p;
+
+	if (strlen(exe) > (sizeof(cmd) - 32)) {
+		fail("executable path too long:", exe);
+	}
+	sprintf(cmd, "nm \"%s\" 2>/dev/null", exe);
+	if ((p = popen(cmd, "r")) == NULL) {
+		fail("unable to run", cmd);
+	}
+	sym = (SYM*)alloc(cap, sizeof(SYM));
+	while (fgets(line, sizeof(line), p) != NULL) {
+		if ((sscanf(line, "%lx %c %1023s", &addr, &type, name) != 3)
+		|| ((type != 'T') && (type != 't'))) {
+			continue;
+		}
+		if (strcmp(name, "gc_write_snapshot") == 0) {
+			slide = anchor - as_word(addr);
+		}
+		if (n_sym == cap) {
+			cap <<= 1;
+			sym = (SYM*)realloc(sym, cap * sizeof(SYM));
+			if (sym == NULL) {
+				fail("out of memory", NULL);
+			}
+		}
+		sym[n_sym].addr = as_word(addr);
+		sym[n_sym].name = strcpy((char*)alloc(strlen(name) + 1, 1), name);
+		++n_sym;
+	}
+	pclose(p);
+	for (i = 0; i < n_sym; ++i) {
+		sym[i].addr += slide;
+	}
+	qsort(sym, n_sym, sizeof(SYM), cmp_sym);
+}
+
+static char*
+beh_name(WORD beh)
+/* return the name of behavior function <beh> */
+{
+	static char buf[64];
+	long lo = 0;
+	long hi = n_sym - 1;
+	long mid;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sym[mid].addr == beh) {
+			return sym[mid].name;
+		} else if (sym[mid].addr < beh) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	sprintf(buf, "%#lx", (unsigned long)beh);
+	return buf;
+}
+
+static WORD
+beh_of(long v)
+/* return the behavior function of actor node <v> (0 if it has none) */
+{
+	WORD f = node[v].first;
+
+	if ((node[v].type != TYPE_ACTOR) || ((f & TAG_MASK) != TAG_FUNC)) {
+		return 0;
+	}
+	return as_word((unsigned long)f >> 2);	/* see MK_FUNC() in cons.h */
+}
+
+static int
+cmp_beh(const void* a, const void* b)
+{
+	WORD x = ((BEH_STAT*)a)->beh;
+	WORD y = ((BEH_STAT*)b)->beh;
+
+	return ((x < y) ? -1 : ((x > y) ? 1 : 0));
+}
+
+static int
+cmp_beh_size(const void* a, const void* b)
+{
+	long x = ((BEH_STAT*)a)->size;
+	long y = ((BEH_STAT*)b)->size;
+
+	return ((x > y) ? -1 : ((x < y) ? 1 : 0));
+}
+
+static void
+report_behaviors(long* order, int top)
+/* count reachable actors and their retained cells, by behavior */
+{
+	BEH_STAT* b = (BEH_STAT*)alloc(n_node, sizeof(BEH_STAT));
+	long n = 0;
+	long m = 0;
+	long i;
+	WORD f;
+
+	for (i = 0; order[i] >= 0; ++i) {
+		if ((f = beh_of(order[i])) != 0) {
+			b[n].beh = f;
+			b[n].count = 1;
+			b[n].size = node[order[i]].size;
+			++n;
+		}
+	}
+	qsort(b, n, sizeof(BEH_STAT), cmp_beh);
+	for (i = 0; i < n; ++i) {
+		if ((m > 0) && (b[m - 1].beh == b[i].beh)) {
+			b[m - 1].count += b[i].count;
+			b[m - 1].size += b[i].size;
+		} else {
+			b[m++] = b[i];
+		}
+	}
+	qsort(b, m, sizeof(BEH_STAT), cmp_beh_size);
+	printf("\nbehaviors (%ld actors, %ld behaviors, retained cells may overlap):\n", n, m);
+	printf("%10s %10s  %s\n", "actors", "retained", "behavior");
+	for (i = 0; (i < m) && (i < top); ++i) {
+		printf("%10ld %10ld  %s\n", b[i].count, b[i].size, beh_name(b[i].beh));
+	}
+	free(b);
+}
+
+static int
+cmp_kid_size(const void* a, const void* b)
+{
+	long x = node[*(long*)a].size;
+	long y = node[*(long*)b].size;
+
+	return ((x > y) ? -1 : ((x < y) ? 1 : 0));
+}
+
+static void
+build_tree(long* order)
+/* group reachable cells under their immediate dominators, largest first */
+{
+	long* fill;
+	long i;
+	long v;
+
+	kid_base = (long*)alloc(n_node + 1, sizeof(long));
+	kids = (long*)alloc(n_node, sizeof(long));
+	for (i = 0; (v = order[i]) > 0; ++i) {	/* the super-root comes last */
+		++kid_base[node[v].idom + 1];
+	}
+	fill = compress_rows(kid_base, n_node);
+	for (i = 0; (v = order[i]) > 0; ++i) {
+		kids[fill[node[v].idom]++] = v;
+	}
+	free(fill);
+	for (i = 0; i < n_node; ++i) {
+		qsort(&kids[kid_base[i]], kid_base[i + 1] - kid_base[i], sizeof(long), cmp_kid_size);
+	}
+}
+
+static void
+print_tree(long v, int depth, int max_depth, int top, long min_size)
+/* print the dominator subtree of <v>, down to <max_depth> */
+{
+	long i;
+	WORD f;
+
+	if (v != 0) {
+		printf("%*s%ld %s %#lx", 2 * (depth - 1), "", node[v].size,
+			type_name[node[v].type], (unsigned long)node[v].addr);
+		if ((f = beh_of(v)) != 0) {
+			printf(" %s", beh_name(f));
+		}
+		if (node[v].flags & GC_SNAP_PERM) {
+			printf(" (perm)");
+		} else if (node[v].flags & GC_SNAP_OLD) {
+			printf(" (old)");
+		}
+		printf("\n");
+	}
+	if (depth >= max_depth) {
+		return;
+	}
+	for (i = kid_base[v]; (i < kid_base[v + 1]) && (i < kid_base[v] + top); ++i) {
+		if (node[kids[i]].size < min_size) {
+			break;		/* the rest are smaller */
+		}
+		print_tree(kids[i], depth + 1, max_depth, top, min_size);
+	}
+}
+
+static void
+usage()
+{
+	fprintf(stderr, "usage: heapsnap [-d depth] [-n top] snapshot [executable]\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char** argv)
+{
+	int max_depth = 4;
+	int top = 10;
+	long* order;
+	long live;
+	long count[N_TYPES];
+	long n_old = 0;
+	long i;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:n:")) != EOF) {
+		switch (c) {
+		case 'd':	max_depth = atoi(optarg);	break;
+		case 'n':	top = atoi(optarg);			break;
+		default:								usage();
+		}
+	}
+	if ((optind >= argc) || ((argc - optind) > 2)) {
+		usage();
+	}
+	read_snapshot(argv[optind]);
+	if ((optind + 1) < argc) {
+		read_symbols(argv[optind + 1]);
+	}
+	order = postorder();
+	live = dominators(order);
+	memset(count, 0, sizeof(count));
+	for (i = 0; order[i] > 0; ++i) {
+		++count[node[order[i]].type];
+	}
+	for (i = 1; i < n_node; ++i) {
+		n_old += ((node[i].flags & GC_SNAP_OLD) != 0);
+	}
+	printf("%ld cells (%ld permanent of %ld bytes, %ld old, others of %ld bytes)\n",
+		n_node - 1, n_perm, (long)perm_size, n_old, (long)cell_size);
+	printf("%ld reachable (%ld bytes), %ld garbage\n", live,
+		(live - n_perm) * (long)cell_size + n_perm * (long)perm_size,
+		(n_node - 1) - live);	/* permanent cells are all reachable */
+	for (i = 0; i < N_TYPES; ++i) {
+		printf("%10ld %s\n", count[i], type_name[i]);
+	}
+	report_behaviors(order, top);
+	build_tree(order);
+	printf("\ndominator tree (retained cells, type, address):\n");
+	print_tree(0, 0, max_depth, top, (live + 99) / 100);
+	return EXIT_SUCCESS;
+}
@@ -7,8 +7,15 @@ static char	_Program[] = "Kernel";
 static char	_Version[] = "2017-12-01";
 static char	_Copyright[] = "Copyright 2012-2017 Dale Schumacher";
 
+#define	_GNU_SOURCE		/* for sigaction() */
 #include <getopt.h>
+#include <signal.h>
+#include <limits.h>			/* INT_MAX */
 #include "kernel.h"
+#include "arena.h"
+#if ACTOR_WORK_STEALING
+#include <pthread.h>
+#endif
 
 #include "dbug.h"
 DBUG_UNIT("kernel");
@@ -20,6 +27,9 @@ DBUG_UNIT("kernel");
 #define	OPT_MATCH_PTREE		1
 
 static int M_limit = 1000 * 1000;  /* actor messaging dispatch limit */
+static BOOL K_compact = FALSE;  /* compact the heap after each top-level form */
+static long L_limit = 0;  /* most collectable cells (0 = no limit) */
+static char* S_file = NULL;  /* file to write GC statistics to at exit */
 
 static BEH_PROTO;	/* ==== GLOBAL ACTOR CONFIGURATION ==== */
 static FILE* input_file = NULL;
@@ -35,7 +45,7 @@ static CONS* a_ignore;
 static CONS* a_kernel_env;
 static CONS* a_ground_env;
 
-static CONS* intern_map;  /* pr(value->const, name->symbol) */
+static CONS* intern_map;  /* pr(value->const, name->weak symbol) */
 
 typedef CONS* (*LAMBDA_x)(CONS* x);
 typedef CONS* (*LAMBDA_x_y)(CONS* x, CONS* y);
@@ -332,8 +342,29 @@ file_next(SOURCE* src)
 	}
 	DBUG_RETURN d;
 }
+/**
+LET source_finalizer(src, f) = \#finalize.[
+	# close f (unless it is stdin), release src
+]
+**/
+static
+BEH_DECL(source_finalizer)
+{
+	SOURCE* src = (SOURCE*)(MK_PTR(hd(MINE)));
+	FILE* f = (FILE*)(MK_PTR(tl(MINE)));
+
+	DBUG_ENTER("source_finalizer");
+	if (WHAT == ATOM("finalize")) {
+		DBUG_PRINT("", ("src=%p f=%p", src, f));
+		if (f != stdin) {
+			fclose(f);
+		}
+		FREE(src);
+	}
+	DBUG_RETURN;
+}
 SOURCE*
-file_source(FILE* f)
+file_source(FILE* f)  /* THE SOURCE OWNS <f> ONCE ITS CONTEXT IS UNREACHABLE */
 {
 	SOURCE* src;
 
@@ -346,6 +377,7 @@ file_source(FILE* f)
 	src->empty = file_empty;
 	src->get = file_get;
 	src->next = file_next;
+	FINALIZE(src->context, source_finalizer, pr(MK_REF(src), MK_REF(f)));
 	DBUG_PRINT("context", ("%s", cons_to_str(src->context)));
 	DBUG_RETURN src;
 }
@@ -723,19 +755,26 @@ LET as_tuple(list) = (
 static CONS*
 as_tuple(CONS* list)
 {
+	CONS* v[LIST_BATCH];
+	CONS* p;
+	int n = 0;
+
 	DBUG_ENTER("as_tuple");
 	DBUG_PRINT("list", ("%s", cons_to_str(list)));
-	list = cons_value(list);
-	if (is_pr(list)) {
-		CONS* rest = as_tuple(tl(list));
-		if (rest == BOOLEAN(FALSE)) {
-			list = rest;  /* propagate failure */
-		} else {
-			list = pr(hd(list), rest);
-		}
+	p = cons_value(list);
+	while (is_pr(p) && (n < LIST_BATCH)) {
+		v[n++] = hd(p);
+		list = tl(p);
+		p = cons_value(list);
+	}
+	if (is_pr(p)) {
+		p = as_tuple(list);  /* the rest of a long list */
+	}
+	if (p != BOOLEAN(FALSE)) {  /* propagate failure */
+		p = gc_list(v, n, p);
 	}
-	DBUG_PRINT("result", ("%s", cons_to_str(list)));
-	DBUG_RETURN list;
+	DBUG_PRINT("result", ("%s", cons_to_str(p)));
+	DBUG_RETURN p;
 }
 #endif
 /**
@@ -1763,20 +1802,46 @@ BEH_DECL(symbol_type)
 	DBUG_RETURN;
 }
 
+#if ACTOR_WORK_STEALING
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;  /* behaviors may intern symbols */
+#endif
+
 static CONS*
 get_symbol(CONS* name)  /* USE FACTORY TO INTERN INSTANCES */
 {
-	CONS* symbol;
-	CONS* symbol_map = cdr(intern_map);
+	CONS* symbol = NIL;
+	CONS* prev;
+	CONS* map;
 
 	DBUG_ENTER("get_symbol");
 	DBUG_PRINT("name", ("%s", cons_to_str(name)));
-	symbol = map_get_def(symbol_map, name, NIL);
+#if ACTOR_WORK_STEALING
+	pthread_mutex_lock(&intern_lock);
+#endif
+	prev = intern_map;	/* symbol map entries are (name . weak symbol) */
+	map = cdr(prev);
+	while (!nilp(map)) {
+		CONS* entry = car(map);
+
+		if (gc_weak_cleared(cdr(entry))) {
+			map = cdr(map);
+			rplacd(prev, map);		/* unused symbol was reclaimed, drop its entry */
+			continue;
+		}
+		if (car(entry) == name) {
+			symbol = gc_weak_get(cdr(entry));
+			break;
+		}
+		prev = map;
+		map = cdr(map);
+	}
 	if (nilp(symbol)) {
 		symbol = ACTOR(symbol_type, name);
-		symbol_map = map_put(symbol_map, name, symbol);
-		rplacd(intern_map, symbol_map);
+		rplacd(intern_map, map_put(cdr(intern_map), name, gc_weak(symbol)));
 	}
+#if ACTOR_WORK_STEALING
+	pthread_mutex_unlock(&intern_lock);
+#endif
 	DBUG_PRINT("symbol", ("%s", cons_to_str(symbol)));
 	DBUG_RETURN symbol;
 }
@@ -3854,18 +3919,19 @@ BEH_DECL(time_type)
 	} else if (req == ATOM("write")) {
 		CONS* result = a_false;
 		SINK* sink = current_sink;
+		WORD t = tv_unbox(value);
 		char* s;
 		CONS* r;
 
 		r = (sink->put_cstr)(sink, "#time<");
 		if (r == a_true) {
-			s = printable(map_get_def(value, ATOM("s"), NUMBER(0)));
+			s = printable(NUMBER(t / NS_PER_SEC));
 			r = (sink->put_cstr)(sink, s);
 			FREE(s);
 			if (r == a_true) {
 				r = (sink->put)(sink, NUMBER(','));
 				if (r == a_true) {
-					s = printable(map_get_def(value, ATOM("us"), NUMBER(0)));
+					s = printable(NUMBER((t % NS_PER_SEC) / NS_PER_TICK));
 					r = (sink->put_cstr)(sink, s);
 					FREE(s);
 					if (r == a_true) {
@@ -3882,7 +3948,7 @@ BEH_DECL(time_type)
 }
 /**
 LET time_args_beh(cust, env) = \NIL.[  # no arguments
-	CREATE now WITH time_type(NOW)
+	CREATE now WITH time_type(box(NOW))
 	SEND now TO cust
 ]
 **/
@@ -3901,22 +3967,20 @@ BEH_DECL(time_args_beh)
 /*	env = tl(state); */
 	ENSURE(nilp(WHAT));
 
-	now = ACTOR(time_type, NOW);
+	now = ACTOR(time_type, tv_box(NOW));
 	DBUG_PRINT("now", ("%s", cons_to_str(now)));
 	SEND(cust, now);
 	DBUG_RETURN;
 }
-/* Determine elapsed time between raw time values, as an ABE number */
+/* Determine elapsed ticks between raw time values, as an ABE number */
 static CONS*
-time_diff(CONS* start, CONS* end)
+time_diff(WORD start, WORD end)
 {
-	long dt = 0;
+	WORD dt = (end - start) / NS_PER_TICK;
 
-	dt += MK_INT(map_get_def(end, ATOM("s"), NUMBER(0)));
-	dt -= MK_INT(map_get_def(start, ATOM("s"), NUMBER(0)));
-	dt *= TICK_FREQ;
-	dt += MK_INT(map_get_def(end, ATOM("us"), NUMBER(0)));
-	dt -= MK_INT(map_get_def(start, ATOM("us"), NUMBER(0)));
+	if (dt > INT_MAX) {
+		dt = INT_MAX;	/* largest ABE number */
+	}
 	return NUMBER((int)dt);
 }
 /**
@@ -3929,13 +3993,13 @@ BEH_DECL(timed_cust_beh)
 {
 	CONS* state = MINE;
 	CONS* cust;
-	CONS* start;
+	WORD start;
 
 	DBUG_ENTER("timed_cust_beh");
 	ENSURE(is_pr(state));
 	cust = hd(state);
 	ENSURE(actorp(cust));
-	start = tl(state);
+	start = tv_unbox(tl(state));
 
 	DBUG_PRINT("cust", ("%s", cons_to_str(cust)));
 	SEND(cust, get_number(time_diff(start, NOW)));
@@ -3945,7 +4009,7 @@ BEH_DECL(timed_cust_beh)
 LET timed_oper = \(cust, req).[  # derived from sequence_oper
 	CASE req OF
 	(#comb, opnds, env) : [
-		CREATE k_timed WITH timed_cust_beh(cust, NOW);
+		CREATE k_timed WITH timed_cust_beh(cust, box(NOW));
 		SEND (k_timed, #foldl, Inert, (\(x,y).y), #eval, env) TO opnds
 	]
 	_ : oper_type(cust, req)
@@ -3971,7 +4035,7 @@ BEH_DECL(timed_oper)
 	&& (hd(req) == ATOM("comb"))) {
 		CONS* opnds = hd(tl(req));
 		CONS* env = tl(tl(req));
-		CONS* k_timed = ACTOR(timed_cust_beh, pr(cust, NOW));
+		CONS* k_timed = ACTOR(timed_cust_beh, pr(cust, tv_box(NOW)));
 
 		SEND(opnds, pr(k_timed, pr(ATOM("foldl"),
 			pr(a_inert, pr(MK_FUNC(pair_tail), pr(ATOM("eval"), env))))));
@@ -3980,6 +4044,116 @@ BEH_DECL(timed_oper)
 	}
 	DBUG_RETURN;
 }
+/* Convert a counter to an ABE number, clamped like time_diff() */
+static CONS*
+stat_number(WORD n)
+{
+	if (n > INT_MAX) {
+		n = INT_MAX;	/* largest ABE number */
+	}
+	return NUMBER((int)n);
+}
+/* Prepend a (name . number) binding to a Kernel list */
+static CONS*
+stat_binding(char* name, WORD n, CONS* list)
+{
+	CONS* binding = ACTOR(pair_type, pr(get_symbol(ATOM(name)), get_number(stat_number(n))));
+
+	return ACTOR(pair_type, pr(binding, list));
+}
+/**
+LET heap_stats_args_beh(cust, env) = \NIL.[  # no arguments
+	SEND gc_get_stats() TO cust  # as an association list
+]
+**/
+static
+BEH_DECL(heap_stats_args_beh)
+{
+	CONS* state = MINE;
+	CONS* cust;
+	CONS* hist = a_nil;
+	CONS* list;
+	GC_STATS stats;
+	int i;
+
+	DBUG_ENTER("heap_stats_args_beh");
+	ENSURE(is_pr(state));
+	cust = hd(state);
+	ENSURE(actorp(cust));
+	ENSURE(nilp(WHAT));
+
+	gc_get_stats(&stats);
+	for (i = GC_PAUSE_BUCKETS; i > 0; --i) {
+		hist = ACTOR(pair_type, pr(get_number(stat_number(stats.pause_hist[i - 1])), hist));
+	}
+	list = ACTOR(pair_type, pr(ACTOR(pair_type, pr(get_symbol(ATOM("pause-hist")), hist)), a_nil));
+	list = stat_binding("pause-max-us", stats.pause_max_us, list);
+	list = stat_binding("pause-us", stats.pause_us, list);
+	list = stat_binding("pause-cnt", stats.pause_cnt, list);
+	list = stat_binding("compact-us", stats.compact_us, list);
+	list = stat_binding("sweep-us", stats.sweep_us, list);
+	list = stat_binding("mark-us", stats.mark_us, list);
+	list = stat_binding("start-us", stats.start_us, list);
+	list = stat_binding("alloc-rate", stats.alloc_rate, list);
+	list = stat_binding("free-cells", stats.free_cells, list);
+	list = stat_binding("heap-cells", stats.heap_cells, list);
+	list = stat_binding("cells-promoted", stats.cells_promoted, list);
+	list = stat_binding("weak-cleared", stats.weak_cleared, list);
+	list = stat_binding("cells-finalized", stats.cells_finalized, list);
+	list = stat_binding("cells-freed", stats.cells_freed, list);
+	list = stat_binding("cells-scanned", stats.cells_scanned, list);
+	list = stat_binding("cells-allocated", stats.cells_allocated, list);
+	list = stat_binding("full-collections", stats.full_collections, list);
+	list = stat_binding("major-cycles", stats.major_cycles, list);
+	list = stat_binding("cycles-completed", stats.cycles_completed, list);
+	list = stat_binding("cycles-started", stats.cycles_started, list);
+	SEND(cust, list);
+	DBUG_RETURN;
+}
+/**
+LET gc_collect_args_beh(cust, env) = \NIL.[  # no arguments
+	gc_request_collection()  # done before the next message is dispatched
+	SEND Inert TO cust
+]
+**/
+static
+BEH_DECL(gc_collect_args_beh)
+{
+	CONS* state = MINE;
+	CONS* cust;
+
+	DBUG_ENTER("gc_collect_args_beh");
+	ENSURE(is_pr(state));
+	cust = hd(state);
+	ENSURE(actorp(cust));
+	ENSURE(nilp(WHAT));
+
+	gc_request_collection();
+	SEND(cust, a_inert);
+	DBUG_RETURN;
+}
+/**
+LET heap_snapshot_args_beh(cust, env) = \NIL.[  # no arguments
+	gc_request_snapshot()  # written before the next message is dispatched
+	SEND Inert TO cust
+]
+**/
+static
+BEH_DECL(heap_snapshot_args_beh)
+{
+	CONS* state = MINE;
+	CONS* cust;
+
+	DBUG_ENTER("heap_snapshot_args_beh");
+	ENSURE(is_pr(state));
+	cust = hd(state);
+	ENSURE(actorp(cust));
+	ENSURE(nilp(WHAT));
+
+	gc_request_snapshot();
+	SEND(cust, a_inert);
+	DBUG_RETURN;
+}
 
 
 /**
@@ -3994,6 +4168,9 @@ CREATE False WITH bool_type(FALSE)
 
 ground_env("$timed") = NEW timed_oper
 ground_env("time-now") = NEW appl_type(NEW args_oper(time_args_beh))
+ground_env("heap-stats") = NEW appl_type(NEW args_oper(heap_stats_args_beh))
+ground_env("gc-collect") = NEW appl_type(NEW args_oper(gc_collect_args_beh))
+ground_env("heap-snapshot") = NEW appl_type(NEW args_oper(heap_snapshot_args_beh))
 ground_env("make-encapsulation-type") = NEW appl_type(NEW args_oper(brand_args_beh))
 ground_env("+") = NEW appl_type(NEW num_foldl_oper(0, num_plus_op))
 ground_env("*") = NEW appl_type(NEW num_foldl_oper(1, num_times_op))
@@ -4052,6 +4229,7 @@ init_kernel()
 	input_file = stdin;
 	output_file = stdout;
 	current_source = file_source(input_file);
+	cfg_add_gc_root(CFG, current_source->context);	/* protect from gc */
 	current_sink = file_sink(output_file);
 
 	a_inert = ACTOR(unit_type, NIL);
@@ -4086,6 +4264,15 @@ init_kernel()
 	ground_map = map_put(ground_map, ATOM("time-now"),
 		ACTOR(appl_type,
 			ACTOR(args_oper, MK_FUNC(time_args_beh))));
+	ground_map = map_put(ground_map, ATOM("heap-stats"),
+		ACTOR(appl_type,
+			ACTOR(args_oper, MK_FUNC(heap_stats_args_beh))));
+	ground_map = map_put(ground_map, ATOM("gc-collect"),
+		ACTOR(appl_type,
+			ACTOR(args_oper, MK_FUNC(gc_collect_args_beh))));
+	ground_map = map_put(ground_map, ATOM("heap-snapshot"),
+		ACTOR(appl_type,
+			ACTOR(args_oper, MK_FUNC(heap_snapshot_args_beh))));
 	ground_map = map_put(ground_map, ATOM("make-encapsulation-type"),
 		ACTOR(appl_type,
 			ACTOR(args_oper, MK_FUNC(brand_args_beh))));
@@ -4380,6 +4567,15 @@ run_repl(int batch)
 	for (;;) {
 		int remain = run_configuration(cfg, batch);
 
+		if ((remain < 0) && gc_heap_exhausted()) {
+			cfg_force_gc(cfg);  /* reclaim the cells of the dropped messages */
+			if (gc_heap_exhausted()) {	/* nothing can run under the limit */
+				fprintf(stderr, "\nLive cells exceed the heap limit of %ld cells\n", L_limit);
+				exit(EXIT_FAILURE);
+			}
+			THROW(pr(ATOM("OutOfMemory"), stat_number(L_limit)));
+			continue;
+		}
 		if (remain < 0) {
 			DBUG_PRINT("", ("%d messages queued (limit %d).", cfg->q_count, cfg->q_limit));
 			break;		/* abnormal return */
@@ -4498,24 +4694,31 @@ BEH_DECL(report_beh)
 static CONS*
 read_eval_print_loop(FILE* f, BOOL interactive)
 {
+	static int env_root = -1;
+	int src_root;
 	CONS* cust;
 	CONS* expr;
 	
 	DBUG_ENTER("read_eval_print_loop");
 	input_file = f;
 	current_source = file_source(input_file);
+	src_root = cfg_add_gc_root(CFG, current_source->context);	/* protect from gc */
 	/* each REPL gets a fresh environment stacked on previous definitions */
 	a_ground_env = ACTOR(env_type, pr(a_ground_env, NIL));
-	cfg_add_gc_root(CFG, a_ground_env);		/* protect from gc */
+	if (env_root >= 0) {
+		cfg_remove_gc_root(CFG, env_root);	/* reachable from the new environment */
+	}
+	env_root = cfg_add_gc_root(CFG, a_ground_env);	/* protect from gc */
 	for (;;) {
 		if (interactive) {
 			prompt();
 		}
 		expr = read_sexpr(current_source);
 		if (expr == NUMBER(EOF)) {
-			DBUG_RETURN a_inert;  /* end of input */
+			expr = a_inert;  /* end of input */
+			break;
 		} else if (!actorp(expr)) {
-			DBUG_RETURN expr;  /* error */
+			break;  /* error */
 		}
 		cust = a_sink;
 		if (interactive) {
@@ -4523,7 +4726,13 @@ read_eval_print_loop(FILE* f, BOOL interactive)
 		}
 		SEND(expr, pr(cust, pr(ATOM("eval"), a_ground_env)));  /* evaluate */
 		run_repl(M_limit);  /* actor dispatch loop */
+		if (K_compact) {
+			cfg_compact_gc(CFG);  /* only roots are held in C variables here */
+		}
 	}	
+	/* the source is finalized (and the file closed) once its context is collected */
+	cfg_remove_gc_root(CFG, src_root);
+	DBUG_RETURN expr;
 }
 
 /**
@@ -4968,7 +5177,7 @@ void
 usage(void)
 {
 	fprintf(stderr, "\
-usage: %s [-ti]  [-M message-limit] [-# dbug] file...\n",
+usage: %s [-tiPK]  [-M message-limit] [-T threads] [-S stats-file] [-H cells] [-L cells] [-G percent] [-C kbytes] [-# dbug] file...\n",
 		_Program);
 	exit(EXIT_FAILURE);
 }
@@ -4979,20 +5188,39 @@ banner(void)
 	printf("%s v%s -- %s\n", _Program, _Version, _Copyright);
 }
 
+static void
+snapshot_signal(int sig)
+/* SIGUSR1 asks for a heap snapshot between messages */
+{
+	gc_request_snapshot();
+}
+
 int
 main(int argc, char** argv)
 {
 	int c;
 	BOOL test_mode = FALSE;			/* flag to run unit tests */
 	BOOL interactive = FALSE;		/* flag to run unit tests */
+	long heap_cells = 0;			/* cells to pre-allocate */
+	long commit_kb = 0;				/* arena commit size (0 = default) */
+	BOOL huge_pages = FALSE;		/* flag to advise huge pages */
+	struct sigaction sa;
 
 	DBUG_ENTER("main");
 	DBUG_PROCESS(argv[0]);
-	while ((c = getopt(argc, argv, "tiM:#:V")) != EOF) {
+	while ((c = getopt(argc, argv, "tiPKS:M:T:H:L:G:C:#:V")) != EOF) {
 		switch(c) {
 		case 't':	test_mode = TRUE;		break;
 		case 'i':	interactive = TRUE;		break;
+		case 'P':	huge_pages = TRUE;		break;
+		case 'K':	K_compact = TRUE;		break;
+		case 'S':	S_file = optarg;		break;
 		case 'M':	M_limit = atoi(optarg);	break;
+		case 'T':	cfg_set_dispatch_threads(atoi(optarg));	break;
+		case 'H':	heap_cells = atol(optarg);	break;
+		case 'L':	L_limit = atol(optarg);	break;
+		case 'G':	gc_set_heap_growth(atol(optarg));	break;
+		case 'C':	commit_kb = atol(optarg);	break;
 		case '#':	DBUG_PUSH(optarg);		break;
 		case 'V':	banner();				exit(EXIT_SUCCESS);
 		case '?':							usage();
@@ -5000,6 +5228,17 @@ main(int argc, char** argv)
 		}
 	}
 	banner();
+	if ((commit_kb > 0) || huge_pages) {
+		arena_set_commit((commit_kb > 0) ? ((size_t)commit_kb << 10) : ARENA_COMMIT, huge_pages);
+	}
+	if (heap_cells > 0) {
+		gc_presize_heap(heap_cells);	/* avoid growth stalls */
+	}
+	gc_set_heap_limit(L_limit);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = snapshot_signal;
+	sa.sa_flags = SA_RESTART;		/* don't interrupt reading the input */
+	sigaction(SIGUSR1, &sa, NULL);
 	CFG = new_configuration(1000);
 	init_kernel();  /* ==== INITIALIZE GLOBAL CONFIGURATION ==== */
 	if (test_mode) {
@@ -5016,8 +5255,7 @@ main(int argc, char** argv)
 			exit(EXIT_FAILURE);
 		}
 		fprintf(output_file, "Loading %s\n", filename);
-		read_eval_print_loop(f, FALSE);
-		fclose(f);
+		read_eval_print_loop(f, FALSE);  /* closes f, see source_finalizer */
 	}
 	if (interactive) {
 		fprintf(output_file, "Entering INTERACTIVE mode.\n");
@@ -5026,6 +5264,16 @@ main(int argc, char** argv)
 		report_actor_usage(CFG);
 	}
 	report_cons_stats();
+	if (S_file != NULL) {
+		FILE* f = fopen(S_file, "w");
+
+		if (f == NULL) {
+			perror(S_file);
+		} else {
+			gc_dump_stats(f);  /* JSON */
+			fclose(f);
+		}
+	}
 
 	DBUG_RETURN (exit(EXIT_SUCCESS), 0);
 }
@@ -13,40 +13,71 @@ typedef ptrdiff_t WORD;
 typedef unsigned int uint;
 typedef unsigned long int ulint;
 
+#ifndef GC_COMPRESSED_REFS
+#define	GC_COMPRESSED_REFS 0	/* 1 = cells hold 32-bit references, see gc.h */
+#endif
+
 typedef struct cons CONS;
+#if GC_COMPRESSED_REFS
+typedef unsigned int REF;	/* encoded value, see gc_encode() */
+#else
+typedef CONS* REF;
+#endif
 struct cons {
-	CONS*	first;
-	CONS*	rest;
+	REF		first;
+	REF		rest;
 };
 
 typedef struct cell CELL;
 struct cell {
-	CONS*	first;		/* user-visible pointer to first list element */
-	CONS*	rest;		/* user-visible pointer to the rest of the list */
+	REF		first;		/* user-visible pointer to first list element */
+	REF		rest;		/* user-visible pointer to the rest of the list */
 	WORD	_prev;		/* private pointer to previous cell in gc chain */
 	WORD	_next;		/* private pointer to next cell in gc chain */
 };
 
+typedef struct message MESSAGE;
+struct message {
+	CONS*	target;		/* actor the message is delivered to */
+	CONS*	msg;		/* message content */
+};
+
+typedef struct post POST;
+struct post {
+	POST* volatile	next;	/* next (newer) message posted, see cfg_post() */
+	MESSAGE	m;			/* message posted */
+};
+
+typedef struct timer_wheel TIMER_WHEEL;	/* see actor.c */
+
 typedef struct config CONFIG;
 struct config {
-	CELL	msg_queue;	/* must be first member to make CONFIG_QUEUE() macro work */
-	CONS*	gc_root;	/* root reference to preserve during garbage collection */
+	MESSAGE*	q_ring;	/* ring buffer of messages waiting in the queue */
+	int		q_size;		/* number of slots allocated for q_ring (power of 2) */
+	int		q_head;		/* slot of the oldest message waiting in q_ring */
+	CONS**	gc_roots;	/* root references to preserve during garbage collection */
+	int		gc_root_cnt;	/* number of slots used in gc_roots */
+	int		gc_root_max;	/* number of slots allocated for gc_roots */
+	int		gc_root_free;	/* first free slot in gc_roots, or -1 */
 	int		q_count;	/* number of messages waiting in the message queue */
-	CONS*	q_entry;	/* (detached) queue entry for message being delivered */
+	MESSAGE	q_entry;	/* (dequeued) message being delivered */
 	int		msg_cnt_hi;	/* total number of messages delivered (hi 31 bits) */
 	int		msg_cnt_lo;	/* total number of messages delivered (lo 31 bits) */
 	int		q_limit;	/* maximum number of messages waiting in queue */
-	time_t	t_epoch;	/* starting value for seconds */
-	time_t	t_now_s;	/* current time (seconds) */
-	time_t	t_now_us;	/* current time (microseconds) */
-	CONS*	t_queue;	/* timer queue for delivery of delayed messages */
-	int		t_count;	/* number of delayed messages in timer queue */
+	WORD	t_epoch;	/* monotonic clock at creation (nanoseconds) */
+	WORD	t_now;		/* current time (nanoseconds since t_epoch) */
+	TIMER_WHEEL*	t_wheel;	/* delayed messages by delivery time */
+	int		t_count;	/* number of delayed messages in t_wheel */
+	POST* volatile	in_head;	/* newest message posted by another thread */
+	POST*	in_tail;	/* oldest posted message not yet queued */
+	POST	in_stub;	/* placeholder keeping the posted messages linked */
 };
 
 #define	as_int(p)	((int)(p))
 #define	as_ptr(p)	((void*)(p))
 #define	as_word(p)	((WORD)(p))
 #define	as_cons(p)	((CONS*)(p))
+#define	as_ref(p)	((REF)(p))
 #define	as_cell(p)	((CELL*)(p))
 #define	as_bool(p)	((BOOL)(p))
 